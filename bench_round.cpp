@@ -0,0 +1,72 @@
+// Timing of floor, ceil and round on every backend that the CPU supports, in 32 independent
+// calls and in a dependent chain of 32 calls. Build and run it with e.g.
+//     g++ -std=c++14 -O2 bench_round.cpp -o bench_round && ./bench_round
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include "mexce.h"
+
+using std::string;
+using std::to_string;
+
+namespace {
+
+const int calls = 32;
+
+
+// The best of 5 runs, in ns per call of the function
+double time_expression(mexce::backend b, const string& expression, double* sum)
+{
+    double x = 0.3;
+    mexce::evaluator ev;
+    ev.bind(x, "x");
+    ev.set_backend(b);
+    ev.set_expression(expression);
+
+    double best = 1e300;
+    for (int rep = 0; rep < 5; rep++) {
+        auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < 1000000; i++) {
+            x += 0.001;
+            *sum += ev.evaluate();
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::nano>(t1 - t0).count() / 1e6 / calls);
+    }
+    return best;
+}
+
+}
+
+
+int main()
+{
+    double sum = 0;
+    printf("%-6s %-6s %12s %12s\n", "", "", "independent", "chain");
+    for (auto b : { mexce::backend::x87, mexce::backend::sse2, mexce::backend::avx }) {
+        try {
+            mexce::evaluator ev;
+            ev.set_backend(b);
+        }
+        catch (std::logic_error&) {
+            continue;
+        }
+        const char* backend_name = b == mexce::backend::x87 ? "x87" : b == mexce::backend::sse2 ? "sse2" : "avx";
+
+        for (string f : { "floor", "ceil", "round" }) {
+            // f(x*1.37) + f(x*2.37) + ..., and f(f(...f(x+0.3)...)+0.3)
+            string independent = "0", chain = "x";
+            for (int i = 0; i < calls; i++) {
+                independent += "+" + f + "(x*" + to_string(i + 1) + ".37)";
+                chain = f + "(" + chain + "+0.3)";
+            }
+            double t_independent = time_expression(b, independent, &sum);
+            double t_chain       = time_expression(b, chain, &sum);
+            printf("%-6s %-6s %9.2f ns %9.2f ns\n", backend_name, f.c_str(), t_independent, t_chain);
+        }
+    }
+    printf("(%g)\n", sum);
+    return 0;
+}
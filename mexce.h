@@ -6,7 +6,9 @@
 // Author: Ioannis Makris
 //
 // mexce can compile and evaluate a mathematical expression at runtime.
-// The generated machine code will mostly use the x87 FPU.
+// By default, the generated machine code will mostly use the x87 FPU. On x64,
+// scalar SSE2 or AVX code can be generated instead (see evaluator::set_backend).
+// To evaluate an expression over arrays of values, see evaluator::evaluate_batch.
 //
 // An example:
 // -----------
@@ -32,16 +34,22 @@
 #define MEXCE_INCLUDED
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cinttypes>
 #include <cmath>
 #include <cstring>
 #include <deque>
 #include <exception>
+#include <initializer_list>
 #include <iomanip>
+#include <limits>
 #include <list>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <set>
 #include <sstream>
 #include <string>
 #include <tuple>
@@ -59,8 +67,14 @@
 #ifdef _WIN32
     #include <Windows.h>
 #elif defined(__linux__)
-    //#include <unistd.h>
     #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+#ifdef _MSC_VER
+    #include <intrin.h>
+#else
+    #include <cpuid.h>
 #endif
 
 
@@ -71,14 +85,63 @@ namespace mexce {
 class evaluator;
 
 
+// The instruction set of the generated code
+enum class backend
+{
+    x87,    // x87 FPU (the default, and the only backend available on 32-bit x86)
+    sse2,   // scalar SSE2, x64 only
+    avx     // scalar AVX (VEX-encoded SSE2 operations), x64 only
+};
+
+
+// The accuracy of sin, cos, tan, exp, the logarithms and pow, in the code of the SSE/AVX
+// backends (the x87 backend always uses the x87 instructions)
+enum class accuracy
+{
+    fast,       // shorter polynomials, without the extra precision steps: about 1e-13 relative error
+    standard,   // polynomials within about 1-2 ULP (the default)
+    precise     // the x87 instructions, which compute with 64-bit significands (but sin, cos
+                // and tan are computed as with standard, which reduces the argument more exactly)
+};
+
+
+// The values of a variable in a batch (see evaluator::evaluate_batch). The value of row i
+// is read from (const char*)data + i * stride, where stride may be negative to read an array
+// from its end, and T must be the type the variable was bound with.
+struct column
+{
+    template <typename T>
+    column(const std::string& variable_name, const T* data, ptrdiff_t stride = sizeof(T));
+
+    std::string     variable_name;
+    const void*     data;
+    ptrdiff_t       stride;
+    int             numeric_data_type;
+};
+
+
+// The rewrites of the peephole pass over the x87 code of an expression (see
+// evaluator::get_peephole_counters), by kind
+struct peephole_counters
+{
+    size_t loads_discarded      = 0;    // a load that is popped right away
+    size_t copies_folded        = 0;    // fld st(0) folded into the operation that takes it
+    size_t exchanges_removed    = 0;    // fxch pairs, and fxch folded into the operation after it
+    size_t addresses_reused     = 0;    // loads of eax/rax with the address it holds, or that is not used
+    size_t stores_forwarded     = 0;    // a temporary that is loaded right after it is stored, copied instead
+};
+
+
 namespace impl {
 
     struct Element;
     struct Value;
     struct Constant;
     struct Variable;
+    struct Temporary;
     struct Function;
     struct mexce_charstream;
+    struct Column_cursor;
 
     using std::abs;
     using std::deque;
@@ -93,19 +156,69 @@ namespace impl {
     using std::next;
     using std::pair;
     using std::shared_ptr;
-    using std::static_pointer_cast;
     using std::string;
     using std::stringstream;
     using std::vector;
 
     using constant_map_t    = map<string, shared_ptr<Constant> >;
     using variable_map_t    = map<string, shared_ptr<Variable> >;
-    using elist_t           = list<shared_ptr<Element> >;
+    using elist_t           = list<Element*>;
     using elist_it_t        = elist_t::iterator;
     using elist_const_it_t  = elist_t::const_iterator;
 
-    std::shared_ptr<Constant> make_intermediate_constant(evaluator* ev, double v);
+    Constant* make_intermediate_constant(evaluator* ev, double v);
+    Function* make_function(evaluator* ev, const Function& f);
+    Temporary* make_temporary(evaluator* ev, int32_t index);
     uint8_t* push_intermediate_code(evaluator* ev, const std::string& s);
+
+
+    // Owns the elements that an expression is compiled from, which the element lists refer
+    // to by pointer. They are constructed in large blocks and destroyed all together, when
+    // the expression changes. The variables of the expression are kept alive here as well,
+    // in case they are unbound or rebound before the expression is compiled again.
+    class Element_arena
+    {
+    public:
+        Element_arena() = default;
+        Element_arena(const Element_arena&) = delete;
+        Element_arena& operator=(const Element_arena&) = delete;
+        ~Element_arena() { clear(); }
+
+        template <typename T, typename... Args>
+        T* make(Args&&... args)
+        {
+            size_t offset = (m_used + alignof(T) - 1) & ~(alignof(T) - 1);
+            if (m_blocks.empty() || offset + sizeof(T) > block_size) {
+                m_blocks.emplace_back(new char[block_size]);
+                offset = 0;
+            }
+            T* p = new (m_blocks.back().get() + offset) T(std::forward<Args>(args)...);
+            m_used = offset + sizeof(T);
+            m_destructors.push_back(make_pair((void*)p, [](void* q) { static_cast<T*>(q)->~T(); }));
+            return p;
+        }
+
+        void retain(shared_ptr<const void> p) { m_retained.push_back(std::move(p)); }
+
+        void clear()
+        {
+            for (auto& d : m_destructors) {
+                d.second(d.first);
+            }
+            m_destructors.clear();
+            m_retained.clear();
+            m_blocks.resize(std::min(m_blocks.size(), (size_t)1));
+            m_used = 0;
+        }
+
+    private:
+        static const size_t block_size = 16384;
+
+        vector<std::unique_ptr<char[]> >        m_blocks;
+        size_t                                  m_used = 0;
+        vector<pair<void*, void (*)(void*)> >   m_destructors;
+        vector<shared_ptr<const void> >         m_retained;
+    };
 }
 
 
@@ -120,39 +233,145 @@ public:
     template <typename T, typename ...Args>
     void bind(T& referenced_variable, const std::string& variable_name, Args&... args);
 
+    // Binds a variable of type T that is not at a fixed address, but at offset bytes from
+    // a context pointer, which is passed to evaluate_in. The same compiled expression
+    // can then be evaluated for any number of records with that layout.
+    template <typename T>
+    void bind_offset(size_t offset, const std::string& variable_name);
+
+    // Binds a member of struct S, at its offset (see bind_offset), e.g. bind_member(&Row::price, "price").
+    // The expression can then be evaluated for a single S with evaluate_in, or for an array of S
+    // with evaluate_batch.
+    template <typename S, typename T>
+    void bind_member(T S::* member, const std::string& variable_name);
+
+    // Allocates a variable of type T, initialized to T(), in the variable block of the evaluator,
+    // and binds it, e.g. double& x = eval.var<double>("x"). The block is contiguous and aligned
+    // to a cache line, and the generated code addresses it from a register, with 8- or 32-bit
+    // displacements. The reference is valid for the lifetime of the evaluator. If variable_name
+    // is already a variable of the block, of the same type, it is returned instead. Throws
+    // std::logic_error if it is a variable of the block of another type, or if the block
+    // (of 4 KiB) is full.
+    template <typename T>
+    T& var(const std::string& variable_name);
+
     template <typename ...Args>
     void unbind(const std::string& variable_name, Args&... args);
 
     void unbind_all();
 
+    // Selects the instruction set of the generated code and recompiles the current
+    // expression. Throws std::logic_error if the CPU does not support it.
+    void set_backend(mexce::backend b);
+
+    // Selects the accuracy of the transcendental functions (see mexce::accuracy) and
+    // recompiles the current expression.
+    void set_accuracy(mexce::accuracy a);
+
+    // Allows the optimizations that change the result for some values of the variables, and
+    // recompiles the current expression: simplifications such as sqrt(x*x) = abs(x), which
+    // differs where x*x overflows, sums and products evaluated as balanced trees, division by
+    // a constant as multiplication by its reciprocal, and a*b+c as a fused multiply-add (with
+    // the AVX backend, on CPUs with FMA).
+    void set_fast_math(bool enabled);
+    bool get_fast_math() const { return m_fast_math; }
+
     void set_expression(std::string);
 
+    // Sets several expressions, e.g. related formulas of the same variables, which are compiled
+    // into one function that computes all of them. The subexpressions that they have in common
+    // are computed once. The result of the i-th expression is written to out[i] by evaluate(out)
+    // and evaluate_in(context, out), and to out[i*n + row] by evaluate_batch. If an expression
+    // does not compile, it throws, and the evaluator keeps the previous expressions.
+    void set_expressions(const std::vector<std::string>& expressions);
+
+    // The generated code only uses registers and its own stack frame, so evaluate() and
+    // evaluate_batch() may be called from several threads at once, as long as the
+    // expression, the backend and the bindings are not changed meanwhile.
     double evaluate();
 
+    // Evaluates the expression, reading the variables that were bound with bind_offset
+    // from the given context. (It is not an overload of evaluate, which would take string literals.)
+    double evaluate_in(const void* context);
+
+    // Evaluates the expressions (see set_expressions) and writes their results to out.
+    void evaluate(double* out);
+    void evaluate_in(const void* context, double* out);
+
+    // Evaluates an expression once, with the variables, backend and settings of the evaluator,
+    // without changing its own expressions.
     double evaluate(const std::string& expression);
 
+    // Evaluates the expression for n rows and writes the results to out. The variables
+    // listed in inputs are read from their columns, the rest keep their current value
+    // in all rows. The loop is part of the generated code, which is compiled on the
+    // first call after the expression is set.
+    void evaluate_batch(size_t n, std::initializer_list<column> inputs, double* out);
+
+    // Evaluates the expression for n records, which start at records and are stride bytes
+    // apart, e.g. an array of the struct whose members were bound with bind_member. The
+    // variables bound at an offset are read from each record, the rest as above.
+    void evaluate_batch(size_t n, const void* records, ptrdiff_t stride, double* out,
+        std::initializer_list<column> inputs = {});
+
+    // The rewrites of the peephole pass over the x87 code of the current expression, and
+    // of its batch kernel, once that is compiled
+    const peephole_counters& get_peephole_counters() const { return m_peephole_counters; }
+
 private:
 
     bool                    is_constant_expression      = false;
     double                  constant_expression_value   = 0.0;
     size_t                  m_buffer_size               = 0;
-    std::string             m_expression;
+    std::vector<std::string> m_expressions;
     impl::elist_t           m_elist;
+    std::vector<impl::elist_it_t> m_roots;              // the last element of each expression in m_elist
+    int32_t                 m_num_temporaries           = 0;
+    peephole_counters       m_peephole_counters;
     std::list<std::string>  m_intermediate_code;
-    impl::constant_map_t    m_intermediate_constants;  // produced during expression simplification
+    impl::Element_arena     m_arena;                    // the elements of m_elist
+    std::map<uint64_t, impl::Constant*> m_intermediate_constants;  // produced during expression simplification, by their bits
     impl::variable_map_t    m_variables;
     impl::constant_map_t    m_constants;
+    mexce::backend          m_backend                   = backend::x87;
+    mexce::accuracy         m_accuracy                  = accuracy::standard;
+    bool                    m_fast_math                 = false;
+
+    using evaluate_fptr_t = double (*)(const void*);
+    evaluate_fptr_t         evaluate_fptr               = nullptr;
+    using evaluate_all_fptr_t = void (*)(const void*, double*);
+    evaluate_all_fptr_t     evaluate_all_fptr           = nullptr;  // instead of evaluate_fptr, with several expressions
+    bool                    m_uses_context              = false;    // the expression has variables bound at an offset
+    bool                    m_uses_block                = false;    // the expression has variables in the variable block
+
+    // the variable block (see var), aligned to a cache line
+    static const size_t     variable_block_size         = 4096;
+    std::unique_ptr<char[]> m_variable_block;
+    char*                   m_variable_block_base       = nullptr;
+    size_t                  m_variable_block_used       = 0;
+
+    // the batch kernel, and the variables of the expression, in the order of their cursors
+    using batch_fptr_t = void (*)(size_t, impl::Column_cursor*, double*);
+    std::atomic<batch_fptr_t> m_batch_fptr{nullptr};
+    std::mutex              m_batch_mutex;              // serializes the compilation of the batch kernel
+    size_t                  m_batch_buffer_size         = 0;
+    std::vector<impl::Variable*> m_batch_variables;
+
+    void check_variable_name(const std::string& variable_name) const;
+    impl::elist_t parse(std::string expression);
+    void compile_expressions(const std::vector<std::string>& expressions);
+    void compile_and_finalize_elist(impl::elist_it_t first, impl::elist_it_t last, mexce::backend b);
+    void compile_and_finalize_outputs();
+    void compile_batch_kernel();
 
-    double                (*evaluate_fptr)();
-
-#ifdef MEXCE_64
-    volatile double         m_x64_return_var;
-#endif
+    friend
+    impl::Constant* impl::make_intermediate_constant(evaluator* ev, double v);
 
-    void compile_and_finalize_elist(impl::elist_it_t first, impl::elist_it_t last);
+    friend
+    impl::Function* impl::make_function(evaluator* ev, const impl::Function& f);
 
     friend
-    std::shared_ptr<impl::Constant> impl::make_intermediate_constant(evaluator* ev, double v);
+    impl::Temporary* impl::make_temporary(evaluator* ev, int32_t index);
 
     friend
     uint8_t* impl::push_intermediate_code(evaluator* ev, const std::string& s);
@@ -183,8 +402,13 @@ protected:
 inline
 double evaluator::evaluate(const std::string& expression)
 {
+    // the variables of the block stay where they are, in the block of this evaluator
     evaluator ev;
-    ev.m_variables = m_variables;
+    ev.m_variables              = m_variables;
+    ev.m_variable_block_base    = m_variable_block_base;
+    ev.m_backend                = m_backend;
+    ev.m_accuracy               = m_accuracy;
+    ev.m_fast_math              = m_fast_math;
     ev.set_expression(expression);
     return ev.evaluate();
 }
@@ -202,50 +426,328 @@ size_t get_page_size()
     GetSystemInfo(&system_info);
     return system_info.dwPageSize;
 }
+#else
+inline
+size_t get_page_size()
+{
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
 #endif
 
 
-inline
-uint8_t* get_executable_buffer(size_t sz)
+// Executable memory, shared by all the evaluators. Code is packed into regions of 1 MiB or
+// more, instead of taking a page (and a mapping) per function. Each region is mapped twice,
+// once writable and once executable, so that no page is both, and new code is written to
+// the free blocks of a region while the rest of it may be running in other threads.
+// Freed blocks are merged with their free neighbours and reused, and a region is unmapped
+// when all of it is free (except for the last one).
+// If the system does not allow the double mapping, each block gets its own mapping instead.
+struct Code_arena
 {
+    static const size_t region_size = 1 << 20;
+    static const size_t alignment   = 64;
+
+    struct Region
+    {
+        uint8_t*    writable;
+        size_t      size;
+    };
+
+    std::mutex                      mutex;
+    map<uint8_t*, Region>           regions;            // by executable address
+    map<uint8_t*, size_t>           free_blocks;        // by executable address
+    std::multimap<size_t, uint8_t*> free_by_size;
+    bool                            double_mapping = true;
+
+    static Code_arena& instance()
+    {
+        // never destroyed, since evaluators with static storage may outlive it
+        static Code_arena* arena = new Code_arena;
+        return *arena;
+    }
+
+    // maps a region twice - returns false if the system does not allow it
+    static bool map_region(size_t size, uint8_t*& writable, uint8_t*& executable)
+    {
 #ifdef _WIN32
-    static auto const page_size = get_page_size();
-    return (uint8_t*)VirtualAlloc(nullptr, page_size, MEM_COMMIT, PAGE_READWRITE);
-#elif defined(__linux__)
-    return (uint8_t*)mmap(0, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        HANDLE h = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_EXECUTE_READWRITE,
+            DWORD(uint64_t(size) >> 32), DWORD(size), nullptr);
+        if (!h) {
+            return false;
+        }
+        writable   = (uint8_t*)MapViewOfFile(h, FILE_MAP_WRITE, 0, 0, size);
+        executable = (uint8_t*)MapViewOfFile(h, FILE_MAP_READ | FILE_MAP_EXECUTE, 0, 0, size);
+        CloseHandle(h);                                 // the views keep the section
+        if (writable && executable) {
+            return true;
+        }
+        if (writable)   UnmapViewOfFile(writable);
+        if (executable) UnmapViewOfFile(executable);
+        return false;
+#elif defined(MFD_CLOEXEC)
+        int fd = memfd_create("mexce", MFD_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        void* w = MAP_FAILED;
+        void* x = MAP_FAILED;
+        if (ftruncate(fd, (off_t)size) == 0) {
+            w = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            x = mmap(nullptr, size, PROT_READ | PROT_EXEC,  MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (w != MAP_FAILED && x != MAP_FAILED) {
+            writable   = (uint8_t*)w;
+            executable = (uint8_t*)x;
+            return true;
+        }
+        if (w != MAP_FAILED) munmap(w, size);
+        if (x != MAP_FAILED) munmap(x, size);
+        return false;
+#else
+        (void)size; (void)writable; (void)executable;
+        return false;
 #endif
-}
+    }
 
+    static void unmap_region(uint8_t* writable, uint8_t* executable, size_t size)
+    {
+#ifdef _WIN32
+        (void)size;
+        UnmapViewOfFile(writable);
+        UnmapViewOfFile(executable);
+#else
+        munmap(writable, size);
+        munmap(executable, size);
+#endif
+    }
 
-inline
-double (*lock_executable_buffer(uint8_t* buffer, size_t sz))()
-{
+    // a mapping of its own, for when the double mapping is not available
+    static uint8_t* map_single(const string& code)
+    {
 #ifdef _WIN32
-    DWORD dummy;
-    VirtualProtect(buffer, sz, PAGE_EXECUTE_READ, &dummy);
-#elif defined(__linux__)
-    if (mprotect((void*) buffer, sz, PROT_EXEC) != 0) {
-        buffer = 0;
+        auto buffer = (uint8_t*)VirtualAlloc(nullptr, code.size(), MEM_COMMIT, PAGE_READWRITE);
+        if (!buffer) {
+            return nullptr;
+        }
+        memcpy(buffer, code.data(), code.size());
+        DWORD dummy;
+        VirtualProtect(buffer, code.size(), PAGE_EXECUTE_READ, &dummy);
+        return buffer;
+#else
+        void* buffer = mmap(0, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED) {
+            return nullptr;
+        }
+        memcpy(buffer, code.data(), code.size());
+        if (mprotect(buffer, code.size(), PROT_READ | PROT_EXEC) != 0) {
+            munmap(buffer, code.size());
+            return nullptr;
+        }
+        return (uint8_t*)buffer;
+#endif
     }
+
+    static void unmap_single(uint8_t* buffer, size_t size)
+    {
+#ifdef _WIN32
+        (void)size;
+        VirtualFree(buffer, 0, MEM_RELEASE);
+#else
+        munmap(buffer, size);
 #endif
-    return reinterpret_cast<double (*)()>(buffer);
+    }
+
+    static size_t block_size(size_t size) { return (size + alignment - 1) & ~(alignment - 1); }
+
+    void insert_free_block(uint8_t* p, size_t size)
+    {
+        free_blocks[p] = size;
+        free_by_size.insert(make_pair(size, p));
+    }
+
+    void erase_free_block(map<uint8_t*, size_t>::iterator it)
+    {
+        auto range = free_by_size.equal_range(it->second);
+        for (auto s = range.first; s != range.second; s++) {
+            if (s->second == it->first) {
+                free_by_size.erase(s);
+                break;
+            }
+        }
+        free_blocks.erase(it);
+    }
+
+    // the region that contains p, or regions.end()
+    map<uint8_t*, Region>::iterator region_of(const uint8_t* p)
+    {
+        auto it = regions.upper_bound((uint8_t*)p);
+        if (it == regions.begin()) {
+            return regions.end();
+        }
+        --it;
+        return p < it->first + it->second.size ? it : regions.end();
+    }
+
+    // Copies code to executable memory and returns its address, or null on failure
+    uint8_t* allocate(const string& code)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        size_t size = block_size(code.size());
+        auto fit = free_by_size.lower_bound(size);
+        if (fit == free_by_size.end() && double_mapping) {
+            size_t page = get_page_size();
+            size_t rsize = std::max((size_t)region_size, (size + page - 1) / page * page);
+            uint8_t *writable, *executable;
+            if (map_region(rsize, writable, executable)) {
+                regions[executable] = Region{ writable, rsize };
+                insert_free_block(executable, rsize);
+                fit = free_by_size.lower_bound(size);
+            }
+            else {
+                double_mapping = false;
+            }
+        }
+        if (fit == free_by_size.end()) {
+            return map_single(code);
+        }
+
+        uint8_t* p = fit->second;
+        size_t available = fit->first;
+        erase_free_block(free_blocks.find(p));
+        if (available > size) {
+            insert_free_block(p + size, available - size);
+        }
+        auto r = region_of(p);
+        memcpy(r->second.writable + (p - r->first), code.data(), code.size());
+        return p;
+    }
+
+    void free(const void* code, size_t size)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        uint8_t* p = (uint8_t*)code;
+        auto r = region_of(p);
+        if (r == regions.end()) {
+            unmap_single(p, size);
+            return;
+        }
+
+        // merge with the free neighbours in the same region
+        size = block_size(size);
+        auto next = free_blocks.lower_bound(p);
+        if (next != free_blocks.end() && next->first == p + size &&
+            next->first < r->first + r->second.size)
+        {
+            size += next->second;
+            erase_free_block(next);
+        }
+        auto prev = free_blocks.lower_bound(p);
+        if (prev != free_blocks.begin()) {
+            --prev;
+            if (prev->first + prev->second == p && prev->first >= r->first) {
+                p = prev->first;
+                size += prev->second;
+                erase_free_block(prev);
+            }
+        }
+
+        if (size == r->second.size && regions.size() > 1) {
+            unmap_region(r->second.writable, r->first, size);
+            regions.erase(r);
+            return;
+        }
+        insert_free_block(p, size);
+    }
+};
+
+
+// Copies code to executable memory, and returns it as a function of type F (null on failure)
+template <typename F>
+F copy_to_executable_buffer(const string& code)
+{
+    return reinterpret_cast<F>(Code_arena::instance().allocate(code));
 }
 
 
-inline
-void free_executable_buffer(double (*buffer)(), size_t sz)
+// F is the type of the function pointer, which depends on the kind of the generated code
+template <typename F>
+void free_executable_buffer(F buffer, size_t sz)
 {
     if (!buffer) {
         return;
     }
-#ifdef _WIN32
-    VirtualFree( (void*) buffer, 0, MEM_RELEASE);
-#elif defined(__linux__)
-    munmap((void *) buffer, sz);
+    Code_arena::instance().free((const void*)buffer, sz);
+}
+
+
+struct Cpu_features
+{
+    bool sse41      = false;
+    bool avx        = false;
+    bool avx2       = false;
+    bool fma        = false;
+    bool avx512f    = false;
+};
+
+
+inline
+void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t r[4])
+{
+#ifdef _MSC_VER
+    __cpuidex((int*)r, (int)leaf, (int)subleaf);
+#else
+    __cpuid_count(leaf, subleaf, r[0], r[1], r[2], r[3]);
+#endif
+}
+
+
+inline
+uint64_t read_xcr0()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((uint64_t)hi << 32) | lo;
 #endif
 }
 
 
+// Instruction set extensions that are supported by both the CPU and the OS
+inline
+const Cpu_features& cpu_features()
+{
+    static const Cpu_features features = [] {
+        Cpu_features f;
+        uint32_t r[4];
+        cpuid(0, 0, r);
+        uint32_t max_leaf = r[0];
+
+        cpuid(1, 0, r);
+        bool osxsave    = (r[2] >> 27) & 1;
+        uint64_t xcr0   = osxsave ? read_xcr0() : 0;
+        bool ymm_state  = (xcr0 & 0x06) == 0x06;    // XMM and YMM state
+        bool zmm_state  = (xcr0 & 0xe6) == 0xe6;    // ...and opmask, ZMM_Hi256, Hi16_ZMM state
+
+        f.sse41 = (r[2] >> 19) & 1;
+        f.avx   = ymm_state && ((r[2] >> 28) & 1);
+        f.fma   = f.avx     && ((r[2] >> 12) & 1);
+
+        if (max_leaf >= 7) {
+            cpuid(7, 0, r);
+            f.avx2    = f.avx     && ((r[1] >>  5) & 1);
+            f.avx512f = zmm_state && ((r[1] >> 16) & 1);
+        }
+        return f;
+    }();
+    return features;
+}
+
+
 enum Numeric_data_type
 {
     M16INT,
@@ -260,7 +762,8 @@ enum Element_type
 {
     CCONST,
     CVAR,
-    CFUNC
+    CFUNC,
+    CTEMP
 };
 
 
@@ -286,19 +789,14 @@ enum Token_type
 
 
 inline
-string double_to_hex( double v )
+double bits_to_double(uint64_t u)
 {
-    uint64_t* u64p = (uint64_t*)&v;
-
-    stringstream stream;
-    stream << "0x" 
-        << std::setfill ('0') << std::setw(sizeof(*u64p)*2) 
-        << std::hex << *u64p;
-    return stream.str();
+    double v;
+    memcpy(&v, &u, sizeof(v));
+    return v;
 }
 
 
-
 struct Element
 {
     Element_type element_type;
@@ -332,7 +830,7 @@ struct Constant: public Value
     {}
 
     Constant(double num):
-        Value( (volatile void *) &internal_constant, M64FP, CCONST, double_to_hex(num)),
+        Value( (volatile void *) &internal_constant, M64FP, CCONST, string()),
         internal_constant(num)
     {}
 
@@ -362,51 +860,120 @@ private:
 struct Variable: public Value
 {
     bool referenced;
+    bool in_context;        // it is at context_offset from the context pointer, instead of address
+    bool in_block;          // it is in the variable block, at context_offset from its start (see evaluator::var)
+    int32_t context_offset;
 
     Variable(volatile void * addr, string name, Numeric_data_type numeric_data_type):
-        Value(addr, numeric_data_type, CVAR, name), referenced(false)
+        Value(addr, numeric_data_type, CVAR, name), referenced(false), in_context(false), in_block(false),
+        context_offset(0)
+    {}
+
+    Variable(int32_t offset, string name, Numeric_data_type numeric_data_type):
+        Value(nullptr, numeric_data_type, CVAR, name), referenced(false), in_context(true), in_block(false),
+        context_offset(offset)
+    {}
+};
+
+
+// The result of a subexpression that occurs more than once, which is computed where it first
+// occurs and kept in the stack frame of the generated code (see eliminate_common_subexpressions).
+struct Temporary: public Value
+{
+    int32_t index;
+
+    Temporary(int32_t index):
+        Value(nullptr, M64FP, CTEMP, "t" + std::to_string(index)), index(index)
     {}
+
+    // the x87 code keeps them in extended precision, at [esp/rsp+x87_offset(index)]
+    static int32_t x87_offset(int32_t index) { return index * 16; }
 };
 
 
+struct Simd_compiler;
+
+
 struct Function: public Element
 {
     using optimizer_t = void (*)(elist_it_t, evaluator*, elist_t*);
 
+    // Emits the function for the SSE/AVX backends. It returns false if it cannot
+    // handle the case, and then the x87 code is used instead (see Simd_compiler).
+    using simd_emitter_t = bool (*)(Simd_compiler&);
+
+    static const size_t max_args = 2;
+
     size_t              stack_req;
-    string              name;
+    const char*         name;
     size_t              num_args;
     
-    vector<elist_it_t>  args;
+    elist_it_t          args[max_args];
     elist_it_t          parent;
     size_t              parent_arg_index = size_t(~0); // index in postfix order (inverted), i.e. arg1-arg0
 
     list<elist_t>       absorbed[2];
 
-    string              code;
+    const uint8_t*      code;                       // static, or in the intermediate code of the evaluator
+    size_t              code_size;
     optimizer_t         optimizer;
+    simd_emitter_t      simd;
+
+    // the opcode of the SSE2 arithmetic instruction (addsd, mulsd...), if this is
+    // one of the four basic binary operations
+    uint8_t             simd_arithmetic = 0;
+
+    // the operation takes its arguments in reverse order (fsubr/fdivr, see order_operands)
+    bool                reversed = false;
+
+    // With fast math, a mul that is contracted into its parent add/sub, which takes the product
+    // as its argument fused_arg and computes it with FMA (see contract_multiply_add). The SSE/AVX
+    // code leaves the factors on the stack, so the add/sub takes three operands.
+    bool                contracted = false;
+    int                 fused_arg = -1;
+
+    // a constant argument that an optimizer folded into the function (the exponent of pow_opt)
+    double              folded_arg = 0.0;
 
     bool                force_not_constant = false;
 
     Function(
-        const string& name,
-        size_t      num_args,
-        size_t      sreq,
-        size_t      size,
-        uint8_t    *code_buffer,
-        optimizer_t optimizer = 0)
+        const char*     name,
+        size_t          num_args,
+        size_t          sreq,
+        size_t          size,
+        uint8_t        *code_buffer,
+        optimizer_t     optimizer = 0,
+        simd_emitter_t  simd      = 0)
     :
-        Element   ( CFUNC                        ),
-        stack_req ( sreq                         ),
-        name      ( name                         ),
-        num_args  ( num_args                     ),
-        args      ( vector<elist_it_t>(num_args) ),
-        code      ( (char*)code_buffer, size     ),
-        optimizer ( optimizer                    ) {}
+        Element   ( CFUNC       ),
+        stack_req ( sreq        ),
+        name      ( name        ),
+        num_args  ( num_args    ),
+        code      ( code_buffer ),
+        code_size ( size        ),
+        optimizer ( optimizer   ),
+        simd      ( simd        )
+    {
+        assert(num_args <= max_args);
+    }
+};
+
+
+// A reference of the generated code to its constant pool (see link_code): the position of the
+// 32-bit displacement of a RIP-relative operand, and the bits of the value it refers to
+struct Pool_reference
+{
+    std::streamoff  position;
+    uint64_t        bits;
 };
 
 
-struct mexce_charstream { stringstream s; };
+struct mexce_charstream
+{
+    stringstream            s;
+    vector<Pool_reference>  pool_references;
+};
 
 template<typename T>
 mexce_charstream& operator << (mexce_charstream &s, T data) {
@@ -422,909 +989,4207 @@ mexce_charstream& operator < (mexce_charstream &s, int v) {
 }
 
 
-
+// Appends code, with its references to the constant pool, to s
 inline
-shared_ptr<mexce::impl::Constant> make_intermediate_constant(evaluator* ev, double v)
+void append_code(mexce_charstream& s, const string& code, const vector<Pool_reference>& pool_references)
 {
-    auto sc = make_shared<impl::Constant>(v);
-    auto it = ev->m_intermediate_constants.find(sc->name);
-    if (it == ev->m_intermediate_constants.end()) {
-        ev->m_intermediate_constants[sc->name] = sc;
+    std::streamoff base = s.s.tellp();
+    for (auto r : pool_references) {
+        r.position += base;
+        s.pool_references.push_back(r);
     }
-    else {
-        sc = it->second; // releases the constant we just created
-    }
-    return sc;
+    s.s.write(code.data(), code.size());
 }
 
 
-
 inline
-uint8_t* push_intermediate_code(evaluator* ev, const string& s)
+void append_code(mexce_charstream& s, const mexce_charstream& code)
 {
-    ev->m_intermediate_code.push_back(string());
-    ev->m_intermediate_code.back() = s;
-    return (uint8_t*)&ev->m_intermediate_code.back()[0];
+    append_code(s, code.s.str(), code.pool_references);
 }
 
 
 
 inline
-void link_arguments(elist_t& elist)
+Constant* make_intermediate_constant(evaluator* ev, double v)
 {
-    vector<elist_it_t > evec;
-    for (auto y = elist.begin(); y != elist.end(); y++) {
-        if ((*y)->element_type == CFUNC) {
-            auto f = static_pointer_cast<Function>(*y);
-            f->parent = elist.end();
-            for (size_t i = 0; i < f->num_args; i++) {
-                f->args[i] = evec.back();
-
-                if ((*f->args[i])->element_type == CFUNC) {
-                    auto cf = static_pointer_cast<Function>(*f->args[i]);
-                    cf->parent = y;
-                    cf->parent_arg_index = i; // postfix order (inverted)
-                }
-                evec.pop_back();
-            }
-        }
-        evec.push_back(y);
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    auto& c = ev->m_intermediate_constants[bits];
+    if (!c) {
+        c = ev->m_arena.make<Constant>(v);
     }
+    return c;
 }
 
 
+// Copies a function to the elements of the expression
 inline
-Token_type get_infix_rank(char infix_op)
+Function* make_function(evaluator* ev, const Function& f)
 {
-    switch (infix_op) {
-        case '<': return INFIX_4;
-        case '+':
-        case '-': return INFIX_3;
-        case '*':
-        case '/': return INFIX_2;
-        case '^': return INFIX_1;
-    }
+    return ev->m_arena.make<Function>(f);
+}
 
-    assert(false);
-    return UNDEFINED_TOKEN_TYPE;
+
+inline
+Temporary* make_temporary(evaluator* ev, int32_t index)
+{
+    return ev->m_arena.make<Temporary>(index);
 }
 
 
-inline Function Sin()
+
+inline
+uint8_t* push_intermediate_code(evaluator* ev, const string& s)
 {
-    static uint8_t code[] = {
-        0xd9, 0xfe                                  // fsin
-    };
-    return Function("sin", 1, 0, sizeof(code), code);
+    ev->m_intermediate_code.push_back(string());
+    ev->m_intermediate_code.back() = s;
+    return (uint8_t*)&ev->m_intermediate_code.back()[0];
 }
 
 
-inline Function Cos()
+
+// Where the generated code finds the variables. By default, a variable is read from
+// its bound address, which is embedded in the code, or if it was bound at an offset, from
+// the context pointer in ebx/rbx plus the offset. Batch kernels read the variables
+// through column cursors instead (see evaluator::evaluate_batch): ebx/rbx points to an
+// array of cursors, and the pointer of the variable is at pointer_offset[variable].
+// A column, as the batch kernel reads it. The kernel advances data by stride after each row.
+struct Column_cursor
 {
-#ifndef MEXCE_ACCURACY
-    static uint8_t code[] = {
-        0xd9, 0xff                                  // fcos
-    };
-#else
+    const void*     data;
+    ptrdiff_t       stride;
+};
 
-    static uint64_t mfactors[] = {  // Maclaurin expansion factors (80-bit)
 
-#if (MEXCE_ACCURACY > 9)
-        0x9c9962823eb07306, 0x000000000000bf93,     // - 1 / (30!),
-#endif
-#if (MEXCE_ACCURACY > 8)
-        0x850c5131a842e9ba, 0x0000000000003f9d,     //   1 / (28!),
-#endif
-#if (MEXCE_ACCURACY > 7)
-        0xc4742fe35272cd1c, 0x000000000000bfa6,     // - 1 / (26!),
-#endif
-#if (MEXCE_ACCURACY > 6)
-        0xf96780cb97abbe65, 0x0000000000003faf,     //   1 / (24!),
-#endif
+struct Variable_addressing
+{
+    map<const Value*, int32_t> pointer_offset;
+    bool block_base = false;    // the variables in the variable block are addressed relative to ebp/rbp
+};
+
+
+// The offset of v from ebp/rbp, if it is addressed relative to it (see emit_keep_arguments), or -1
+inline
+int32_t block_offset(const Value* v, const Variable_addressing* va)
+{
+    if (!va || !va->block_base || v->element_type != CVAR || !static_cast<const Variable*>(v)->in_block) {
+        return -1;
+    }
+    return static_cast<const Variable*>(v)->context_offset;
+}
+
+
+
+// Emits code that loads the address of v to eax/rax. It emits nothing and returns false for the
+// values that an instruction can address itself (see emit_direct_address): on 32-bit x86, those
+// with a fixed address, and on x64, the constants.
+inline
+bool emit_value_address(mexce_charstream& s, const Value* v, const Variable_addressing* va)
+{
+    if (va) {
+        auto it = va->pointer_offset.find(v);
+        if (it != va->pointer_offset.end()) {
+#ifdef MEXCE_64
+            s < 0x48;                               // REX.W
+#endif
+            s < 0x8b < 0x83;                        // mov         eax/rax, [ebx/rbx+disp32]
+            s << it->second;
+            return true;
+        }
+    }
+    if (v->element_type == CVAR && static_cast<const Variable*>(v)->in_context) {
+#ifdef MEXCE_64
+        s < 0x48;                                   // REX.W
+#endif
+        s < 0x8d < 0x83;                            // lea         eax/rax, [ebx/rbx+disp32]
+        s << static_cast<const Variable*>(v)->context_offset;
+        return true;
+    }
+#ifdef MEXCE_64
+    if (v->element_type == CCONST) {
+        return false;
+    }
+    s < 0x48 < 0xb8;                                // mov         rax, imm64
+    s << (void*)v->address;
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+// Emits the 32-bit displacement of a memory operand with ModRM.mod = 0 and rm = 5, for a value
+// that emit_value_address did not load. On 32-bit x86 it is the address of the value. On x64
+// it is RIP-relative, i.e. relative to the end of the instruction, which the displacement must
+// be the last field of, and refers to the copy of the constant in the constant pool.
+inline
+void emit_direct_address(mexce_charstream& s, const Value* v)
+{
+#ifdef MEXCE_64
+    Pool_reference r = { s.s.tellp(), 0 };
+    memcpy(&r.bits, (const void*)v->address, sizeof(r.bits));
+    s.pool_references.push_back(r);
+    s << int32_t(0);
+#else
+    s << (void*)v->address;
+#endif
+}
+
+
+// Appends the constant pool to the code, at the next cache line boundary (the code itself
+// starts at one, see Code_arena), with each value once, and sets the displacements that
+// refer to it. Returns the code, as it is copied to the executable buffer.
+inline
+string link_code(const mexce_charstream& s)
+{
+    string code = s.s.str();
+    if (s.pool_references.empty()) {
+        return code;
+    }
+    code.resize((code.size() + Code_arena::alignment - 1) & ~(Code_arena::alignment - 1), '\xcc');
+
+    map<uint64_t, int32_t> offsets;
+    for (auto& r : s.pool_references) {
+        auto it = offsets.find(r.bits);
+        if (it == offsets.end()) {
+            it = offsets.insert(make_pair(r.bits, int32_t(code.size()))).first;
+            code.append((const char*)&r.bits, sizeof(r.bits));
+        }
+        int32_t disp = it->second - int32_t(r.position + sizeof(int32_t));
+        memcpy(&code[(size_t)r.position], &disp, sizeof(disp));
+    }
+    return code;
+}
+
+
+
+// Links the functions in [first, last), which are whole subexpressions of elist, to their
+// arguments, and the arguments to them. The functions that are not an argument there have no
+// parent (elist.end()).
+inline
+void link_arguments(elist_t& elist, elist_it_t first, elist_it_t last)
+{
+    vector<elist_it_t > evec;
+    for (auto y = first; y != last; y++) {
+        if ((*y)->element_type == CFUNC) {
+            auto f = static_cast<Function*>(*y);
+            f->parent = elist.end();
+            for (size_t i = 0; i < f->num_args; i++) {
+                f->args[i] = evec.back();
+
+                if ((*f->args[i])->element_type == CFUNC) {
+                    auto cf = static_cast<Function*>(*f->args[i]);
+                    cf->parent = y;
+                    cf->parent_arg_index = i; // postfix order (inverted)
+                }
+                evec.pop_back();
+            }
+        }
+        evec.push_back(y);
+    }
+}
+
+
+inline
+void link_arguments(elist_t& elist)
+{
+    link_arguments(elist, elist.begin(), elist.end());
+}
+
+
+inline
+Token_type get_infix_rank(char infix_op)
+{
+    switch (infix_op) {
+        case '<': return INFIX_4;
+        case '+':
+        case '-': return INFIX_3;
+        case '*':
+        case '/': return INFIX_2;
+        case '^': return INFIX_1;
+    }
+
+    assert(false);
+    return UNDEFINED_TOKEN_TYPE;
+}
+
+
+// x64 general purpose registers, as encoded in ModRM/SIB
+enum Gp_register
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15,
+    RIP = 16        // the base of a constant, in the constant pool (see emit_direct_address)
+};
+
+
+enum Simd_encoding
+{
+    SSE_ENCODING,       // legacy SSE - destructive, two-operand forms
+    VEX_ENCODING,       // AVX
+    EVEX_ENCODING       // AVX-512
+};
+
+
+// SSE2 arithmetic opcodes (0F map), shared by the scalar (F2) and the packed (66) forms
+enum Simd_arithmetic
+{
+    SIMD_SQRT   = 0x51,
+    SIMD_ADD    = 0x58,
+    SIMD_MUL    = 0x59,
+    SIMD_SUB    = 0x5c,
+    SIMD_MIN    = 0x5d,
+    SIMD_DIV    = 0x5e,
+    SIMD_MAX    = 0x5f
+};
+
+
+// bitwise operations (66 0F map)
+enum Simd_logic
+{
+    SIMD_AND    = 0x54,
+    SIMD_ANDN   = 0x55,     // ~a & b
+    SIMD_OR     = 0x56,
+    SIMD_XOR    = 0x57
+};
+
+
+// cmpsd/cmppd predicates
+enum Simd_predicate
+{
+    CMP_EQ, CMP_LT, CMP_LE, CMP_UNORD, CMP_NEQ, CMP_NLT, CMP_NLE, CMP_ORD
+};
+
+
+struct Mem
+{
+    int         base;
+    int32_t     disp;
+    int         index;
+    int         scale;
+    const Value* constant = nullptr;    // for base == RIP
+
+    Mem(int base, int32_t disp = 0, int index = -1, int scale = 1):
+        base(base), disp(disp), index(index), scale(scale) {}
+
+    explicit Mem(const Value* constant):
+        base(RIP), disp(0), index(-1), scale(1), constant(constant) {}
+};
+
+
+struct Simd_op
+{
+    uint8_t     pp;         // mandatory prefix - 0: none, 1: 66, 2: F3, 3: F2
+    uint8_t     map;        // opcode map - 1: 0F, 2: 0F38, 3: 0F3A
+    uint8_t     opcode;
+    uint8_t     w;          // REX.W / VEX.W / EVEX.W
+};
+
+
+// Generates SSE/AVX code for an element list.
+// The x87 register stack is modelled with vector registers: the stack element at
+// depth k lives in register k % stack_regs, and whatever a deeper element would
+// overwrite is spilled to the stack frame first. The registers above stack_regs
+// hold the temporaries that fit (see reserve_slots()), and the last num_scratch are
+// scratch registers for the function emitters.
+// Functions that have no SIMD implementation are evaluated by their x87 code,
+// through memory, one lane at a time (see bridge()).
+//
+// Stack frame layout, relative to rsp:
+//   [0, 3 * vec_bytes)     arguments/result of bridged x87 code, or scratch memory
+//   [3 * vec_bytes, ...)   temporaries and cached columns that are not in registers
+//   [..., ...)             spill slots, one per depth
+struct Simd_compiler
+{
+    static const int        num_scratch = 6;
+
+    mexce_charstream        s;
+    evaluator*              ev;
+    Simd_encoding           encoding;
+    int                     lanes;
+    bool                    sse41;
+    bool                    fma;
+    mexce::accuracy         tier;               // of the transcendental functions
+    int                     stack_regs;
+    int                     scratch_base;       // the first scratch register
+    const Variable_addressing* addressing;
+    int                     tail_mask   = 0;    // the opmask of the valid rows, in the last iteration of a batch
+
+    int                     depth       = 0;
+    int                     max_depth   = 0;
+    const Function*         function    = nullptr;  // the function being emitted
+    int                     num_args    = 0;    // its arity
+    int                     max_tmp     = -1;
+    bool                    bridged     = false;
+    vector<bool>            resident;           // per depth: the element is in its register
+
+    // A temporary, or a column that is read more than once, in a register or in the frame
+    struct Slot
+    {
+        int                 reg;                // or -1
+        int32_t             offset;             // in the frame, if it is not in a register
+    };
+    vector<Slot>            slots;              // the temporaries first, by their index
+    int                     num_slots   = 0;    // of those in the frame
+
+    // the columns that are read more than once, by their slot, and whether it is loaded yet
+    map<const Value*, pair<int, bool> > cached_columns;
+
+    Simd_compiler(evaluator* ev, mexce::backend b, mexce::accuracy a, int lanes,
+        const Variable_addressing* va = nullptr)
+    :
+        ev          ( ev                                                    ),
+        encoding    ( lanes == 8 ? EVEX_ENCODING :
+                      b == mexce::backend::sse2 ? SSE_ENCODING : VEX_ENCODING ),
+        lanes       ( lanes                                                 ),
+        sse41       ( cpu_features().sse41                                  ),
+        fma         ( encoding != SSE_ENCODING && cpu_features().fma        ),
+        tier        ( a                                                     ),
+        stack_regs  ( (encoding == EVEX_ENCODING ? 32 : 16) - num_scratch   ),
+        scratch_base( stack_regs                                            ),
+        addressing  ( va                                                    )
+    {}
+
+    int vl()        const { return lanes == 8 ? 2 : lanes == 4 ? 1 : 0; }
+    int vec_bytes() const { return lanes * 8; }
+    int reg(int k)  const { return k % stack_regs; }
+
+    // the register of the i-th argument (in infix order) of the function being emitted,
+    // which is also where its result is expected
+    int arg(int i)  const { return reg(depth - num_args + i); }
+
+    int tmp(int i)
+    {
+        assert(i < num_scratch);
+        max_tmp = std::max(max_tmp, i);
+        return scratch_base + i;
+    }
+
+    int32_t slot_offset(int i)  const { return (3 + i) * vec_bytes(); }
+    int32_t spill_offset(int k) const { return slot_offset(num_slots + k); }
+
+
+    // Reserves the slots of the temporaries, and in batch kernels, of the columns that are read
+    // more than once, so that they are only loaded (or gathered) the first time. The expressions
+    // start at first and end at each of roots. The registers that the stack does not reach
+    // hold as many slots as they can, the rest are in the frame.
+    void reserve_slots(elist_const_it_t first, const vector<elist_it_t>& roots, int num_temporaries)
+    {
+        int num = num_temporaries;
+        int peak = 0;
+        map<const Value*, int> reads;
+        auto it = first;
+        for (auto& root : roots) {
+            int d = 0;
+            for (elist_const_it_t last = next(root); it != last; it++) {
+                if ((*it)->element_type == CFUNC) {
+                    auto f = static_cast<const Function*>(*it);
+                    if (f->contracted) {
+                        continue;
+                    }
+                    d -= (int)f->num_args + (f->fused_arg >= 0);
+                }
+                peak = std::max(peak, ++d);
+                if (lanes > 1 && addressing && (*it)->element_type == CVAR &&
+                    addressing->pointer_offset.count((const Value*)*it))
+                {
+                    reads[(const Value*)*it]++;
+                }
+            }
+        }
+        for (auto& r : reads) {
+            if (r.second > 1) {
+                cached_columns[r.first] = make_pair(num++, false);
+            }
+        }
+
+        int in_registers = std::max(0, std::min(num, stack_regs - peak));
+        stack_regs -= in_registers;
+        for (int i = 0; i < num; i++) {
+            Slot slot = { -1, 0 };
+            if (i < in_registers) {
+                slot.reg = stack_regs + i;
+            }
+            else {
+                slot.offset = slot_offset(num_slots++);
+            }
+            slots.push_back(slot);
+        }
+    }
+
+
+    void store_slot(int i, int src)
+    {
+        if (slots[i].reg >= 0) {
+            mov(slots[i].reg, src);
+        }
+        else {
+            store(Mem(RSP, slots[i].offset), src);
+        }
+    }
+
+
+    void load_slot(int dst, int i)
+    {
+        if (slots[i].reg >= 0) {
+            mov(dst, slots[i].reg);
+        }
+        else {
+            load(dst, Mem(RSP, slots[i].offset));
+        }
+    }
+
+
+    void modrm(int r, int rm, const Mem* m, int disp_scale)
+    {
+        r &= 7;
+        if (!m) {
+            s < (0xc0 | r << 3 | (rm & 7));
+            return;
+        }
+        if (m->base == RIP) {
+            s < (r << 3 | 5);                                   // [rip+disp32]
+            emit_direct_address(s, m->constant);
+            return;
+        }
+        int  base = m->base & 7;
+        bool sib  = m->index >= 0 || base == RSP;
+        int  mod  = 2;
+        if (m->disp == 0 && base != RBP) {
+            mod = 0;
+        }
+        else
+        if (m->disp % disp_scale == 0 && m->disp / disp_scale >= -128 && m->disp / disp_scale <= 127) {
+            mod = 1;
+        }
+        s < (mod << 6 | r << 3 | (sib ? 4 : base));
+        if (sib) {
+            int ss = m->scale == 8 ? 3 : m->scale == 4 ? 2 : m->scale == 2 ? 1 : 0;
+            s < (ss << 6 | (m->index >= 0 ? m->index & 7 : 4) << 3 | base);
+        }
+        if (mod == 1) s < (m->disp / disp_scale);
+        if (mod == 2) s << (int32_t)m->disp;
+    }
+
+
+    // Emits an instruction in the active encoding.
+    // r:   the ModRM.reg operand (usually the destination)
+    // v:   the extra source operand of the VEX/EVEX forms (ignored by SSE_ENCODING)
+    // rm:  the ModRM.rm register operand, if m is null
+    // mem_bytes: the size of the memory operand (EVEX scales 8-bit displacements by it)
+    void encode(Simd_op op, int r, int v, int rm, const Mem* m = nullptr, int mem_bytes = 0,
+        int L = -1, int opmask = 0, bool zeroing = false, bool broadcast = false)
+    {
+        static const uint8_t prefix[] = { 0, 0x66, 0xf3, 0xf2 };
+        if (L < 0) {
+            L = vl();
+        }
+        int rex_r = (r >> 3) & 1;
+        int rex_x = m ? (m->index >= 0 ? (m->index >> 3) & 1 : 0) : (rm >> 4) & 1;
+        int rex_b = m ? (m->base >> 3) & 1 : (rm >> 3) & 1;
+
+        switch (encoding) {
+            case SSE_ENCODING:
+                if (op.pp) {
+                    s < prefix[op.pp];
+                }
+                if (op.w || rex_r || rex_x || rex_b) {
+                    s < (0x40 | op.w << 3 | rex_r << 2 | rex_x << 1 | rex_b);
+                }
+                s < 0x0f;
+                if (op.map == 2) s < 0x38;
+                if (op.map == 3) s < 0x3a;
+                break;
+            case VEX_ENCODING:
+                if (op.map == 1 && !op.w && !rex_x && !rex_b) {
+                    s < 0xc5 < (!rex_r << 7 | (~v & 15) << 3 | L << 2 | op.pp);
+                }
+                else {
+                    s < 0xc4 < (!rex_r << 7 | !rex_x << 6 | !rex_b << 5 | op.map)
+                             < (op.w << 7 | (~v & 15) << 3 | L << 2 | op.pp);
+                }
+                break;
+            case EVEX_ENCODING:
+                s < 0x62
+                  < (!rex_r << 7 | !rex_x << 6 | !rex_b << 5 | !((r >> 4) & 1) << 4 | op.map)
+                  < (op.w << 7 | (~v & 15) << 3 | 4 | op.pp)
+                  < (zeroing << 7 | L << 5 | broadcast << 4 | !((v >> 4) & 1) << 3 | opmask);
+                break;
+        }
+        s < op.opcode;
+        modrm(r, rm, m, (encoding == EVEX_ENCODING && m) ? mem_bytes : 1);
+    }
+
+
+    uint8_t evex_w() const { return encoding == EVEX_ENCODING; }
+
+
+    // dst = a OP b, for instructions of the form OP xmm1, (xmm2,) xmm3
+    // In SSE_ENCODING, if dst aliases b, the last scratch register may be overwritten.
+    void binary(Simd_op op, int dst, int a, int b, bool commutative, int imm = -1)
+    {
+        if (encoding == SSE_ENCODING && dst != a) {
+            if (dst == b && commutative) {
+                b = a;
+            }
+            else {
+                if (dst == b) {
+                    int t = tmp(num_scratch - 1);
+                    mov(t, b);
+                    b = t;
+                }
+                mov(dst, a);
+            }
+        }
+        encode(op, dst, a, b);
+        if (imm >= 0) {
+            s < imm;
+        }
+    }
+
+
+    void arith(int opcode, int dst, int a, int b)
+    {
+        Simd_op op = { uint8_t(lanes == 1 ? 3 : 1), 1, uint8_t(opcode), evex_w() };
+        binary(op, dst, a, b, opcode == SIMD_ADD || opcode == SIMD_MUL);
+    }
+
+
+    void arith(int opcode, int dst, int a, const Mem& m)
+    {
+        Simd_op op = { uint8_t(lanes == 1 ? 3 : 1), 1, uint8_t(opcode), evex_w() };
+        if (encoding == SSE_ENCODING) {
+            mov(dst, a);
+        }
+        encode(op, dst, a, 0, &m, vec_bytes());
+    }
+
+
+    void logic(int opcode, int dst, int a, int b)
+    {
+        if (encoding == EVEX_ENCODING) {
+            // the floating point forms need AVX512DQ, the integer ones do the same
+            uint8_t iop = opcode == SIMD_AND ? 0xdb : opcode == SIMD_ANDN ? 0xdf : opcode == SIMD_OR ? 0xeb : 0xef;
+            binary({ 1, 1, iop, 1 }, dst, a, b, opcode != SIMD_ANDN);
+        }
+        else {
+            binary({ 1, 1, uint8_t(opcode), 0 }, dst, a, b, opcode != SIMD_ANDN);
+        }
+    }
+
+
+    void sqrt(int dst, int src)
+    {
+        if (lanes == 1) {
+            encode({ 3, 1, SIMD_SQRT, 0 }, dst, src, src);      // sqrtsd
+        }
+        else {
+            encode({ 1, 1, SIMD_SQRT, evex_w() }, dst, 0, src); // sqrtpd
+        }
+    }
+
+
+    // roundsd/roundpd (vrndscalepd in EVEX) - mode: 0 nearest, 1 down, 2 up, 3 truncate
+    // Without SSE4.1, |src| + 2^52 - 2^52 rounds to nearest, which is then corrected by 1
+    // where it went the wrong way, and given the sign of src (from 2^52 on, src is an integer).
+    void round(int dst, int src, int mode)
+    {
+        if (sse41) {
+            uint8_t opcode = lanes == 1 ? 0x0b : 0x09;
+            encode({ 1, 3, opcode, evex_w() }, dst, lanes == 1 ? src : 0, src);
+            s < (mode | 8);                                     // suppress the precision exception
+            return;
+        }
+        int sign = tmp(0), a = tmp(1), t = tmp(2), r = tmp(3), m = tmp(4);
+        load_constant(sign, -0.0);
+        logic(SIMD_ANDN, a, sign, src);
+        logic(SIMD_AND, sign, sign, src);
+        load_constant(t, 4503599627370496.0);                   // 2^52
+        arith(SIMD_ADD, r, a, t);
+        arith(SIMD_SUB, r, r, t);
+        select(r, compare(a, t, CMP_LT, m), r, a);
+        if (mode == 3) {
+            load_constant(t, 1.0);
+            select_or_zero(t, compare(a, r, CMP_LT, m), t);
+            arith(SIMD_SUB, r, r, t);
+        }
+        logic(SIMD_OR, r, r, sign);
+        if (mode == 1 || mode == 2) {
+            load_constant(t, 1.0);
+            if (mode == 1) {
+                select_or_zero(t, compare(src, r, CMP_LT, m), t);
+                arith(SIMD_SUB, r, r, t);
+            }
+            else {
+                select_or_zero(t, compare(r, src, CMP_LT, m), t);
+                arith(SIMD_ADD, r, r, t);
+            }
+        }
+        logic(SIMD_OR, dst, r, sign);
+    }
+
+
+    void mov(int dst, int src)
+    {
+        if (dst != src) {
+            encode({ 1, 1, 0x28, evex_w() }, dst, 0, src);      // movapd
+        }
+    }
+
+
+    void load(int dst, const Mem& m, int opmask = 0)
+    {
+        if (lanes == 1) {
+            encode({ 3, 1, 0x10, evex_w() }, dst, 0, 0, &m, 8); // movsd
+        }
+        else {
+            encode({ 1, 1, 0x10, evex_w() }, dst, 0, 0, &m, vec_bytes(), -1, opmask, opmask != 0); // movupd
+        }
+    }
+
+
+    void store(const Mem& m, int src, int opmask = 0)
+    {
+        if (lanes == 1) {
+            encode({ 3, 1, 0x11, evex_w() }, src, 0, 0, &m, 8); // movsd
+        }
+        else {
+            encode({ 1, 1, 0x11, evex_w() }, src, 0, 0, &m, vec_bytes(), -1, opmask); // movupd
+        }
+    }
+
+
+    // loads the address of a Value to rax, except for temporaries in the frame, the variables
+    // in the variable block and the constants
+    Mem value_address(const Value* v)
+    {
+        if (v->element_type == CTEMP) {
+            return Mem(RSP, slots[static_cast<const Temporary*>(v)->index].offset);
+        }
+        int32_t offset = block_offset(v, addressing);
+        if (offset >= 0) {
+            return Mem(RBP, offset);
+        }
+        if (!emit_value_address(s, v, addressing)) {
+            return Mem(v);
+        }
+        return Mem(RAX);
+    }
+
+
+    // emits a jump with a 32-bit displacement - cc: the condition code of a jcc, or -1 for jmp
+    // Returns the position of the displacement, for set_jump_target().
+    std::streamoff jump(int cc)
+    {
+        if (cc < 0) {
+            s < 0xe9;
+        }
+        else {
+            s < 0x0f < (0x80 | cc);
+        }
+        auto pos = s.s.tellp();
+        s << int32_t(0);
+        return pos;
+    }
+
+
+    // points the jump at pos to the current position
+    void set_jump_target(std::streamoff pos)
+    {
+        std::streamoff here = s.s.tellp();
+        s.s.seekp(pos);
+        s << int32_t(here - pos - 4);
+        s.s.seekp(here);
+    }
+
+
+    // loads a single value to the low lane of dst
+    void load_scalar(int dst, const Mem& m, Numeric_data_type type)
+    {
+        switch (type) {
+            case M64FP:
+                encode({ 3, 1, 0x10, evex_w() }, dst, 0, 0, &m, 8, 0); // movsd
+                break;
+            case M32FP:
+                encode({ 2, 1, 0x5a, 0 }, dst, dst, 0, &m, 4, 0); // cvtss2sd
+                break;
+            case M32INT:
+                encode({ 3, 1, 0x2a, 0 }, dst, dst, 0, &m, 4, 0); // cvtsi2sd    xmm, dword ptr
+                break;
+            case M64INT:
+                encode({ 3, 1, 0x2a, 1 }, dst, dst, 0, &m, 8, 0); // cvtsi2sd    xmm, qword ptr
+                break;
+            case M16INT:
+                s < 0x0f < 0xbf;                                // movsx       ecx, word ptr
+                modrm(RCX, 0, &m, 1);
+                encode({ 3, 1, 0x2a, 0 }, dst, dst, RCX, nullptr, 0, 0); // cvtsi2sd    xmm, ecx
+                break;
+        }
+    }
+
+
+    // loads a single value to all the lanes of dst
+    void broadcast(int dst, const Mem& m, Numeric_data_type type)
+    {
+        if (lanes == 1) {
+            load_scalar(dst, m, type);
+        }
+        else
+        if (type == M64FP) {
+            encode({ 1, 2, 0x19, evex_w() }, dst, 0, 0, &m, 8); // vbroadcastsd ymm/zmm, qword ptr
+        }
+        else {
+            load_scalar(dst, m, type);
+            encode({ 1, 2, 0x19, evex_w() }, dst, 0, dst);      // vbroadcastsd ymm/zmm, xmm
+        }
+    }
+
+
+    // Loads a column of a batch kernel, whose cursor is at offset in [rbx]: contiguous
+    // columns are loaded as vectors, columns with zero stride are broadcast and the rest
+    // (e.g. the members of an array of structs) are gathered, with vgatherdpd/vgatherdps/
+    // vpgatherdd if the offsets of the lanes fit in 32 bits, otherwise through the stack
+    // frame, one lane at a time.
+    void load_column(int dst, const Value* v, int32_t offset)
+    {
+        static const int8_t type_size[] = { 2, 4, 8, 4, 8 };
+        Numeric_data_type type = v->numeric_data_type;
+
+        Mem m = value_address(v);
+        s < 0x48 < 0x8b < 0x93;                                 // mov         rdx, [rbx+disp32]
+        s << int32_t(offset + sizeof(void*));
+
+        vector<std::streamoff> done;
+        if (type == M64FP || type == M32FP || type == M32INT) {
+            s < 0x48 < 0x83 < 0xfa < type_size[type];           // cmp         rdx, imm8
+            auto not_contiguous = jump(0x5);                    // jne
+            if (type == M64FP) {
+                load(dst, m, tail_mask);
+            }
+            else {
+                uint8_t pp = type == M32FP ? 0 : 2;             // vcvtps2pd / vcvtdq2pd
+                encode({ pp, 1, uint8_t(type == M32FP ? 0x5a : 0xe6), 0 }, dst, 0, 0, &m, vec_bytes() / 2,
+                    -1, tail_mask, tail_mask != 0);
+            }
+            done.push_back(jump(-1));
+            set_jump_target(not_contiguous);
+        }
+
+        s < 0x48 < 0x85 < 0xd2;                                 // test        rdx, rdx
+        auto strided = jump(0x5);                               // jnz
+        broadcast(dst, m, type);
+        done.push_back(jump(-1));
+        set_jump_target(strided);
+
+        if (type == M64FP || type == M32FP || type == M32INT) {
+            alignas(32) static const int32_t lane_index[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+
+            // the offset of the last lane is at most 7 * stride, which fits in 32 bits if |stride| < 2^28
+            s < 0x48 < 0x8d < 0x8a; s << int32_t(1 << 28);      // lea         rcx, [rdx+10000000h]
+            s < 0x48 < 0xc1 < 0xe9 < 29;                        // shr         rcx, 29
+            auto too_far = jump(0x5);                           // jnz
+
+            int idx = tmp(0);
+            int L_idx = lanes == 8 ? 1 : 0;                     // lanes dwords
+            s < 0x48 < 0xb9; s << (const void*)lane_index;      // mov         rcx, imm64
+            Mem index_table(RCX);
+            encode({ 1, 1, 0x6e, 0 }, idx, 0, RDX, nullptr, 0, 0); // vmovd       xmm, edx
+            encode({ 1, 2, 0x58, 0 }, idx, 0, idx, nullptr, 0, L_idx); // vpbroadcastd
+            encode({ 1, 2, 0x40, 0 }, idx, idx, 0, &index_table, 4 * lanes, L_idx); // vpmulld     idx, idx, [rcx]
+
+            // vgatherdpd, or vgatherdps/vpgatherdd to the lower half and a conversion
+            Mem lanes_m(RAX, 0, idx, 1);
+            uint8_t gather_op = type == M32INT ? 0x90 : 0x92;
+            uint8_t w = type == M64FP;
+            int L_dst = type == M64FP ? vl() : vl() - 1;
+            if (encoding == EVEX_ENCODING) {
+                if (tail_mask) {
+                    s < 0xc5 < 0xf8 < 0x90 < 0xd1;              // kmovw       k2, k1
+                }
+                else {
+                    s < 0xc5 < 0xec < 0x46 < 0xd2;              // kxnorw      k2, k2, k2
+                }
+                encode({ 1, 2, gather_op, w }, dst, idx & 16, 0, &lanes_m, w ? 8 : 4, L_dst, 2);
+            }
+            else {
+                int mask = tmp(1);
+                encode({ 1, 1, 0x76, 0 }, mask, mask, mask, nullptr, 0, L_dst); // vpcmpeqd    mask, mask, mask
+                encode({ 1, 2, gather_op, w }, dst, mask, 0, &lanes_m, 0, L_dst);
+            }
+            if (type == M32FP) {
+                encode({ 0, 1, 0x5a, 0 }, dst, 0, dst);         // vcvtps2pd
+            }
+            if (type == M32INT) {
+                encode({ 2, 1, 0xe6, 0 }, dst, 0, dst);         // vcvtdq2pd
+            }
+            done.push_back(jump(-1));
+            set_jump_target(too_far);
+        }
+
+        bridged = true;                                         // gathered in the bridge area
+        vector<std::streamoff> gathered;
+        for (int l = 0; l < lanes; l++) {
+            if (tail_mask && l) {
+                s < 0x48 < 0x83 < 0xff < l;                     // cmp         rdi, l
+                gathered.push_back(jump(0x6));                  // jbe         (past the last valid row)
+            }
+            Mem lane(RSP, l * 8);
+            load_scalar(dst, m, type);
+            encode({ 3, 1, 0x11, evex_w() }, dst, 0, 0, &lane, 8, 0); // movsd       qword ptr [rsp+8*l], xmm
+            if (l < lanes - 1) {
+                s < 0x48 < 0x01 < 0xd0;                         // add         rax, rdx
+            }
+        }
+        for (auto pos : gathered) {
+            set_jump_target(pos);
+        }
+        load(dst, Mem(RSP, 0));
+
+        for (auto pos : done) {
+            set_jump_target(pos);
+        }
+    }
+
+
+    void load_value(int dst, const Value* v)
+    {
+        if (v->element_type == CTEMP) {
+            load_slot(dst, static_cast<const Temporary*>(v)->index);
+            return;
+        }
+        if (lanes > 1 && addressing) {
+            auto it = addressing->pointer_offset.find(v);
+            if (it != addressing->pointer_offset.end()) {
+                auto cached = cached_columns.find(v);
+                if (cached == cached_columns.end()) {
+                    load_column(dst, v, it->second);
+                    return;
+                }
+                if (cached->second.second) {
+                    load_slot(dst, cached->second.first);
+                    return;
+                }
+                load_column(dst, v, it->second);
+                store_slot(cached->second.first, dst);
+                cached->second.second = true;
+                return;
+            }
+        }
+        broadcast(dst, value_address(v), v->numeric_data_type);
+    }
+
+
+    void load_constant(int dst, double v)
+    {
+        if (v == 0.0 && !std::signbit(v)) {
+            logic(SIMD_XOR, dst, dst, dst);
+            return;
+        }
+        load_value(dst, make_intermediate_constant(ev, v));
+    }
+
+
+    // Compares a with b and returns the mask of the lanes where the predicate holds.
+    // The mask is written to mask_reg, or to k2 in EVEX_ENCODING, where it is an opmask.
+    int compare(int a, int b, int pred, int mask_reg)
+    {
+        if (encoding == EVEX_ENCODING) {
+            encode({ 1, 1, 0xc2, 1 }, 2, a, b);                 // vcmppd      k2, a, b, pred
+            s < pred;
+            return 2;
+        }
+        Simd_op cmp = { uint8_t(lanes == 1 ? 3 : 1), 1, 0xc2, 0 };
+        binary(cmp, mask_reg, a, b, false, pred);
+        return mask_reg;
+    }
+
+
+    // dst = mask ? if_true : if_false, for a mask returned by compare()
+    // In SSE_ENCODING, if_true and the mask are overwritten.
+    void select(int dst, int mask, int if_true, int if_false)
+    {
+        switch (encoding) {
+            case EVEX_ENCODING:
+                encode({ 1, 2, 0x65, 1 }, dst, if_false, if_true, nullptr, 0, -1, mask); // vblendmpd dst {k}
+                break;
+            case VEX_ENCODING:
+                encode({ 1, 3, 0x4b, 0 }, dst, if_false, if_true);                      // vblendvpd
+                s < (mask << 4);
+                break;
+            case SSE_ENCODING:
+                logic(SIMD_AND,  if_true, if_true, mask);
+                logic(SIMD_ANDN, mask,    mask,    if_false);
+                logic(SIMD_OR,   dst,     if_true, mask);
+                break;
+        }
+    }
+
+
+    // dst = mask ? src : +0, for a mask returned by compare()
+    void select_or_zero(int dst, int mask, int src)
+    {
+        if (encoding == EVEX_ENCODING) {
+            encode({ 1, 1, 0x28, 1 }, dst, 0, src, nullptr, 0, -1, mask, true); // vmovapd dst {k}{z}
+        }
+        else {
+            logic(SIMD_AND, dst, mask, src);
+        }
+    }
+
+
+    // dst = (a PRED b) ? if_true : if_false
+    void compare_select(int dst, int a, int b, int pred, double if_true, double if_false)
+    {
+        int mask = compare(a, b, pred, tmp(0));
+        load_constant(tmp(1), if_true);
+        if (if_false == 0.0 && !std::signbit(if_false)) {
+            select_or_zero(dst, mask, tmp(1));
+            return;
+        }
+        load_constant(tmp(2), if_false);
+        select(dst, mask, tmp(1), tmp(2));
+    }
+
+
+    // dst = dst - a * b, with a single rounding - requires FMA
+    void fnmadd(int dst, int a, int b)
+    {
+        encode({ 1, 2, uint8_t(lanes == 1 ? 0xbd : 0xbc), 1 }, dst, a, b); // vfnmadd231sd/pd
+    }
+
+
+    // dst = dst + a * b, with a single rounding - requires FMA
+    void fmadd(int dst, int a, int b)
+    {
+        encode({ 1, 2, uint8_t(lanes == 1 ? 0xb9 : 0xb8), 1 }, dst, a, b); // vfmadd231sd/pd
+    }
+
+
+    // dst = dst * a + b, fused if the CPU has FMA
+    void mul_add(int dst, int a, int b)
+    {
+        if (fma) {
+            encode({ 1, 2, uint8_t(lanes == 1 ? 0xa9 : 0xa8), 1 }, dst, a, b); // vfmadd213sd/pd
+            return;
+        }
+        arith(SIMD_MUL, dst, dst, a);
+        arith(SIMD_ADD, dst, dst, b);
+    }
+
+
+    // dst = dst * a - b, fused if the CPU has FMA
+    void mul_sub(int dst, int a, int b)
+    {
+        if (fma) {
+            encode({ 1, 2, uint8_t(lanes == 1 ? 0xab : 0xaa), 1 }, dst, a, b); // vfmsub213sd/pd
+            return;
+        }
+        arith(SIMD_MUL, dst, dst, a);
+        arith(SIMD_SUB, dst, dst, b);
+    }
+
+
+    // dst = dst + a * b, fused if the CPU has FMA - otherwise b is overwritten with a * b
+    void add_mul(int dst, int a, int b)
+    {
+        if (fma) {
+            fmadd(dst, a, b);
+            return;
+        }
+        arith(SIMD_MUL, b, b, a);
+        arith(SIMD_ADD, dst, dst, b);
+    }
+
+
+    // dst = dst - a * b, fused if the CPU has FMA - otherwise b is overwritten with a * b
+    void sub_mul(int dst, int a, int b)
+    {
+        if (fma) {
+            fnmadd(dst, a, b);
+            return;
+        }
+        arith(SIMD_MUL, b, b, a);
+        arith(SIMD_SUB, dst, dst, b);
+    }
+
+
+    // dst = c[0] + x * (c[1] + x * (c[2] + ... x * c[n-1])) - t is overwritten
+    void polynomial(int dst, int x, const double* c, int n, int t)
+    {
+        load_constant(dst, c[n - 1]);
+        for (int i = n - 2; i >= 0; i--) {
+            load_constant(t, c[i]);
+            mul_add(dst, x, t);
+        }
+    }
+
+
+    // psllq/psrlq dst, src, bits - ext selects the operation (6: left, 2: right)
+    void shift(int ext, int dst, int src, int bits)
+    {
+        Simd_op op = { 1, 1, 0x73, evex_w() };
+        if (encoding == SSE_ENCODING) {
+            mov(dst, src);
+            encode(op, ext, 0, dst);
+        }
+        else {
+            encode(op, ext, dst, src);
+        }
+        s < bits;
+    }
+
+
+    void shift_left (int dst, int src, int bits) { shift(6, dst, src, bits); }
+    void shift_right(int dst, int src, int bits) { shift(2, dst, src, bits); }
+
+
+    // paddq - the lanes as 64-bit integers
+    void add_int(int dst, int a, int b)
+    {
+        binary({ 1, 1, 0xd4, evex_w() }, dst, a, b, true);
+    }
+
+
+    // Returns the mask of the lanes where bit 0 of the 64-bit integer in src is set, for select().
+    // It is built in dst, or in k2 with EVEX_ENCODING. With VEX_ENCODING, only the sign bits
+    // are set, which is what vblendvpd reads.
+    int odd_lanes(int dst, int src)
+    {
+        shift_left(dst, src, 63);
+        switch (encoding) {
+            case EVEX_ENCODING:
+                encode({ 1, 2, 0x27, 1 }, 2, dst, dst);       // vptestmq    k2, dst, dst
+                return 2;
+            case SSE_ENCODING:
+                encode({ 1, 1, 0x72, 0 }, 4, 0, dst);         // psrad       dst, 31
+                s < 31;
+                encode({ 1, 1, 0x70, 0 }, dst, 0, dst);       // pshufd      dst, dst, 0xf5
+                s < 0xf5;
+                break;
+            default:
+                break;
+        }
+        return dst;
+    }
+
+
+    // Emits a jump that is taken if the mask (from compare()) is set in any of the lanes.
+    // Returns the position of the displacement, for set_jump_target().
+    std::streamoff jump_if_any(int mask)
+    {
+        if (encoding == EVEX_ENCODING) {
+            s < 0xc5 < 0xf8 < 0x98 < (0xc0 | mask << 3 | mask);   // kortestw    k, k
+        }
+        else {
+            encode({ 1, 1, 0x50, 0 }, RAX, 0, mask);           // movmskpd    eax, mask
+            if (lanes == 1) {
+                s < 0xa8 < 0x01;                                // test        al, 1
+            }
+            else {
+                s < 0x85 < 0xc0;                                // test        eax, eax
+            }
+        }
+        return jump(0x5);                                       // jnz
+    }
+
+
+    // The bridge area of the frame, which a function emitter may use to keep three vectors
+    // in memory.
+    Mem scratch_memory(int i)
+    {
+        assert(i < 3);
+        bridged = true;
+        return Mem(RSP, i * vec_bytes());
+    }
+
+
+    // makes room for a new element on top of the stack, and returns its register
+    int push()
+    {
+        int k = depth++;
+        max_depth = std::max(max_depth, depth);
+        if ((int)resident.size() < depth) {
+            resident.resize(depth, false);
+        }
+        if (k >= stack_regs && resident[k - stack_regs]) {
+            store(Mem(RSP, spill_offset(k - stack_regs)), reg(k));
+            resident[k - stack_regs] = false;
+        }
+        resident[k] = true;
+        return reg(k);
+    }
+
+
+    void reload(int first, int last)
+    {
+        for (int k = first; k < last; k++) {
+            if (!resident[k]) {
+                load(reg(k), Mem(RSP, spill_offset(k)));
+                resident[k] = true;
+            }
+        }
+    }
+
+
+    // evaluates a function through its x87 code
+    void bridge(const Function* f)
+    {
+        bridged = true;
+        for (int i = 0; i < num_args; i++) {
+            store(Mem(RSP, i * vec_bytes()), arg(i));
+        }
+        for (int l = 0; l < lanes; l++) {
+            for (int i = 0; i < num_args; i++) {
+                s < 0xdd < 0x44 < 0x24 < (i * vec_bytes() + l * 8);  // fld         qword ptr [rsp+disp8]
+            }
+            s.s.write((const char*)f->code, f->code_size);
+            s < 0xdd < 0x5c < 0x24 < (l * 8);                       // fstp        qword ptr [rsp+disp8]
+        }
+        load(arg(0), Mem(RSP, 0));
+    }
+
+
+    void compile_function(const Function* f)
+    {
+        if (f->num_args == 0) {
+            throw std::logic_error("Internal error: SIMD code cannot use x87-only intermediate code");
+        }
+        function = f;
+        num_args = (int)f->num_args + (f->fused_arg >= 0);
+        reload(depth - num_args, depth);
+        if (f->fused_arg == 1) {
+            // a*b+c or a*b-c, with the factors and c on the stack
+            if (f->simd_arithmetic == SIMD_SUB) {
+                mul_sub(arg(0), arg(1), arg(2));
+            }
+            else {
+                mul_add(arg(0), arg(1), arg(2));
+            }
+        }
+        else
+        if (f->fused_arg == 0) {
+            // c+a*b or c-a*b
+            if (f->simd_arithmetic == SIMD_SUB) {
+                sub_mul(arg(0), arg(1), arg(2));
+            }
+            else {
+                add_mul(arg(0), arg(1), arg(2));
+            }
+        }
+        else
+        if (f->simd_arithmetic && f->reversed) {
+            arith(f->simd_arithmetic, arg(1), arg(1), arg(0));
+            mov(arg(0), arg(1));
+        }
+        else
+        if (f->simd_arithmetic) {
+            arith(f->simd_arithmetic, arg(0), arg(0), arg(1));
+        }
+        else
+        if (!f->simd || !f->simd(*this)) {
+            bridge(f);
+        }
+        depth -= num_args - 1;
+    }
+
+
+    void compile(elist_const_it_t first, elist_const_it_t last)
+    {
+        for (auto it = first; it != last; it++) {
+            if ((*it)->element_type == CFUNC) {
+                // a contracted product is left to the add/sub that takes it, as its two factors
+                if (!((Function*)*it)->contracted) {
+                    compile_function((Function*)*it);
+                }
+                continue;
+            }
+
+            auto v = (const Value*)*it;
+            auto it_next = next(it);
+            auto f_next = it_next != last && (*it_next)->element_type == CFUNC ? (Function*)*it_next : nullptr;
+
+            // a double, followed by a basic arithmetic operation, is used directly from memory
+            // (or from its register, if it is a temporary there)
+            if (lanes == 1 && depth && v->numeric_data_type == M64FP && f_next &&
+                f_next->simd_arithmetic && !f_next->reversed && !f_next->contracted && f_next->fused_arg < 0)
+            {
+                reload(depth - 1, depth);
+                int r = reg(depth - 1);
+                int op = f_next->simd_arithmetic;
+                int slot_reg = v->element_type == CTEMP ? slots[static_cast<const Temporary*>(v)->index].reg : -1;
+                if (slot_reg >= 0) {
+                    arith(op, r, r, slot_reg);
+                }
+                else {
+                    arith(op, r, r, value_address(v));
+                }
+                it = it_next;
+                continue;
+            }
+
+            load_value(push(), v);
+        }
+    }
+
+
+    // stores the result of an expression and leaves the stack empty, for the next one
+    void store_result(const Mem& m, int opmask = 0)
+    {
+        assert(depth == 1);
+        store(m, reg(0), opmask);
+        depth = 0;
+    }
+
+
+    // the bytes of the frame that hold the bridge area, the slots and the spill slots
+    int32_t frame_data_size() const
+    {
+        int spills = std::max(0, max_depth - stack_regs);
+        return (bridged || num_slots || spills) ? spill_offset(spills) : 0;
+    }
+
+
+    // the registers that the calling convention expects to be preserved, if they are used
+    uint32_t callee_saved_xmm() const
+    {
+        uint32_t regs = 0;
+#ifdef _WIN32
+        // xmm6-xmm15 are callee-saved in the Windows x64 calling convention
+        int used = std::min(max_depth, stack_regs);
+        for (int r = 6; r < 16; r++) {
+            if (r < used || (r >= scratch_base && r <= scratch_base + max_tmp)) {
+                regs |= 1u << r;
+            }
+        }
+        for (auto& slot : slots) {
+            if (slot.reg >= 6 && slot.reg < 16) {
+                regs |= 1u << slot.reg;
+            }
+        }
+#endif
+        return regs;
+    }
+
+
+    static int32_t frame_size(int32_t data_size, uint32_t saved_xmm, bool entry_aligned)
+    {
+        int32_t sz = data_size;
+        for (uint32_t r = saved_xmm; r; r &= r - 1) {
+            sz += 16;
+        }
+        return sz ? ((sz + 15) & ~15) + (entry_aligned ? 0 : 8) : 0;  // the return address is 8 bytes
+    }
+
+
+    // saves/restores the registers in saved_xmm, from offset in the frame onwards
+    static void save_restore_xmm(mexce_charstream& cs, bool save, int32_t offset, uint32_t saved_xmm)
+    {
+        for (int r = 0; r < 16; r++) {
+            if (saved_xmm & (1u << r)) {
+                if (r >= 8) cs < 0x44;                          // REX.R
+                cs < 0x0f < (save ? 0x11 : 0x10) < (0x84 | (r & 7) << 3) < 0x24;
+                cs << offset;                                   // movups      [rsp+disp32], xmm / xmm, [rsp+disp32]
+                offset += 16;
+            }
+        }
+    }
+
+
+    static void emit_prologue(mexce_charstream& cs, int32_t data_size, uint32_t saved_xmm, bool entry_aligned)
+    {
+        if (int32_t sz = frame_size(data_size, saved_xmm, entry_aligned)) {
+            cs < 0x48 < 0x81 < 0xec; cs << sz;                  // sub         rsp, imm32
+            save_restore_xmm(cs, true, data_size, saved_xmm);
+        }
+    }
+
+
+    static void emit_epilogue(mexce_charstream& cs, int32_t data_size, uint32_t saved_xmm, bool entry_aligned)
+    {
+        if (int32_t sz = frame_size(data_size, saved_xmm, entry_aligned)) {
+            save_restore_xmm(cs, false, data_size, saved_xmm);
+            cs < 0x48 < 0x81 < 0xc4; cs << sz;                  // add         rsp, imm32
+        }
+    }
+
+
+    void emit_prologue(mexce_charstream& cs) const
+    {
+        emit_prologue(cs, frame_data_size(), callee_saved_xmm(), false);
+    }
+
+
+    void emit_epilogue(mexce_charstream& cs) const
+    {
+        emit_epilogue(cs, frame_data_size(), callee_saved_xmm(), false);
+    }
+};
+
+
+
+// Polynomial implementations of the transcendental functions, for the SSE/AVX backends.
+// They replace the microcoded x87 instructions (fsin, fyl2x, f2xm1...) with arithmetic that
+// is evaluated for all the lanes at once: the argument is reduced to a small interval, with
+// Cody-Waite constants, and the function is approximated there by a minimax polynomial
+// (those of fdlibm, for sin, cos and ln). The largest errors, measured against correctly
+// rounded results, are:
+//
+//   sin, cos   1.1 ULP     for |x| <= 2^20 (the x87 code is used for larger arguments)
+//   tan        2.2 ULP
+//   exp        1.0 ULP     (1.2 ULP without FMA)
+//   ln, log    0.8 ULP
+//   log2       1.7 ULP
+//   log10      1.8 ULP
+//   logb       1.7 ULP
+//   pow        1.1 ULP     (the x87 code is used if the CPU has no FMA)
+//
+// These are the kernels of accuracy::standard. With accuracy::fast, the polynomials are shorter
+// (Chebyshev fits) and the steps that carry extra precision are skipped, which leaves a relative
+// error of about 1e-13, and with accuracy::precise the x87 code is used instead, except for
+// sin, cos and tan.
+
+const double simd_round_magic = 6755399441055744.0;  // 1.5 * 2^52: v + magic rounds v to an integer
+
+
+// TRIG_SIN_COS and TRIG_COS_SIN compute both sin and cos of the argument: the first is the result,
+// and the second is stored to the temporary whose index is in folded_arg (see fuse_sin_cos)
+enum Trigonometric_function { TRIG_SIN, TRIG_COS, TRIG_TAN, TRIG_SIN_COS, TRIG_COS_SIN };
+
+
+inline Function Sin();
+inline Function Cos();
+
+
+// x = f(x_mem) by the x87 code of f in the lanes where |x_mem| > 2^20, and is kept in the others
+inline
+void bridge_large_arguments(Simd_compiler& c, const Function* f, const Mem& x_mem)
+{
+    int x = c.arg(0), r = c.tmp(0), m = c.tmp(1), k = c.tmp(2);
+    c.mov(r, x);
+    c.load(x, x_mem);
+    c.bridge(f);
+    c.load(m, x_mem);
+    c.arith(SIMD_MUL, m, m, m);
+    c.load_constant(k, 1099511627776.0);                // 2^40
+    c.select(x, c.compare(k, m, CMP_LT, k), x, r);
+}
+
+
+// the same for both results of TRIG_SIN_COS and TRIG_COS_SIN, by the x87 code of sin and cos
+inline
+void bridge_sin_cos(Simd_compiler& c, Trigonometric_function fn, const Mem& x_mem)
+{
+    static const Function sin_f = Sin(), cos_f = Cos();
+    int x = c.arg(0), t = c.tmp(3), i = (int)c.function->folded_arg;
+    c.mov(t, x);
+    c.load_slot(x, i);
+    bridge_large_arguments(c, fn == TRIG_SIN_COS ? &cos_f : &sin_f, x_mem);
+    c.store_slot(i, x);
+    c.mov(x, t);
+    bridge_large_arguments(c, fn == TRIG_SIN_COS ? &sin_f : &cos_f, x_mem);
+}
+
+
+inline
+bool simd_trigonometric(Simd_compiler& c, Trigonometric_function fn)
+{
+    // pi/2 in three parts: the first two have 33 significant bits, so that their products
+    // with k are exact for k < 2^20 (fdlibm __ieee754_rem_pio2)
+    static const double pio2_1  = 1.57079632673412561417e+00;
+    static const double pio2_2  = 6.07710050630396597660e-11;
+    static const double pio2_2t = 2.02226624879595063154e-21;
+    static const double sin_c[] = {
+         8.33333333332248946124e-03, -1.98412698298579493134e-04,  2.75573137070700676789e-06,
+        -2.50507602534068634195e-08,  1.58969099521155010221e-10
+    };
+    static const double sin_c1  = -1.66666666666666324348e-01;
+    static const double cos_c[] = {
+         4.16666666666666019037e-02, -1.38888888888741095749e-03,  2.48015872894767294178e-05,
+        -2.75573143513906633035e-07,  2.08757232129817482790e-09, -1.13596475577881948265e-11
+    };
+    static const double sin_fast_c[] = {                        // (sin(y) - y) / y^3
+        -0.16666666666663885,       0.008333333331079223,      -0.00019841266916985966,
+         2.755599092956532e-06,    -2.4805636241834762e-08
+    };
+    static const double cos_fast_c[] = {                        // (cos(y) - 1 + y^2/2) / y^4
+         0.04166666666666468,      -0.0013888888887277342,      2.4801585210990515e-05,
+        -2.7556369695573007e-07,    2.0700600483433117e-09
+    };
+
+    // accuracy::precise uses these kernels too: fsin, fcos and fptan reduce the argument with
+    // a 66-bit pi, which loses most of the result near multiples of pi/2 of large arguments
+    bool both = fn == TRIG_SIN_COS || fn == TRIG_COS_SIN;
+    bool fast = c.tier == accuracy::fast;
+
+    int x = c.arg(0), q = c.tmp(0), k = c.tmp(1), u = c.tmp(2), yl = c.tmp(3), v = c.tmp(4), w = c.tmp(5);
+    Mem x_mem = c.scratch_memory(2);
+    c.store(x_mem, x);
+
+    // x = k * pi/2 + y + yl, with |y| <= pi/4 - for cos, the quadrant in q is one more
+    double magic = simd_round_magic + (fn == TRIG_COS);
+    c.load_constant(q, 0.63661977236758134308);        // 2/pi
+    c.load_constant(k, magic);
+    c.mul_add(q, x, k);                                 // the low bits of q are the quadrant
+    c.arith(SIMD_SUB, k, q, k);
+    c.load_constant(u, pio2_1);
+    c.sub_mul(x, k, u);                                 // r1 = x - k * pio2_1
+    int z = k, sin_y = u, cos_y = x;
+    if (fast) {
+        // without yl
+        c.load_constant(u, pio2_2);
+        c.sub_mul(x, k, u);
+        c.load_constant(u, pio2_2t);
+        c.sub_mul(x, k, u);
+
+        // sin(y) = y * (1 + z * S(z)), which keeps the sign of -0, cos(y) = 1 - (z/2 - z^2 * C(z)),
+        // z = y^2
+        c.arith(SIMD_MUL, z, x, x);
+        c.polynomial(u, z, sin_fast_c, 5, v);
+        c.load_constant(v, 1.0);
+        c.mul_add(u, z, v);
+        c.arith(SIMD_MUL, sin_y, u, x);
+        c.polynomial(v, z, cos_fast_c, 5, w);
+        c.arith(SIMD_MUL, v, v, z);
+        c.arith(SIMD_MUL, v, v, z);
+        c.load_constant(w, 0.5);
+        c.arith(SIMD_MUL, w, w, z);
+        c.arith(SIMD_SUB, w, w, v);
+        c.load_constant(x, 1.0);
+        c.arith(SIMD_SUB, cos_y, x, w);
+    }
+    else {
+        c.load_constant(u, pio2_2);
+        c.arith(SIMD_MUL, u, u, k);
+        c.arith(SIMD_SUB, yl, x, u);                    // r2 = r1 - k * pio2_2
+        c.arith(SIMD_SUB, x, x, yl);
+        c.arith(SIMD_SUB, x, x, u);                     // (r1 - r2) - k * pio2_2
+        c.load_constant(u, pio2_2t);
+        c.arith(SIMD_MUL, u, u, k);
+        c.arith(SIMD_SUB, u, u, x);                     // the rest of k * pi/2
+        c.arith(SIMD_SUB, x, yl, u);                    // y
+        c.arith(SIMD_SUB, yl, yl, x);
+        c.arith(SIMD_SUB, yl, yl, u);                   // yl
+
+        // sin(y + yl) = y - ((z * (yl/2 - z*y * p(z)) - yl) - z*y * S1), z = y^2 (fdlibm __kernel_sin)
+        c.arith(SIMD_MUL, z, x, x);
+        c.polynomial(u, z, sin_c, 5, v);
+        c.arith(SIMD_MUL, v, z, x);
+        c.arith(SIMD_MUL, u, u, v);
+        c.load_constant(w, 0.5);
+        c.arith(SIMD_MUL, w, w, yl);
+        c.arith(SIMD_SUB, w, w, u);
+        c.arith(SIMD_MUL, w, w, z);
+        c.arith(SIMD_SUB, w, w, yl);
+        c.load_constant(u, sin_c1);
+        c.arith(SIMD_MUL, u, u, v);
+        c.arith(SIMD_SUB, w, w, u);
+        c.arith(SIMD_SUB, sin_y, x, w);
+
+        // cos(y + yl) = h + (((1 - h) - z/2) + (z^2 * p(z) - y * yl)), h = 1 - z/2 (fdlibm __kernel_cos)
+        c.polynomial(v, z, cos_c, 6, w);
+        c.arith(SIMD_MUL, v, v, z);
+        c.arith(SIMD_MUL, v, v, z);
+        c.arith(SIMD_MUL, yl, yl, x);
+        c.arith(SIMD_SUB, v, v, yl);
+        c.load_constant(w, 0.5);
+        c.arith(SIMD_MUL, w, w, z);
+        c.load_constant(x, 1.0);
+        c.arith(SIMD_SUB, x, x, w);                     // h
+        c.load_constant(yl, 1.0);
+        c.arith(SIMD_SUB, yl, yl, x);
+        c.arith(SIMD_SUB, yl, yl, w);
+        c.arith(SIMD_ADD, yl, yl, v);
+        c.arith(SIMD_ADD, cos_y, x, yl);
+    }
+
+    int odd = c.odd_lanes(z, q);
+    if (fn == TRIG_TAN) {
+        // tan(x) = sin(y)/cos(y), or -cos(y)/sin(y) in the odd quadrants
+        int odd_copy = odd;
+        if (c.encoding == SSE_ENCODING) {
+            c.mov(v, odd);                              // select() overwrites the mask
+            odd_copy = v;
+        }
+        c.load_constant(yl, -0.0);
+        c.logic(SIMD_XOR, yl, yl, cos_y);
+        c.select(yl, odd, yl, sin_y);
+        c.select(x, odd_copy, sin_y, cos_y);
+        c.arith(SIMD_DIV, x, yl, x);
+    }
+    else
+    if (both) {
+        // sin(x) as below, and cos(x) = sin(x + pi/2), from the next quadrant, whose bit 1 is
+        // bit 1 of q xor bit 0
+        int odd_copy = odd, cos_copy = cos_y;
+        if (c.encoding == SSE_ENCODING) {
+            c.mov(v, odd);
+            c.mov(w, cos_y);
+            odd_copy = v;
+            cos_copy = w;
+        }
+        c.select(yl, odd, cos_copy, sin_y);
+        c.select(x, odd_copy, sin_y, cos_y);
+        c.shift_left(z, q, 63);
+        c.shift_left(q, q, 62);
+        c.logic(SIMD_XOR, z, z, q);
+        c.load_constant(w, -0.0);
+        c.logic(SIMD_AND, q, q, w);
+        c.logic(SIMD_AND, z, z, w);
+        c.logic(SIMD_XOR, yl, yl, q);                   // sin(x)
+        c.logic(SIMD_XOR, x, x, z);                     // cos(x)
+        if (fn == TRIG_SIN_COS) {
+            c.store_slot((int)c.function->folded_arg, x);
+            c.mov(x, yl);
+        }
+        else {
+            c.store_slot((int)c.function->folded_arg, yl);
+        }
+    }
+    else {
+        // sin(x) = sin(y), cos(y), -sin(y), -cos(y), for the quadrants 0 to 3
+        c.select(x, odd, cos_y, sin_y);
+        c.shift_left(q, q, 62);
+        c.load_constant(w, -0.0);
+        c.logic(SIMD_AND, q, q, w);
+        c.logic(SIMD_XOR, x, x, q);
+    }
+
+    // the reduction needs |x| <= 2^20: the lanes beyond it, if any, take the x87 code
+    c.load(q, x_mem);
+    c.arith(SIMD_MUL, q, q, q);
+    c.load_constant(k, 1099511627776.0);                // 2^40
+    auto large = c.jump_if_any(c.compare(k, q, CMP_LT, u));
+    auto done = c.jump(-1);
+    c.set_jump_target(large);
+    if (both) {
+        bridge_sin_cos(c, fn, x_mem);
+    }
+    else {
+        bridge_large_arguments(c, c.function, x_mem);
+    }
+    c.set_jump_target(done);
+    return true;
+}
+
+
+// x = e^(x + lo), where lo is much smaller than x, or -1 for none - with a shorter
+// polynomial if fast
+inline
+void simd_exp(Simd_compiler& c, int x, int lo, bool fast)
+{
+    static const double ln2_hi  = 6.93147180369123816490e-01;   // 32 significant bits
+    static const double ln2_lo  = 1.90821492927058770002e-10;
+    static const double exp_c[] = {                             // (e^r - 1 - r) / r^2, |r| <= ln2/2
+        0.5,                        0.1666666666666667,         0.04166666666666667,
+        0.008333333333326141,       0.0013888888888883752,      0.00019841269874800493,
+        2.4801587325533363e-05,     2.7557255425746435e-06,     2.7557273661348637e-07,
+        2.510520637395701e-08,      2.0914679376583935e-09
+    };
+    static const double exp_fast_c[] = {
+        0.5,                        0.16666666666648303,        0.041666666666651364,
+        0.008333333353717156,       0.0013888888905871347,      0.0001984120875699232,
+        2.4801536409064087e-05,     2.7625102005388108e-06,     2.761379555451986e-07
+    };
+
+    int t = c.tmp(0), k = c.tmp(1), u = c.tmp(2), v = c.tmp(3), w = c.tmp(4);
+
+    // beyond these, the result is 0 or inf anyway, even with lo - maxpd/minpd return NaN
+    // in their second operand
+    c.load_constant(t, -800.0);
+    c.arith(SIMD_MAX, x, t, x);
+    c.load_constant(t, 750.0);
+    c.arith(SIMD_MIN, x, t, x);
+    if (lo >= 0) {
+        // lo is large too, when x is
+        c.load_constant(t, -1.0);
+        c.arith(SIMD_MAX, lo, t, lo);
+        c.load_constant(t, 1.0);
+        c.arith(SIMD_MIN, lo, t, lo);
+    }
+
+    // x = k * ln2 + r
+    c.load_constant(t, 1.44269504088896338700);        // 1/ln2
+    c.load_constant(k, simd_round_magic);
+    c.mul_add(t, x, k);
+    c.arith(SIMD_SUB, k, t, k);
+    c.load_constant(u, ln2_hi);
+    c.sub_mul(x, k, u);
+    c.load_constant(u, ln2_lo);
+    c.sub_mul(x, k, u);
+    if (lo >= 0) {
+        c.arith(SIMD_ADD, x, x, lo);
+    }
+
+    // e^r = 1 + r * (1 + r * p(r))
+    if (fast) {
+        c.polynomial(u, x, exp_fast_c, 9, v);
+    }
+    else {
+        c.polynomial(u, x, exp_c, 11, v);
+    }
+    c.load_constant(v, 1.0);
+    c.mul_add(u, x, v);
+    c.mul_add(u, x, v);
+
+    // 2^k = 2^k1 * 2^k2, with k1 = round(k/2), so that both are normal numbers - each factor is
+    // made by adding its exponent, as an integer, to the bits of 1.0
+    c.load_constant(t, 0.5);
+    c.load_constant(w, simd_round_magic);
+    c.mul_add(t, k, w);                                 // magic + k1
+    c.arith(SIMD_SUB, v, t, w);
+    c.arith(SIMD_SUB, k, k, v);
+    c.arith(SIMD_ADD, k, k, w);                         // magic + k2
+    c.load_constant(w, 1.0);
+    c.shift_left(t, t, 52);
+    c.add_int(t, t, w);
+    c.shift_left(k, k, 52);
+    c.add_int(k, k, w);
+    c.arith(SIMD_MUL, u, u, t);
+    c.arith(SIMD_MUL, x, u, k);
+}
+
+
+// Splits x > 0 to 2^e * m, with m in [sqrt(2)/2, sqrt(2)), and sets f = m - 1.
+// Subnormals are scaled by 2^52 first. t, u and v are overwritten.
+inline
+void simd_log_reduction(Simd_compiler& c, int x, int e, int f, int t, int u, int v)
+{
+    c.load_constant(t, 2.2250738585072014e-308);       // the smallest normal number
+    int subnormal = c.compare(x, t, CMP_LT, u);
+    c.load_constant(t, 4503599627370496.0);             // 2^52
+    c.load_constant(v, 1.0);
+    c.select(t, subnormal, t, v);
+    c.arith(SIMD_MUL, u, x, t);
+
+    // adding the bits of 1 - sqrt(2)/2 carries the mantissas above sqrt(2) into the exponent (musl)
+    c.load_constant(v, bits_to_double(0x3ff0000000000000 - 0x3fe6a09e00000000));
+    c.add_int(u, u, v);
+    c.load_constant(v, 4503599627370496.0);
+    c.shift_right(e, u, 52);
+    c.logic(SIMD_OR, e, e, v);                          // 2^52 + the biased exponent
+    c.shift_right(t, t, 52);
+    c.logic(SIMD_OR, t, t, v);                          // 2^52 + the biased exponent of the scale
+    c.arith(SIMD_SUB, e, e, t);
+    c.load_constant(v, bits_to_double(0x000fffffffffffff));
+    c.logic(SIMD_AND, u, u, v);
+    c.load_constant(v, bits_to_double(0x3fe6a09e00000000));
+    c.add_int(u, u, v);
+    c.load_constant(v, 1.0);
+    c.arith(SIMD_SUB, f, u, v);
+}
+
+
+enum Logarithm_base { LOG_E, LOG_2, LOG_10 };
+
+
+// x = log(x), with a shorter polynomial if fast
+inline
+void simd_log(Simd_compiler& c, int x, Logarithm_base base, bool fast)
+{
+    static const double ln2_hi  = 6.93147180369123816490e-01;
+    static const double ln2_lo  = 1.90821492927058770002e-10;
+    static const double lg_c[]  = {
+        6.666666666666735130e-01,   3.999999999940941908e-01,   2.857142874366239149e-01,
+        2.222219843214978396e-01,   1.818357216161805012e-01,   1.531383769920937332e-01,
+        1.479819860511658591e-01
+    };
+    static const double lg_fast_c[] = {
+        0.6666666666737509,         0.3999999879733759,         0.2857175453591449,
+        0.22191400830308503,        0.19362653714202008
+    };
+
+    int t = c.tmp(0), u = c.tmp(1), e = c.tmp(2), f = c.tmp(3), v = c.tmp(4), w = c.tmp(5);
+
+    simd_log_reduction(c, x, e, f, t, u, v);
+
+    // ln(1 + f) = f - f^2/2 + s * (f^2/2 + R(s^2)), s = f / (2 + f) (fdlibm __ieee754_log)
+    c.load_constant(v, 2.0);
+    c.arith(SIMD_ADD, v, v, f);
+    c.arith(SIMD_DIV, v, f, v);                         // s
+    c.arith(SIMD_MUL, t, v, v);
+    if (fast) {
+        c.polynomial(u, t, lg_fast_c, 5, w);
+    }
+    else {
+        c.polynomial(u, t, lg_c, 7, w);
+    }
+    c.arith(SIMD_MUL, u, u, t);                         // R
+    c.arith(SIMD_MUL, t, f, f);
+    c.load_constant(w, 0.5);
+    c.arith(SIMD_MUL, t, t, w);                         // f^2/2
+    c.arith(SIMD_ADD, u, u, t);
+    c.arith(SIMD_MUL, u, u, v);
+
+    if (base == LOG_E) {
+        // e * ln2_hi - ((f^2/2 - (s * (f^2/2 + R) + e * ln2_lo)) - f)
+        c.load_constant(v, ln2_lo);
+        c.arith(SIMD_MUL, v, v, e);
+        c.arith(SIMD_ADD, u, u, v);
+        c.arith(SIMD_SUB, t, t, u);
+        c.arith(SIMD_SUB, t, t, f);
+        c.load_constant(v, ln2_hi);
+        c.arith(SIMD_MUL, v, v, e);
+        c.arith(SIMD_SUB, v, v, t);
+    }
+    else {
+        // e * log(2) + ln(1 + f) * log(e), with log(2) in two parts for log10
+        c.arith(SIMD_SUB, t, t, u);
+        c.arith(SIMD_SUB, f, f, t);
+        c.load_constant(v, base == LOG_2 ? 1.44269504088896338700 : 4.34294481903251816668e-01);
+        c.arith(SIMD_MUL, f, f, v);
+        if (base == LOG_10) {
+            c.load_constant(v, 3.69423907715893078616e-13);
+            c.arith(SIMD_MUL, v, v, e);
+            c.arith(SIMD_ADD, f, f, v);
+            c.load_constant(v, 3.01029995663611771306e-01);
+            c.arith(SIMD_MUL, e, e, v);
+        }
+        c.arith(SIMD_ADD, v, e, f);
+    }
+
+    // x <= 0, or NaN: sqrt(x) - inf is -inf for zeros and NaN otherwise - and log(inf) = inf
+    c.load_constant(t, 0.0);
+    int not_positive = c.compare(t, x, CMP_NLT, u);
+    c.sqrt(f, x);
+    c.load_constant(e, std::numeric_limits<double>::infinity());
+    c.arith(SIMD_SUB, f, f, e);
+    c.select(v, not_positive, f, v);
+    int infinite = c.compare(x, e, CMP_EQ, u);
+    c.select(x, infinite, x, v);
+}
+
+
+// a = e^(b * ln(a)), for a >= 0 - a and b are also stored in a_mem and b_mem
+inline
+void simd_pow_exp_log(Simd_compiler& c, int a, int b, const Mem& a_mem, const Mem& b_mem)
+{
+    static const double ln2_hi  = 0.693147180559945286226764;
+    static const double ln2_lo  = 2.319046813846299558417771e-17;
+    static const double c23_hi  = 0.666666666666666629659233;   // 2/3
+    static const double c23_lo  = 3.70074341541718826e-17;
+    static const double t_c[]   = {                             // (2 atanh(s)/s - 2 - 2z/3) / z^2, z = s^2
+        0.4,                        0.28571428571429364,        0.22222222221656232,
+        0.18181818335314404,        0.15384594970895457,        0.13334804238225345,
+        0.11706248540922386,        0.11723051028097753
+    };
+
+    int t0 = c.tmp(0), t1 = c.tmp(1), t2 = c.tmp(2), t3 = c.tmp(3), t4 = c.tmp(4), t5 = c.tmp(5);
+
+    // a = 2^e * (1 + f)
+    int e = t0, f = t1;
+    simd_log_reduction(c, a, e, f, t2, t3, t4);
+
+    // s = f / (2 + f), as sh + sl
+    int d = t2, dl = t3, rd = t4, sh = t5, sl = t1;
+    c.load_constant(d, 2.0);
+    c.arith(SIMD_ADD, d, d, f);
+    c.load_constant(dl, 2.0);
+    c.arith(SIMD_SUB, dl, d, dl);
+    c.arith(SIMD_SUB, dl, f, dl);                       // 2 + f = d + dl
+    c.load_constant(rd, 1.0);
+    c.arith(SIMD_DIV, rd, rd, d);
+    c.arith(SIMD_MUL, sh, f, rd);
+    c.fnmadd(sl, sh, d);
+    c.fnmadd(sl, sh, dl);
+    c.arith(SIMD_MUL, sl, sl, rd);
+    c.arith(SIMD_ADD, t2, sh, sl);
+    c.arith(SIMD_SUB, t3, t2, sh);
+    c.arith(SIMD_SUB, sl, sl, t3);
+    sh = t2;
+
+    // s^3 = ch + cl, where s^2 = zh + zl
+    int zh = t3, nzl = t4, ch = t5, ncl = a;
+    c.arith(SIMD_MUL, zh, sh, sh);
+    c.mov(nzl, zh);
+    c.fnmadd(nzl, sh, sh);
+    c.arith(SIMD_ADD, ch, sh, sh);
+    c.fnmadd(nzl, ch, sl);                              // -zl
+    c.arith(SIMD_MUL, ch, zh, sh);
+    c.mov(ncl, ch);
+    c.fnmadd(ncl, zh, sh);
+    c.fmadd(ncl, nzl, sh);
+    c.fnmadd(ncl, zh, sl);                              // -cl
+
+    // q = 2/3 + z * T(z) = qh + ql
+    int tz = t4, qh = b, ql = t3;
+    c.polynomial(tz, zh, t_c, 8, b);
+    c.arith(SIMD_MUL, tz, tz, zh);
+    c.load_constant(ql, c23_hi);
+    c.arith(SIMD_ADD, qh, ql, tz);
+    c.arith(SIMD_SUB, ql, ql, qh);
+    c.arith(SIMD_ADD, ql, ql, tz);
+    c.load_constant(tz, c23_lo);
+    c.arith(SIMD_ADD, ql, ql, tz);
+
+    // ln(1 + f) = 2s + s^3 * q: the low parts are summed in sl
+    int th = t4;
+    c.arith(SIMD_ADD, sl, sl, sl);
+    c.fnmadd(sl, ncl, qh);
+    c.fmadd(sl, ch, ql);
+    c.arith(SIMD_MUL, th, ch, qh);
+    c.mov(a, th);
+    c.fnmadd(a, ch, qh);
+    c.arith(SIMD_SUB, sl, sl, a);
+
+    // + e * ln2
+    int lh = a;
+    c.load_constant(t3, ln2_hi);
+    c.arith(SIMD_MUL, lh, e, t3);
+    c.mov(b, lh);
+    c.fnmadd(b, e, t3);
+    c.arith(SIMD_SUB, sl, sl, b);
+    c.load_constant(t3, ln2_lo);
+    c.fmadd(sl, e, t3);
+
+    // h = e * ln2 + 2s + s^3 * q, in order of magnitude
+    c.arith(SIMD_ADD, sh, sh, sh);
+    c.arith(SIMD_ADD, t0, lh, sh);
+    c.arith(SIMD_SUB, t3, t0, lh);
+    c.arith(SIMD_SUB, t3, sh, t3);
+    c.arith(SIMD_ADD, sl, sl, t3);
+    c.arith(SIMD_ADD, a, t0, th);
+    c.arith(SIMD_SUB, t3, a, t0);
+    c.arith(SIMD_SUB, t3, th, t3);
+    c.arith(SIMD_ADD, sl, sl, t3);
+
+    // ln(0) = -inf, ln(inf) = inf, ln(NaN) = NaN
+    c.load(t0, a_mem);
+    c.load_constant(t3, bits_to_double(0x7fffffffffffffff));
+    c.logic(SIMD_AND, t0, t0, t3);
+    c.load_constant(t3, 0.0);
+    int not_positive = c.compare(t3, t0, CMP_NLT, t4);
+    c.load_constant(t5, -std::numeric_limits<double>::infinity());
+    c.select(a, not_positive, t5, a);
+    c.load_constant(t3, std::numeric_limits<double>::infinity());
+    int not_finite = c.compare(t0, t3, CMP_NLT, t4);
+    c.select(a, not_finite, t0, a);
+
+    // b * ln(a) = ph + pl - pl is NaN if ph is infinite, and then it is ignored
+    c.load(b, b_mem);
+    c.arith(SIMD_MUL, t0, b, a);
+    c.mov(t3, t0);
+    c.fnmadd(t3, b, a);
+    c.arith(SIMD_MUL, t4, b, sl);
+    c.arith(SIMD_SUB, t4, t4, t3);
+    int ordered = c.compare(t4, t4, CMP_ORD, t3);
+    c.select_or_zero(b, ordered, t4);
+    c.mov(a, t0);
+    simd_exp(c, a, b, false);
+}
+
+
+// Double-double arithmetic, on pairs (h, l) that stand for h + l, for the powers that are computed
+// by multiplications - requires FMA. The registers t0 and t1 are overwritten.
+
+// (h, l) = (h, l) * (h2, l2), where (h2, l2) may be (h, l)
+inline
+void simd_dd_mul(Simd_compiler& c, int h, int l, int h2, int l2, int t0, int t1)
+{
+    c.arith(SIMD_MUL, t0, h, l2);
+    c.fmadd(t0, l, h2);                                 // the cross terms
+    c.arith(SIMD_MUL, l, h, h2);
+    c.mov(t1, l);
+    c.fnmadd(t1, h, h2);                                // minus the rounding error of h * h2
+    c.mov(h, l);
+    c.arith(SIMD_SUB, l, t0, t1);
+}
+
+
+// (h, l) = sqrt(h + l)
+inline
+void simd_dd_sqrt(Simd_compiler& c, int h, int l, int t0, int t1)
+{
+    c.sqrt(t0, h);
+    c.mov(t1, h);
+    c.fnmadd(t1, t0, t0);                               // h - s^2, which is exact
+    c.arith(SIMD_ADD, t1, t1, l);
+    c.load_constant(l, 0.5);
+    c.arith(SIMD_MUL, t1, t1, l);
+    c.arith(SIMD_DIV, l, t1, t0);                       // (h + l - s^2) / (2 s)
+    c.mov(h, t0);
+}
+
+
+// (h, l) = 1 / (h + l)
+inline
+void simd_dd_reciprocal(Simd_compiler& c, int h, int l, int t0, int t1)
+{
+    c.load_constant(t0, 1.0);
+    c.arith(SIMD_DIV, t1, t0, h);
+    c.fnmadd(t0, t1, h);                                // 1 - q h, which is exact
+    c.fnmadd(t0, t1, l);
+    c.arith(SIMD_MUL, l, t1, t0);
+    c.mov(h, t1);
+}
+
+
+// h = h + l, unless h is zero, infinite or NaN, when l is 0 or NaN and h is kept as it is
+inline
+void simd_dd_round(Simd_compiler& c, int h, int l, int t0, int t1)
+{
+    c.load_constant(t0, bits_to_double(0x7fffffffffffffff));
+    c.logic(SIMD_AND, t1, t0, h);
+    c.logic(SIMD_AND, t0, t0, l);
+    int small = c.compare(t0, t1, CMP_LT, t0);          // |l| < |h|
+    c.arith(SIMD_ADD, t1, h, l);
+    c.select(h, small, t1, h);
+}
+
+
+// a = pow(a, b), with the same results as the x87 code for negative and zero bases
+// Integer exponents up to 63 are computed by binary exponentiation (in double-double arithmetic,
+// but for the fast tier), and the rest by logarithms, which are skipped when all the lanes have
+// such an exponent. The logarithms are in double-double arithmetic (hi + lo), since b * ln(a)
+// needs about 64 bits for the result to be accurate (as in SLEEF's pow). The fast version is
+// just e^(b * ln(a)), whose relative error grows with |b * ln(a)|. Without FMA, it is the
+// x87 code. integer_exponents: false if b is known not to be such an integer.
+inline
+bool simd_pow(Simd_compiler& c, bool integer_exponents)
+{
+    bool fast = c.tier == accuracy::fast;
+    if (c.tier == accuracy::precise || (!fast && !c.fma)) {
+        return false;
+    }
+
+    int a = c.arg(0), b = c.arg(1);
+    int t0 = c.tmp(0), t1 = c.tmp(1), t2 = c.tmp(2), t3 = c.tmp(3), t4 = c.tmp(4), t5 = c.tmp(5);
+    Mem a_mem = c.scratch_memory(0), b_mem = c.scratch_memory(1), p_mem = c.scratch_memory(2);
+    c.store(a_mem, a);
+    c.store(b_mem, b);
+
+    std::streamoff done = -1;
+    if (integer_exponents) {
+        // |b - round(b)| + max(|b| - 63, 0) is 0 for such b only (and NaN for infinite or NaN b)
+        c.round(t0, b, 0);
+        c.arith(SIMD_SUB, t0, b, t0);
+        c.load_constant(t1, bits_to_double(0x7fffffffffffffff));
+        c.logic(SIMD_AND, t0, t0, t1);
+        c.logic(SIMD_AND, t2, t1, b);                   // |b|
+        c.load_constant(t3, 63.0);
+        c.arith(SIMD_SUB, t3, t2, t3);
+        c.load_constant(t4, 0.0);
+        c.arith(SIMD_MAX, t3, t4, t3);
+        c.arith(SIMD_ADD, t0, t0, t3);
+        c.store(p_mem, t0);
+
+        // as in the x87 code: t0 = product of (bit i of |b| ? a^(2^i) : 1), where the bits
+        // are in the mantissa of |b| + 2^52
+        c.load_constant(t3, 4503599627370496.0);
+        c.arith(SIMD_ADD, t2, t2, t3);
+        if (fast) {
+            for (int i = 0; i < 6; i++) {
+                uint64_t bit_i = 0x4330000000000000ull | 1ull << i;
+                c.load_constant(t3, bits_to_double(bit_i));
+                c.logic(SIMD_AND, t4, t2, t3);
+                int bit = c.compare(t4, t3, CMP_EQ, t1);
+                int power = a;
+                if (c.encoding == SSE_ENCODING) {
+                    c.mov(t3, a);                       // select() overwrites if_true
+                    power = t3;
+                }
+                c.load_constant(t4, 1.0);
+                c.select(t4, bit, power, t4);
+                if (i == 0) {
+                    c.mov(t0, t4);
+                }
+                else {
+                    c.arith(SIMD_MUL, t0, t0, t4);
+                }
+                if (i < 5) {
+                    c.arith(SIMD_MUL, a, a, a);
+                }
+            }
+            c.load_constant(t3, 1.0);
+            c.arith(SIMD_DIV, t3, t3, t0);
+            c.load_constant(t4, 0.0);
+            int negative = c.compare(b, t4, CMP_LT, t1);
+            c.select(a, negative, t3, t0);
+        }
+        else {
+            // in double-double arithmetic: the powers in (a, b) and the product in (t0, t1)
+            c.load_constant(b, 0.0);
+            for (int i = 0; i < 6; i++) {
+                uint64_t bit_i = 0x4330000000000000ull | 1ull << i;
+                c.load_constant(t3, bits_to_double(bit_i));
+                c.logic(SIMD_AND, t4, t2, t3);
+                int bit = c.compare(t4, t3, CMP_EQ, t3);
+                if (i == 0) {
+                    c.load_constant(t0, 1.0);
+                    c.select(t0, bit, a, t0);
+                    c.load_constant(t1, 0.0);
+                }
+                else {
+                    // as simd_dd_mul, by (a, b) or (1, 0)
+                    c.load_constant(t4, 1.0);
+                    c.select(t4, bit, a, t4);
+                    c.arith(SIMD_MUL, t5, t0, b);
+                    c.select_or_zero(t5, bit, t5);
+                    c.fmadd(t5, t1, t4);
+                    c.arith(SIMD_MUL, t1, t0, t4);
+                    c.mov(t3, t1);
+                    c.fnmadd(t3, t0, t4);
+                    c.mov(t0, t1);
+                    c.arith(SIMD_SUB, t1, t5, t3);
+                }
+                if (i < 5) {
+                    simd_dd_mul(c, a, b, a, b, t3, t4);
+                }
+            }
+            c.mov(t4, t0);
+            c.mov(t5, t1);
+            simd_dd_reciprocal(c, t4, t5, t2, t3);
+            c.load(b, b_mem);
+            c.load_constant(t2, 0.0);
+            int negative = c.compare(b, t2, CMP_LT, t3);
+            c.select(t0, negative, t4, t0);
+            c.select(t1, negative, t5, t1);
+            simd_dd_round(c, t0, t1, t2, t3);
+            c.mov(a, t0);
+        }
+        c.load(t0, p_mem);
+        c.load_constant(t4, 0.0);
+        auto logarithms = c.jump_if_any(c.compare(t0, t4, CMP_NEQ, t1));
+        done = c.jump(-1);
+
+        // the other lanes: the result of each one must not depend on the others
+        c.set_jump_target(logarithms);
+        c.store(p_mem, a);
+        c.load(a, a_mem);
+        c.load(b, b_mem);
+    }
+
+    c.load_constant(t2, bits_to_double(0x7fffffffffffffff));
+    c.logic(SIMD_AND, a, a, t2);
+
+    if (fast) {
+        simd_log(c, a, LOG_E, false);
+        c.arith(SIMD_MUL, a, a, b);
+        simd_exp(c, a, -1, true);
+    }
+    else {
+        simd_pow_exp_log(c, a, b, a_mem, b_mem);
+    }
+
+    // x87 computes -(|a|^b) for negative bases, unless b is an integer up to 63, when it
+    // multiplies, or an even integer that fist can store - and for zero bases, it returns
+    // a itself, unless b is an integer up to 63
+    c.load(b, b_mem);
+    c.load_constant(t1, simd_round_magic);
+    c.arith(SIMD_ADD, t2, b, t1);
+    c.arith(SIMD_SUB, t2, t2, t1);
+    c.arith(SIMD_SUB, t3, b, t2);                       // b - round(b)
+    c.load_constant(t0, 0.5);
+    c.arith(SIMD_MUL, t0, t0, b);
+    c.arith(SIMD_ADD, t2, t0, t1);
+    c.arith(SIMD_SUB, t2, t2, t1);
+    c.arith(SIMD_SUB, t0, t0, t2);                      // b/2 - round(b/2)
+    c.load_constant(t1, bits_to_double(0x7fffffffffffffff));
+    c.logic(SIMD_AND, t5, t1, b);
+    c.logic(SIMD_AND, t0, t0, t1);
+    c.logic(SIMD_AND, t3, t3, t1);
+    c.arith(SIMD_ADD, t0, t0, t3);
+    c.load_constant(t2, 2147483647.0);
+    int large = c.compare(t2, t5, CMP_LT, t4);
+    c.load_constant(t1, 1.0);
+    c.select(t0, large, t1, t0);                        // zero if b is an even integer up to 2^31 - 1
+    c.load_constant(t2, 63.0);
+    large = c.compare(t2, t5, CMP_LT, t4);
+    c.load_constant(t1, 1.0);
+    c.select(t3, large, t1, t3);                        // zero if b is an integer up to 63
+    c.load_constant(t1, 0.0);
+    int odd = c.compare(t0, t1, CMP_NEQ, t4);
+    c.load(t2, a_mem);
+    c.select_or_zero(t4, odd, t2);
+    c.load_constant(t0, -0.0);
+    c.logic(SIMD_AND, t4, t4, t0);
+    c.logic(SIMD_OR, a, a, t4);
+    int generic = c.compare(t3, t1, CMP_NEQ, t4);
+    c.select(t0, generic, t2, a);
+    c.load(t2, a_mem);
+    int zero_base = c.compare(t2, t1, CMP_EQ, t4);
+    c.select(a, zero_base, t0, a);
+
+    // b = 0 gives 1, and so does b = NaN, which ftst cannot tell from 0
+    int no_exponent = c.compare(t1, t5, CMP_NLT, t4);
+    c.load_constant(t2, 1.0);
+    c.select(a, no_exponent, t2, a);
+    if (integer_exponents) {
+        c.load_constant(t1, 0.0);
+        int multiplied = c.compare(t3, t1, CMP_EQ, t4);
+        c.load(t2, p_mem);
+        c.select(a, multiplied, t2, a);
+    }
+    if (done >= 0) {
+        c.set_jump_target(done);
+    }
+    return true;
+}
+
+
+
+inline Function Sin()
+{
+    static uint8_t code[] = {
+        0xd9, 0xfe                                  // fsin
+    };
+    return Function("sin", 1, 0, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        return simd_trigonometric(c, TRIG_SIN);
+    });
+}
+
+
+inline Function Cos()
+{
+#ifndef MEXCE_ACCURACY
+    static uint8_t code[] = {
+        0xd9, 0xff                                  // fcos
+    };
+#else
+
+    static uint64_t mfactors[] = {  // Maclaurin expansion factors (80-bit)
+
+#if (MEXCE_ACCURACY > 9)
+        0x9c9962823eb07306, 0x000000000000bf93,     // - 1 / (30!),
+#endif
+#if (MEXCE_ACCURACY > 8)
+        0x850c5131a842e9ba, 0x0000000000003f9d,     //   1 / (28!),
+#endif
+#if (MEXCE_ACCURACY > 7)
+        0xc4742fe35272cd1c, 0x000000000000bfa6,     // - 1 / (26!),
+#endif
+#if (MEXCE_ACCURACY > 6)
+        0xf96780cb97abbe65, 0x0000000000003faf,     //   1 / (24!),
+#endif
 #if (MEXCE_ACCURACY > 5)
         0x8671cb6dbfc294a3, 0x000000000000bfb9,     // - 1 / (22!),
 #endif
 #if (MEXCE_ACCURACY > 4)
         0xf2a15d201011283d, 0x0000000000003fc1,     //   1 / (20!),
 #endif
-#if (MEXCE_ACCURACY > 3)
-        0xb413c31dcbecbbde, 0x000000000000bfca,     // - 1 / (18!),
+#if (MEXCE_ACCURACY > 3)
+        0xb413c31dcbecbbde, 0x000000000000bfca,     // - 1 / (18!),
+#endif
+#if (MEXCE_ACCURACY > 2)
+        0xd73f9f399dc0f88f, 0x0000000000003fd2,     //   1 / (16!),
+#endif
+#if (MEXCE_ACCURACY > 1)
+        0xc9cba54603e4e906, 0x000000000000bfda,     // - 1 / (14!),
+#endif
+#if (MEXCE_ACCURACY > 0)
+        0x8f76c77fc6c4bdaa, 0x0000000000003fe2,     //   1 / (12!),
+#endif
+        0x93f27dbbc4fae397, 0x000000000000bfe9,     // - 1 / (10!),  
+        0xd00d00d00d00d00d, 0x0000000000003fef,     //   1 / ( 8!),
+        0xb60b60b60b60b60b, 0x000000000000bff5,     // - 1 / ( 6!),
+        0xaaaaaaaaaaaaaaab, 0x0000000000003ffa,     //   1 / ( 4!),
+        0x8000000000000000, 0x000000000000bffe,     // - 1 / ( 2!),
+        0x8000000000000000, 0x0000000000003fff      //   1   
+    };
+
+    static uint8_t code[] = {
+        0xd9, 0xeb,                                 // fldpi                    }
+        0xdc, 0xc0,                                 // fadd        st(0),st     }
+        0xd9, 0xc9,                                 // fxch        st(1)        } bring arg to range [0, 2*pi)
+        0xd9, 0xf5,                                 // fprem1                   }
+        0xdd, 0xd9,                                 // fstp        st(1)        }
+
+        0xdc, 0xc8,                                 // fmul        st(0),st  
+        0xb8, 0, 0, 0, 0,                           // mov         eax, dword ptr [addr_fct26]  
+        0xdb, 0x28,                                 // fld         tword ptr [eax]  
+        0xd8, 0xc9,                                 // fmul        st,st(1)  
+        0xdb, 0x68, 0x10,                           // fld         tword ptr [eax+8]  
+        0xde, 0xc1,                                 // faddp       st(1),st  
+        0xd8, 0xc9,                                 // fmul        st,st(1)  
+        0xdb, 0x68, 0x20,                           // fld         tword ptr [eax+10h]  
+        0xde, 0xc1,                                 // faddp       st(1),st  
+        0xd8, 0xc9,                                 // fmul        st,st(1)  
+        0xdb, 0x68, 0x30,                           // fld         tword ptr [eax+18h]  
+        0xde, 0xc1,                                 // faddp       st(1),st  
+        0xd8, 0xc9,                                 // fmul        st,st(1)  
+        0xdb, 0x68, 0x40,                           // fld         tword ptr [eax+20h]  
+        0xde, 0xc1,                                 // faddp       st(1),st  
+        0xd8, 0xc9,                                 // fmul        st,st(1)  
+        0xdb, 0x68, 0x50,                           // fld         tword ptr [eax+28h]  
+        0xde, 0xc1,                                 // faddp       st(1),st  
+
+#if (MEXCE_ACCURACY > 0)
+        0xd8, 0xc9,                                 // fmul        st,st(1)  
+        0xdb, 0x68, 0x60,                           // fld         tword ptr [eax+30h]  
+        0xde, 0xc1,                                 // faddp       st(1),st  
+#endif
+#if (MEXCE_ACCURACY > 1)
+        0xd8, 0xc9,                                 // fmul        st,st(1)  
+        0xdb, 0x68, 0x70,                           // fld         tword ptr [eax+38h]  
+        0xde, 0xc1,                                 // faddp       st(1),st  
+#endif
+#if (MEXCE_ACCURACY > 2)
+        0xd8, 0xc9,                                 // fmul        st,st(1)  
+        0x05, 0x80, 0x00, 0x00, 0x00,               // add         eax, 80h
+        0xdb, 0x28,                                 // fld         tword ptr [eax]  
+        0xde, 0xc1,                                 // faddp       st(1),st  
+#endif
+#if (MEXCE_ACCURACY > 3)
+        0xd8, 0xc9,                                 // fmul        st,st(1)  
+        0xdb, 0x68, 0x10,                           // fld         tword ptr [eax+10h]  
+        0xde, 0xc1,                                 // faddp       st(1),st
+#endif
+#if (MEXCE_ACCURACY > 4)
+        0xd8, 0xc9,                                 // fmul        st,st(1)  
+        0xdb, 0x68, 0x20,                           // fld         tword ptr [eax+20h]  
+        0xde, 0xc1,                                 // faddp       st(1),st  
+#endif
+#if (MEXCE_ACCURACY > 5)
+        0xd8, 0xc9,                                 // fmul        st,st(1)  
+        0xdb, 0x68, 0x30,                           // fld         tword ptr [eax+30h]  
+        0xde, 0xc1,                                 // faddp       st(1),st  
+#endif
+#if (MEXCE_ACCURACY > 6)
+        0xd8, 0xc9,                                 // fmul        st,st(1)  
+        0xdb, 0x68, 0x40,                           // fld         tword ptr [eax+40h]  
+        0xde, 0xc1,                                 // faddp       st(1),st  
+#endif
+#if (MEXCE_ACCURACY > 7)
+        0xd8, 0xc9,                                 // fmul        st,st(1)  
+        0xdb, 0x68, 0x50,                           // fld         tword ptr [eax+50h]  
+        0xde, 0xc1,                                 // faddp       st(1),st  
 #endif
-#if (MEXCE_ACCURACY > 2)
-        0xd73f9f399dc0f88f, 0x0000000000003fd2,     //   1 / (16!),
+#if (MEXCE_ACCURACY > 8)
+        0xd8, 0xc9,                                 // fmul        st,st(1)  
+        0xdb, 0x68, 0x60,                           // fld         tword ptr [eax+60h]  
+        0xde, 0xc1,                                 // faddp       st(1),st  
 #endif
-#if (MEXCE_ACCURACY > 1)
-        0xc9cba54603e4e906, 0x000000000000bfda,     // - 1 / (14!),
+#if (MEXCE_ACCURACY > 9)
+        0xd8, 0xc9,                                 // fmul        st,st(1)  
+        0xdb, 0x68, 0x70,                           // fld         tword ptr [eax+70h]  
+        0xde, 0xc1,                                 // faddp       st(1),st  
 #endif
-#if (MEXCE_ACCURACY > 0)
-        0x8f76c77fc6c4bdaa, 0x0000000000003fe2,     //   1 / (12!),
+        0xdd, 0xd9                                  // fstp        st(1)  
+    };
+
+    *((void**)(code+13)) = (void*)mfactors;
 #endif
-        0x93f27dbbc4fae397, 0x000000000000bfe9,     // - 1 / (10!),  
-        0xd00d00d00d00d00d, 0x0000000000003fef,     //   1 / ( 8!),
-        0xb60b60b60b60b60b, 0x000000000000bff5,     // - 1 / ( 6!),
-        0xaaaaaaaaaaaaaaab, 0x0000000000003ffa,     //   1 / ( 4!),
-        0x8000000000000000, 0x000000000000bffe,     // - 1 / ( 2!),
-        0x8000000000000000, 0x0000000000003fff      //   1   
+
+    return Function("cos", 1, 0, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        return simd_trigonometric(c, TRIG_COS);
+    });
+}
+
+
+inline Function Tan()
+{
+    static uint8_t code[] = {
+        0xd9, 0xf2,                                 // fptan
+        0xdd, 0xd8                                  // fstp        st(0)
+    };
+    return Function("tan", 1, 1, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        return simd_trigonometric(c, TRIG_TAN);
+    });
+}
+
+
+inline Function Abs()
+{
+    static uint8_t code[] = {
+        0xd9, 0xe1                                  // fabs
+    };
+    return Function("abs", 1, 0, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        c.load_constant(c.tmp(0), bits_to_double(0x7fffffffffffffff));
+        c.logic(SIMD_AND, c.arg(0), c.arg(0), c.tmp(0));
+        return true;
+    });
+}
+
+
+inline Function Sfc()
+{
+    static uint8_t code[] = {
+        0xd9, 0xf4,                                 // fxtract
+        0xdd, 0xd9                                  // fstp        st(1)
+    };
+    return Function("sfc", 1, 1, sizeof(code), code);
+}
+
+
+inline Function Expn()
+{
+    static uint8_t code[] = {
+        0xd9, 0xf4,                                 // fxtract
+        0xdd, 0xd8                                  // fstp        st(0)
+    };
+    return Function("expn", 1, 1, sizeof(code), code);
+}
+
+
+inline Function Sign()
+{
+    static uint8_t code[]  =  {
+        0xd9, 0xee,                                 // fldz
+        0xdf, 0xf1,                                 // fcomip      st, st(1)
+        0xdd, 0xd8,                                 // fstp        st(0)
+        0xd9, 0xe8,                                 // fld1
+        0xd9, 0xe8,                                 // fld1
+        0xd9, 0xe0,                                 // fchs
+        0xda, 0xc1,                                 // fcmovb      st, st(1)
+        0xdd, 0xd9                                  // fstp        st(1)
+    };
+    return Function("sign", 1, 1, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        // like the x87 code, this treats 0 (and -0) as negative and NaN as positive
+        c.load_constant(c.tmp(3), 0.0);
+        c.compare_select(c.arg(0), c.arg(0), c.tmp(3), CMP_NLE, 1.0, -1.0);
+        return true;
+    });
+}
+
+
+inline Function Signp()
+{
+    static uint8_t code[]  =  {
+        0xd9, 0xe8,                                 // fld1
+        0xd9, 0xee,                                 // fldz
+        0xdb, 0xf2,                                 // fcomi       st, st(2)
+        0xdd, 0xda,                                 // fstp        st(2)
+        0xdb, 0xc1,                                 // fcmovnb     st, st(1)
+        0xdd, 0xd9                                  // fstp        st(1)
+    };
+    return Function("signp", 1, 2, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        c.load_constant(c.tmp(3), 0.0);
+        c.compare_select(c.arg(0), c.arg(0), c.tmp(3), CMP_NLE, 1.0, 0.0);
+        return true;
+    });
+}
+
+
+inline Function Sqrt()
+{
+    static uint8_t code[] = {
+        0xd9, 0xfa                                  // fsqrt
+    };
+    return Function("sqrt", 1, 0, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        c.sqrt(c.arg(0), c.arg(0));
+        return true;
+    });
+}
+
+
+// the number of multiplications of x^n by binary exponentiation
+inline
+int pow_multiplications(uint32_t n)
+{
+    int count = -2;
+    for (; n; n >>= 1) {
+        count += 1 + (n & 1);
+    }
+    return count;
+}
+
+
+// Splits x^n into (((x^f0)^f1)^...), where each power is computed by binary exponentiation,
+// with the fewest multiplications, e.g. x^15 = (x^3)^5 takes 5 instead of 6. Unlike a
+// general addition chain, this needs no more registers than a single power.
+inline
+std::vector<uint32_t> pow_chain(uint32_t n, std::map<uint32_t, std::vector<uint32_t>>& known)
+{
+    auto it = known.find(n);
+    if (it != known.end()) {
+        return it->second;
+    }
+    if (n == 0) {
+        return {};
+    }
+    std::vector<uint32_t> best = { n };
+    int best_count = pow_multiplications(n);
+    for (uint32_t p = 2; p * p <= n; p++) {
+        if (n % p) {
+            continue;
+        }
+        auto a = pow_chain(p, known);
+        auto b = pow_chain(n / p, known);
+        int count = 0;
+        for (auto f : a) count += pow_multiplications(f);
+        for (auto f : b) count += pow_multiplications(f);
+        if (count < best_count) {
+            best_count = count;
+            best = a;
+            best.insert(best.end(), b.begin(), b.end());
+        }
+    }
+    return known[n] = best;
+}
+
+
+inline
+std::vector<uint32_t> pow_chain(uint32_t n)
+{
+    std::map<uint32_t, std::vector<uint32_t>> known;
+    return pow_chain(n, known);
+}
+
+
+enum Pow_step
+{
+    POW_SQUARE,                                     // x = x * x
+    POW_SAVE,                                       // y = x
+    POW_SQUARE_SAVED,                               // y = y * y
+    POW_MULTIPLY                                    // x = x * y
+};
+
+
+// The steps of x^m by pow_chain: each factor of the chain raises x to it by binary
+// exponentiation from the lowest bit, with the powers of 2 in y.
+inline
+std::vector<Pow_step> pow_steps(uint32_t m)
+{
+    std::vector<Pow_step> steps;
+    for (uint32_t p : pow_chain(m)) {
+        int i = 0;
+        for (; !(p >> i & 1); i++) {
+            steps.push_back(POW_SQUARE);
+        }
+        if (p >> (i + 1)) {
+            steps.push_back(POW_SAVE);
+            while (p >> ++i) {
+                steps.push_back(POW_SQUARE_SAVED);
+                if (p >> i & 1) {
+                    steps.push_back(POW_MULTIPLY);
+                }
+            }
+        }
+    }
+    return steps;
+}
+
+
+// A bound of the relative error of x^(+/- m / 2^roots) by the square roots, the steps of x^m
+// and the reciprocal, in units of the relative error of one rounding (2^-53 in double)
+inline
+double pow_error_bound(const std::vector<Pow_step>& steps, int roots, bool reciprocal)
+{
+    double ex = 0, ey = 0;
+    for (int i = 0; i < roots; i++) {
+        ex = ex / 2 + 1;
+    }
+    for (auto step : steps) {
+        switch (step) {
+            case POW_SQUARE:        ex = 2 * ex + 1;    break;
+            case POW_SAVE:          ey = ex;            break;
+            case POW_SQUARE_SAVED:  ey = 2 * ey + 1;    break;
+            case POW_MULTIPLY:      ex = ex + ey + 1;   break;
+        }
+    }
+    return ex + reciprocal;
+}
+
+
+// The constant exponents that pow_optimizer computes without logarithms, as +/- m / 2^roots:
+// integers and their halves and quarters, e.g. x^1.5 = sqrt(x)^3, as long as the error of the
+// steps in the x87 registers (2^-64 per rounding) stays within 2^-56, 1/8 of the last bit
+// of a double. Larger ones, such as x^1000, take the logarithms.
+inline
+bool split_pow_exponent(double e, uint32_t& m, int& roots)
+{
+    for (roots = 0; roots < 3; roots++) {
+        double s = std::abs(e) * (1 << roots);
+        if (s == std::floor(s) && s <= 65536.0) {
+            m = (uint32_t)s;
+            return pow_error_bound(pow_steps(m), roots, e < 0) <= 256;
+        }
+    }
+    return false;
+}
+
+
+inline
+void pow_optimizer(elist_it_t it, evaluator* ev, elist_t* elist)
+{
+    auto f = static_cast<Function*>(*it);
+
+    if ((*f->args[0])->element_type == CCONST) {
+        auto v = static_cast<Constant*>(*f->args[0]);
+
+        double v_d = v->get_data_as_double();
+        uint32_t m = 0;
+        int roots = 0;
+
+        bool matched = split_pow_exponent(v_d, m, roots);
+        mexce_charstream s;
+
+        // Beyond the integers up to 63, which pow multiplies too, the power is of |x|, and the
+        // result is then that of the generic pow: negated for a negative x (unless the exponent
+        // is an even integer), and x * 0 for a zero, infinite or NaN x (the class by fxam)
+        bool generic = roots || m > 63;
+        bool negate  = roots || (m & 1);
+
+        if (matched) {
+            if (generic) {
+                s < 0xd9 < 0xe5                             // fxam
+                  < 0xdf < 0xe0                             // fnstsw  ax
+                  < 0xd9 < 0xc0                             // fld     st(0)
+                  < 0xd9 < 0xe1;                            // fabs
+            }
+
+            // the roots first, then the integer power of the result by binary exponentiation,
+            // from the lowest bit: st(0) holds the powers of 2 and st(1) the product
+            for (int i = 0; i < roots; i++) {
+                s < 0xd9 < 0xfa;                            // fsqrt
+            }
+            if (m == 0) {
+                s < 0xdd < 0xd8                             // fstp st(0)
+                  < 0xd9 < 0xe8;                            // fld1
+            }
+            auto steps = pow_steps(m);
+            for (size_t i = 0; i < steps.size(); i++) {
+                switch (steps[i]) {
+                    case POW_SQUARE:
+                    case POW_SQUARE_SAVED:
+                        s < 0xdc < 0xc8;                    // fmul  st(0), st
+                        break;
+                    case POW_SAVE:
+                        s < 0xd9 < 0xc0;                    // fld   st(0)
+                        break;
+                    case POW_MULTIPLY:
+                        if (i + 1 < steps.size() && steps[i + 1] == POW_SQUARE_SAVED) {
+                            s < 0xdc < 0xc9;                // fmul  st(1), st
+                        }
+                        else {
+                            s < 0xde < 0xc9;                // fmulp st(1), st
+                        }
+                        break;
+                }
+            }
+            if (v_d < 0) {
+                s < 0xd9 < 0xe8                             // fld1
+                  < 0xde < 0xf1;                            // fdivrp  st(1),st   // inverse
+            }
+            if (generic) {
+                s < 0x9e                                    // sahf
+                  < 0x72 < uint8_t(negate ? 0x0d : 0x06)    // jc      special      (NaN, infinity)
+                  < 0x7b < uint8_t(negate ? 0x0b : 0x04);   // jnp     special      (zero)
+                if (negate) {
+                    s < 0xf6 < 0xc4 < 0x02                  // test    ah, 2        (sign)
+                      < 0x74 < 0x02                         // je      positive
+                      < 0xd9 < 0xe0;                        // fchs
+                }
+// positive:
+                s < 0xdd < 0xd9                             // fstp    st(1)
+                  < 0xeb < 0x06                             // jmp     exit_point
+// special:
+                  < 0xdd < 0xd8                             // fstp    st(0)
+                  < 0xd9 < 0xee                             // fldz
+                  < 0xde < 0xc9;                            // fmulp   st(1), st
+// exit_point:
+            }
+        }
+        else {
+            // this is almost the generic pow, except that it does not try to figure out
+            // if the exponent is an integer: it knows, and for an even one, it does not negate
+            // the result of a negative base
+            bool even = v_d == std::floor(v_d) && std::abs(v_d) <= 2147483647 && std::fmod(v_d, 2) == 0;
+
+            s < 0xd9 < 0xc9                         // fxch                                 }
+              < 0xd9 < 0xe4                         // ftst                                 }
+              < 0x9b                                // wait                                 } if base is 0, leave it in st(0)
+              < 0xdf < 0xe0                         // fnstsw      ax                       } and exit
+              < 0x9e                                // sahf                                 }
+              < 0x74 < uint8_t(even ? 0x10 : 0x14)  // je          store_and_exit           }
+              < 0xd9 < 0xe1                         // fabs
+              < 0xd9 < 0xf1                         // fyl2x                                }
+              < 0xd9 < 0xe8                         // fld1                                 }
+              < 0xd9 < 0xc1                         // fld         st(1)                    }
+              < 0xd9 < 0xf8                         // fprem                                } b^n = 2^(n*log2(b))
+              < 0xd9 < 0xf0                         // f2xm1                                }
+              < 0xde < 0xc1                         // faddp       st(1), st                }
+              < 0xd9 < 0xfd;                        // fscale                               }
+            if (!even) {
+                s < 0x77 < 0x02                     // ja          store_and_exit
+                  < 0xd9 < 0xe0;                    // fchs
+            }
+// store_and_exit:
+            s < 0xdd < 0xd9;                        // fstp        st(1)
+        }
+
+
+        uint8_t* cc = push_intermediate_code(ev, s.s.str());
+        auto f_opt = make_function(ev, Function("pow_opt", 2-matched, matched && generic ? 2 : 1, s.s.str().size(), cc, nullptr,
+            [](Simd_compiler& c) {
+                if (c.num_args != 1) {
+                    return simd_pow(c, false);          // not matched: the exponent is still an argument
+                }
+                double e_d = c.function->folded_arg;
+                uint32_t m = 0;
+                int roots = 0;
+                split_pow_exponent(e_d, m, roots);
+                auto steps = pow_steps(m);
+
+                // in double, when that takes a single rounding (or any number, for the fast tier),
+                // and otherwise in double-double arithmetic, which needs FMA
+                bool dd = c.tier != accuracy::fast && pow_error_bound(steps, roots, e_d < 0) > 1;
+                if (dd && !c.fma) {
+                    return false;
+                }
+
+                int x = c.arg(0), y = c.tmp(0), x_lo = c.tmp(1), y_lo = c.tmp(2);
+                int t3 = c.tmp(3), t4 = c.tmp(4), x0 = c.tmp(5);
+                bool generic = roots || m > 63;
+                if (generic) {
+                    c.mov(x0, x);
+                    c.load_constant(t3, bits_to_double(0x7fffffffffffffff));
+                    c.logic(SIMD_AND, x, x, t3);
+                }
+                if (dd) {
+                    c.load_constant(x_lo, 0.0);
+                }
+                for (int i = 0; i < roots; i++) {
+                    if (dd) {
+                        simd_dd_sqrt(c, x, x_lo, t3, t4);
+                    }
+                    else {
+                        c.sqrt(x, x);
+                    }
+                }
+                if (m == 0) {
+                    c.load_constant(x, 1.0);
+                }
+
+                // square and multiply, as in the x87 code
+                for (auto step : steps) {
+                    switch (step) {
+                        case POW_SQUARE:
+                            dd ? simd_dd_mul(c, x, x_lo, x, x_lo, t3, t4) : c.arith(SIMD_MUL, x, x, x);
+                            break;
+                        case POW_SAVE:
+                            c.mov(y, x);
+                            if (dd) {
+                                c.mov(y_lo, x_lo);
+                            }
+                            break;
+                        case POW_SQUARE_SAVED:
+                            dd ? simd_dd_mul(c, y, y_lo, y, y_lo, t3, t4) : c.arith(SIMD_MUL, y, y, y);
+                            break;
+                        case POW_MULTIPLY:
+                            dd ? simd_dd_mul(c, x, x_lo, y, y_lo, t3, t4) : c.arith(SIMD_MUL, x, x, y);
+                            break;
+                    }
+                }
+                if (e_d < 0) {
+                    if (dd) {
+                        simd_dd_reciprocal(c, x, x_lo, t3, t4);
+                    }
+                    else {
+                        c.load_constant(y, 1.0);
+                        c.arith(SIMD_DIV, y, y, x);
+                        c.mov(x, y);
+                    }
+                }
+                if (dd) {
+                    simd_dd_round(c, x, x_lo, t3, t4);
+                }
+                if (generic) {
+                    // of |x|, as the generic pow on this backend: -(|x|^e) for a negative x
+                    // (unless e is an even integer), and x for a zero x - or as the x87 code,
+                    // where that is the generic pow, x * 0 for a zero, infinite or NaN x
+                    c.load_constant(t3, -0.0);
+                    if (roots || (m & 1)) {
+                        c.logic(SIMD_AND, y, t3, x0);
+                        c.logic(SIMD_OR, x, x, y);
+                    }
+                    if (c.tier == accuracy::precise || (c.tier != accuracy::fast && !c.fma)) {
+                        c.load_constant(y, 0.0);
+                        c.arith(SIMD_MUL, y, y, x0);
+                        c.logic(SIMD_OR, t3, t3, x0);
+                        int regular = c.compare(t3, y, CMP_LT, t3);    // -|x| < x * 0
+                        c.select(x, regular, x, y);
+                    }
+                    else {
+                        c.load_constant(y, 0.0);
+                        int zero = c.compare(x0, y, CMP_EQ, t3);
+                        c.select(x, zero, x0, x);
+                    }
+                }
+                return true;
+            }));
+        f_opt->folded_arg = v_d;
+
+        if (matched) {
+            f_opt->args[0] = f->args[1];
+            elist->erase(f->args[0]);
+        }
+        else {
+            f_opt->args[0] = f->args[0];
+            f_opt->args[1] = f->args[1];
+        }
+        *it = f_opt;
+    }
+}
+
+
+inline Function Pow()
+{
+    // Integer exponents up to 63 are computed by binary exponentiation: st(0) holds the powers
+    // of 2 of the base, and the product in st(1) is multiplied by those of the bits of the
+    // exponent that are set, up to the highest one. For negative exponents, it is inverted.
+    static uint8_t code[]  =  {
+        0xd9, 0xc0,                                 // fld         st(0)                    }
+        0xd9, 0xe1,                                 // fabs                                 }
+        0x50,                                       // push        eax/rax                  }
+        0xdb, 0x14, 0x24,                           // fist        dword ptr [esp]          }
+        0xdb, 0x04, 0x24,                           // fild        dword ptr [esp]          } if (abs(exponent) is not an integer
+        0xdf, 0xf1,                                 // fcomip      st, st(1)                }     or abs(exponent) > 63)
+        0xdd, 0xd8,                                 // fstp        st(0)                    }     goto generic_pow;
+        0x58,                                       // pop         eax/rax                  }
+        0x75, 0x2a,                                 // jne         not_integer              }
+        0x83, 0xf8, 0x3f,                           // cmp         eax, 3fh                 }
+        0x77, 0x2a,                                 // ja          large_integer            }
+
+        0xd9, 0xee,                                 // fldz                                 }
+        0xdf, 0xf1,                                 // fcomip      st, st(1)                } ah = 1 if the exponent is negative
+        0xdd, 0xd8,                                 // fstp        st(0)                    }
+        0x0f, 0x97, 0xc4,                           // seta        ah                       }
+        0xd9, 0xe8,                                 // fld1
+        0xd9, 0xc9,                                 // fxch
+// loop_start:
+        0xd0, 0xe8,                                 // shr         al, 1                    }
+        0x73, 0x02,                                 // jae         skip_multiply            } if the bit is set
+        0xdc, 0xc9,                                 // fmul        st(1), st                }     multiply the product
+// skip_multiply:
+        0x74, 0x04,                                 // je          loop_end                 } if there are higher bits
+        0xd8, 0xc8,                                 // fmul        st, st(0)                }     square the power
+        0xeb, 0xf4,                                 // jmp         loop_start               }
+// loop_end:
+        0xdd, 0xd8,                                 // fstp        st(0)
+        0x84, 0xe4,                                 // test        ah, ah                   }
+        0x74, 0x04,                                 // je          skip_inverse             } if the exponent is negative
+        0xd9, 0xe8,                                 // fld1                                 }     invert the product
+        0xde, 0xf1,                                 // fdivrp      st(1), st                }
+// skip_inverse:
+        0xeb, 0x3d,                                 // jmp         exit_point
+
+// not_integer:
+        0xb8, 0x01, 0x00, 0x00, 0x00,               // mov         eax, 1                   } bit 16 of eax: the result of a
+// large_integer:                                                                           } negative base is negated (for
+        0xc1, 0xe0, 0x10,                           // shl         eax, 10h                 } odd and non-integer exponents)
+// generic_pow:
+        0xd9, 0xe4,                                 // ftst                                 }
+        0xdf, 0xe0,                                 // fnstsw      ax                       }
+        0x9e,                                       // sahf                                 }
+        0x75, 0x08,                                 // jne         non_zero_exponent        } if exponent is NaN
+        0xdd, 0xd8,                                 // fstp        st(0)                    } return 1
+        0xdd, 0xd8,                                 // fstp        st(0)                    }
+        0xd9, 0xe8,                                 // fld1                                 }
+        0xeb, 0x26,                                 // jmp         exit_point               }
+// non_zero_exponent:
+        0xd9, 0xc9,                                 // fxch                                 }
+        0xd9, 0xe4,                                 // ftst                                 }
+        0xdf, 0xe0,                                 // fnstsw      ax                       } if base is 0, leave it in st(0)
+        0x9e,                                       // sahf                                 } and exit
+        0x74, 0x1b,                                 // je          store_and_exit           }
+        0xd9, 0xe1,                                 // fabs
+        0xd9, 0xf1,                                 // fyl2x                                }
+        0xd9, 0xe8,                                 // fld1                                 }
+        0xd9, 0xc1,                                 // fld         st(1)                    }
+        0xd9, 0xf8,                                 // fprem                                } b^n = 2^(n*log2(b))
+        0xd9, 0xf0,                                 // f2xm1                                }
+        0xde, 0xc1,                                 // faddp       st(1), st                }
+        0xd9, 0xfd,                                 // fscale                               }
+        0x77, 0x09,                                 // ja          store_and_exit
+        0xa9, 0x00, 0x00, 0x01, 0x00,               // test        eax, 10000h
+        0x74, 0x02,                                 // je          store_and_exit
+        0xd9, 0xe0,                                 // fchs
+// store_and_exit:
+        0xdd, 0xd9,                                 // fstp        st(1)
+// exit_point:
     };
+    return Function("pow", 2, 2, sizeof(code), code, pow_optimizer, [](Simd_compiler& c) {
+        return simd_pow(c, true);
+    });
+}
 
-    static uint8_t code[] = {
-        0xd9, 0xeb,                                 // fldpi                    }
-        0xdc, 0xc0,                                 // fadd        st(0),st     }
-        0xd9, 0xc9,                                 // fxch        st(1)        } bring arg to range [0, 2*pi)
-        0xd9, 0xf5,                                 // fprem1                   }
-        0xdd, 0xd9,                                 // fstp        st(1)        }
 
-        0xdc, 0xc8,                                 // fmul        st(0),st  
-        0xb8, 0, 0, 0, 0,                           // mov         eax, dword ptr [addr_fct26]  
-        0xdb, 0x28,                                 // fld         tword ptr [eax]  
-        0xd8, 0xc9,                                 // fmul        st,st(1)  
-        0xdb, 0x68, 0x10,                           // fld         tword ptr [eax+8]  
-        0xde, 0xc1,                                 // faddp       st(1),st  
-        0xd8, 0xc9,                                 // fmul        st,st(1)  
-        0xdb, 0x68, 0x20,                           // fld         tword ptr [eax+10h]  
-        0xde, 0xc1,                                 // faddp       st(1),st  
-        0xd8, 0xc9,                                 // fmul        st,st(1)  
-        0xdb, 0x68, 0x30,                           // fld         tword ptr [eax+18h]  
-        0xde, 0xc1,                                 // faddp       st(1),st  
-        0xd8, 0xc9,                                 // fmul        st,st(1)  
-        0xdb, 0x68, 0x40,                           // fld         tword ptr [eax+20h]  
-        0xde, 0xc1,                                 // faddp       st(1),st  
-        0xd8, 0xc9,                                 // fmul        st,st(1)  
-        0xdb, 0x68, 0x50,                           // fld         tword ptr [eax+28h]  
-        0xde, 0xc1,                                 // faddp       st(1),st  
+inline Function Exp()
+{
+    static uint8_t code[]  =  {
+        0xd9, 0xea,                                 // fldl2e  
+        0xde, 0xc9,                                 // fmulp       st(1), st  
+        0xd9, 0xe8,                                 // fld1  
+        0xd9, 0xc1,                                 // fld         st(1)  
+        0xd9, 0xf8,                                 // fprem  
+        0xd9, 0xf0,                                 // f2xm1  
+        0xde, 0xc1,                                 // faddp       st(1), st  
+        0xd9, 0xfd,                                 // fscale  
+        0xdd, 0xd9,                                 // fstp        st(1)
+    };
+    return Function("exp", 1, 2, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        if (c.tier == accuracy::precise) {
+            return false;
+        }
+        simd_exp(c, c.arg(0), -1, c.tier == accuracy::fast);
+        return true;
+    });
+}
 
-#if (MEXCE_ACCURACY > 0)
-        0xd8, 0xc9,                                 // fmul        st,st(1)  
-        0xdb, 0x68, 0x60,                           // fld         tword ptr [eax+30h]  
-        0xde, 0xc1,                                 // faddp       st(1),st  
-#endif
-#if (MEXCE_ACCURACY > 1)
-        0xd8, 0xc9,                                 // fmul        st,st(1)  
-        0xdb, 0x68, 0x70,                           // fld         tword ptr [eax+38h]  
-        0xde, 0xc1,                                 // faddp       st(1),st  
-#endif
-#if (MEXCE_ACCURACY > 2)
-        0xd8, 0xc9,                                 // fmul        st,st(1)  
-        0x05, 0x80, 0x00, 0x00, 0x00,               // add         eax, 80h
-        0xdb, 0x28,                                 // fld         tword ptr [eax]  
-        0xde, 0xc1,                                 // faddp       st(1),st  
-#endif
-#if (MEXCE_ACCURACY > 3)
-        0xd8, 0xc9,                                 // fmul        st,st(1)  
-        0xdb, 0x68, 0x10,                           // fld         tword ptr [eax+10h]  
-        0xde, 0xc1,                                 // faddp       st(1),st
-#endif
-#if (MEXCE_ACCURACY > 4)
-        0xd8, 0xc9,                                 // fmul        st,st(1)  
-        0xdb, 0x68, 0x20,                           // fld         tword ptr [eax+20h]  
-        0xde, 0xc1,                                 // faddp       st(1),st  
-#endif
-#if (MEXCE_ACCURACY > 5)
-        0xd8, 0xc9,                                 // fmul        st,st(1)  
-        0xdb, 0x68, 0x30,                           // fld         tword ptr [eax+30h]  
-        0xde, 0xc1,                                 // faddp       st(1),st  
-#endif
-#if (MEXCE_ACCURACY > 6)
-        0xd8, 0xc9,                                 // fmul        st,st(1)  
-        0xdb, 0x68, 0x40,                           // fld         tword ptr [eax+40h]  
-        0xde, 0xc1,                                 // faddp       st(1),st  
-#endif
-#if (MEXCE_ACCURACY > 7)
-        0xd8, 0xc9,                                 // fmul        st,st(1)  
-        0xdb, 0x68, 0x50,                           // fld         tword ptr [eax+50h]  
-        0xde, 0xc1,                                 // faddp       st(1),st  
-#endif
-#if (MEXCE_ACCURACY > 8)
-        0xd8, 0xc9,                                 // fmul        st,st(1)  
-        0xdb, 0x68, 0x60,                           // fld         tword ptr [eax+60h]  
-        0xde, 0xc1,                                 // faddp       st(1),st  
-#endif
-#if (MEXCE_ACCURACY > 9)
-        0xd8, 0xc9,                                 // fmul        st,st(1)  
-        0xdb, 0x68, 0x70,                           // fld         tword ptr [eax+70h]  
-        0xde, 0xc1,                                 // faddp       st(1),st  
-#endif
-        0xdd, 0xd9                                  // fstp        st(1)  
+
+inline Function Logb()  // implementation with base
+{
+    static uint8_t code[]  =  {
+        0xd9, 0xe8,                                 // fld1
+        0xd9, 0xc9,                                 // fxch        st(1)
+        0xd9, 0xf1,                                 // fyl2x
+        0xd9, 0xc9,                                 // fxch        st(1)
+        0xd9, 0xe8,                                 // fld1
+        0xd9, 0xc9,                                 // fxch        st(1)
+        0xd9, 0xf1,                                 // fyl2x
+        0xde, 0xf9                                  // fdivp       st(1),st
     };
+    return Function("logb", 2, 1, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        // log(arg1) / log(arg0)
+        if (c.tier == accuracy::precise) {
+            return false;
+        }
+        simd_log(c, c.arg(0), LOG_E, c.tier == accuracy::fast);
+        simd_log(c, c.arg(1), LOG_E, c.tier == accuracy::fast);
+        c.arith(SIMD_DIV, c.arg(0), c.arg(1), c.arg(0));
+        return true;
+    });
+}
+
+
+inline Function Ln()
+{
+    static uint8_t code[]  =  {
+        0xd9, 0xe8,                                 // fld1
+        0xd9, 0xc9,                                 // fxch        st(1)
+        0xd9, 0xf1,                                 // fyl2x
+        0xd9, 0xea,                                 // fldl2e
+        0xde, 0xf9                                  // fdivp       st(1),st
+    };
+    return Function("ln", 1, 1, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        if (c.tier == accuracy::precise) {
+            return false;
+        }
+        simd_log(c, c.arg(0), LOG_E, c.tier == accuracy::fast);
+        return true;
+    });
+}
 
-    *((void**)(code+13)) = (void*)mfactors;
-#endif
 
-    return Function("cos", 1, 0, sizeof(code), code);
+// this is an alias, because of C's math.h
+inline Function Log()
+{
+    Function f = Ln();
+    f.name="log";
+    return f;
 }
 
 
-inline Function Tan()
+inline Function Log10()
+{
+    static uint8_t code[]  =  {
+        0xd9, 0xe8,                                 // fld1
+        0xd9, 0xc9,                                 // fxch        st(1)
+        0xd9, 0xf1,                                 // fyl2x
+        0xd9, 0xe9,                                 // fldl2t
+        0xde, 0xf9                                  // fdivp       st(1),st
+    };
+    return Function("log10", 1, 1, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        if (c.tier == accuracy::precise) {
+            return false;
+        }
+        simd_log(c, c.arg(0), LOG_10, c.tier == accuracy::fast);
+        return true;
+    });
+}
+
+
+inline Function Log2()
 {
     static uint8_t code[] = {
-        0xd9, 0xf2,                                 // fptan
-        0xdd, 0xd8                                  // fstp        st(0)
+        0xd9, 0xe8,                                 // fld1
+        0xd9, 0xc9,                                 // fxch        st(1)
+        0xd9, 0xf1                                  // fyl2x
     };
-    return Function("tan", 1, 1, sizeof(code), code);
+    return Function("log2", 1, 1, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        if (c.tier == accuracy::precise) {
+            return false;
+        }
+        simd_log(c, c.arg(0), LOG_2, c.tier == accuracy::fast);
+        return true;
+    });
 }
 
 
-inline Function Abs()
+inline Function Ylog2()
 {
     static uint8_t code[] = {
-        0xd9, 0xe1                                  // fabs
+        0xd9, 0xf1                                  // fyl2x
     };
-    return Function("abs", 1, 0, sizeof(code), code);
+    return Function("ylog2", 2, 0, sizeof(code), code);
 }
 
 
-inline Function Sfc()
+inline Function Max()
 {
     static uint8_t code[] = {
-        0xd9, 0xf4,                                 // fxtract
+        0xdb, 0xf1,                                 // fcomi       st,st(1)
+        0xda, 0xc1,                                 // fcmovb      st,st(1)
         0xdd, 0xd9                                  // fstp        st(1)
     };
-    return Function("sfc", 1, 1, sizeof(code), code);
+    return Function("max", 2, 0, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        // b if a <= b, otherwise (also if unordered) a. maxsd(a, b) is that for ordered
+        // operands, including b for 0 and -0, but b if unordered.
+        int mask = c.compare(c.arg(0), c.arg(1), CMP_UNORD, c.tmp(0));
+        c.arith(SIMD_MAX, c.tmp(1), c.arg(0), c.arg(1));
+        c.select(c.arg(0), mask, c.arg(0), c.tmp(1));
+        return true;
+    });
 }
 
 
-inline Function Expn()
+inline Function Min()
 {
     static uint8_t code[] = {
-        0xd9, 0xf4,                                 // fxtract
-        0xdd, 0xd8                                  // fstp        st(0)
+        0xdb, 0xf1,                                 // fcomi       st,st(1)
+        0xd9, 0xc9,                                 // fxch        st(1)
+        0xda, 0xc1,                                 // fcmovb      st,st(1)
+        0xdd, 0xd9                                  // fstp        st(1)
     };
-    return Function("expn", 1, 1, sizeof(code), code);
+    return Function("min", 2, 0, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        // a if a <= b, otherwise (also if unordered) b. minsd(b, a) is that for ordered
+        // operands, including a for 0 and -0, but a if unordered.
+        int mask = c.compare(c.arg(0), c.arg(1), CMP_UNORD, c.tmp(0));
+        c.arith(SIMD_MIN, c.tmp(1), c.arg(1), c.arg(0));
+        c.select(c.arg(0), mask, c.arg(1), c.tmp(1));
+        return true;
+    });
 }
 
 
-inline Function Sign()
+// floor and ceil avoid the control word where they can: fldcw serializes the FPU on many
+// CPUs, and frndint itself is slow. With a precision control of 53 or 64 bits, x + 3t - 3t
+// rounds x to nearest in two additions, for abs(x) < t = 2^51 or 2^62, and floor corrects the
+// result with fcomi/fcmov. Larger (or infinite) x, and a precision control of 24 bits, take
+// frndint under a control word that rounds down. round keeps frndint under the default one.
+
+inline Function Floor()
 {
-    static uint8_t code[]  =  {
-        0xd9, 0xee,                                 // fldz
-        0xdf, 0xf1,                                 // fcomip      st, st(1)
-        0xdd, 0xd8,                                 // fstp        st(0)
-        0xd9, 0xe8,                                 // fld1
-        0xd9, 0xe8,                                 // fld1
+    static uint8_t code[] = {
+        0x50,                                       // push        eax/rax
+        0xd9, 0x3c, 0x24,                           // fnstcw      word ptr [esp]
+        0x0f, 0xb7, 0x04, 0x24,                     // movzx       eax, word ptr [esp]
+        0xf6, 0xc4, 0x02,                           // test        ah, 2                    } if the precision control is
+        0x74, 0x41,                                 // je          control_word             }     24 bits, use the control word
+
+        0x25, 0x00, 0x01, 0x00, 0x00,               // and         eax, 100h                }
+        0x69, 0xc0, 0x00, 0x80, 0x05, 0x00,         // imul        eax, eax, 58000h         } t = 2^51, or 2^62 if the
+        0x05, 0x00, 0x00, 0x00, 0x59,               // add         eax, 59000000h           }     precision control is 64 bits
+        0x89, 0x04, 0x24,                           // mov         dword ptr [esp], eax     }
+        0xd9, 0x04, 0x24,                           // fld         dword ptr [esp]          }
+        0xd9, 0xc1,                                 // fld         st(1)                    }
+        0xd9, 0xe1,                                 // fabs                                 } if (abs(x) >= t)
+        0xdf, 0xf1,                                 // fcomip      st, st(1)                }     use the control word
+        0xdd, 0xd8,                                 // fstp        st(0)                    }
+        0x73, 0x21,                                 // jae         control_word             }
+
+        0x05, 0x00, 0x00, 0xc0, 0x00,               // add         eax, 0c00000h            }
+        0x89, 0x04, 0x24,                           // mov         dword ptr [esp], eax     }
+        0xd9, 0x04, 0x24,                           // fld         dword ptr [esp]          } r = x + 3t - 3t, which
+        0xd8, 0xc1,                                 // fadd        st, st(1)                }     rounds x to nearest
+        0xd8, 0x24, 0x24,                           // fsub        dword ptr [esp]          }
+        0xdb, 0xf1,                                 // fcomi       st, st(1)                }
+        0xd9, 0xe8,                                 // fld1                                 }
+        0xd8, 0xe9,                                 // fsubr       st, st(1)                } r - 1 if r > x, and x itself
+        0xda, 0xd1,                                 // fcmovbe     st, st(1)                }     if r == x (which keeps -0)
+        0xda, 0xca,                                 // fcmove      st, st(2)                }
+        0xdd, 0xd9,                                 // fstp        st(1)                    }
+        0xdd, 0xd9,                                 // fstp        st(1)                    }
+        0x58,                                       // pop         eax/rax
+        0xeb, 0x14,                                 // jmp         exit_point
+
+// control_word:
+        0x66, 0xc7, 0x04, 0x24, 0x7f, 0x06,         // mov         word ptr [esp], 67fh     }
+        0xd9, 0x7c, 0x24, 0x02,                     // fnstcw      word ptr [esp+2]         }
+        0xd9, 0x2c, 0x24,                           // fldcw       word ptr [esp]           } frndint, rounding down
+        0xd9, 0xfc,                                 // frndint                              }
+        0xd9, 0x6c, 0x24, 0x02,                     // fldcw       word ptr [esp+2]         }
+        0x58,                                       // pop         eax/rax
+// exit_point:
+    };
+    return Function("floor", 1, 2, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        c.round(c.arg(0), c.arg(0), 1);
+        return true;
+    });
+}
+
+
+inline Function Ceil()
+{
+    // ceil(x) = -floor(-x), which also keeps the sign of -0 in ceil(-0.5)
+    static uint8_t code[] = {
+        0xd9, 0xe0,                                 // fchs
+        0x50,                                       // push        eax/rax
+        0xd9, 0x3c, 0x24,                           // fnstcw      word ptr [esp]
+        0x0f, 0xb7, 0x04, 0x24,                     // movzx       eax, word ptr [esp]
+        0xf6, 0xc4, 0x02,                           // test        ah, 2                    } if the precision control is
+        0x74, 0x41,                                 // je          control_word             }     24 bits, use the control word
+
+        0x25, 0x00, 0x01, 0x00, 0x00,               // and         eax, 100h                }
+        0x69, 0xc0, 0x00, 0x80, 0x05, 0x00,         // imul        eax, eax, 58000h         } t = 2^51, or 2^62 if the
+        0x05, 0x00, 0x00, 0x00, 0x59,               // add         eax, 59000000h           }     precision control is 64 bits
+        0x89, 0x04, 0x24,                           // mov         dword ptr [esp], eax     }
+        0xd9, 0x04, 0x24,                           // fld         dword ptr [esp]          }
+        0xd9, 0xc1,                                 // fld         st(1)                    }
+        0xd9, 0xe1,                                 // fabs                                 } if (abs(x) >= t)
+        0xdf, 0xf1,                                 // fcomip      st, st(1)                }     use the control word
+        0xdd, 0xd8,                                 // fstp        st(0)                    }
+        0x73, 0x21,                                 // jae         control_word             }
+
+        0x05, 0x00, 0x00, 0xc0, 0x00,               // add         eax, 0c00000h            }
+        0x89, 0x04, 0x24,                           // mov         dword ptr [esp], eax     }
+        0xd9, 0x04, 0x24,                           // fld         dword ptr [esp]          } r = x + 3t - 3t, which
+        0xd8, 0xc1,                                 // fadd        st, st(1)                }     rounds x to nearest
+        0xd8, 0x24, 0x24,                           // fsub        dword ptr [esp]          }
+        0xdb, 0xf1,                                 // fcomi       st, st(1)                }
+        0xd9, 0xe8,                                 // fld1                                 }
+        0xd8, 0xe9,                                 // fsubr       st, st(1)                } r - 1 if r > x, and x itself
+        0xda, 0xd1,                                 // fcmovbe     st, st(1)                }     if r == x (which keeps -0)
+        0xda, 0xca,                                 // fcmove      st, st(2)                }
+        0xdd, 0xd9,                                 // fstp        st(1)                    }
+        0xdd, 0xd9,                                 // fstp        st(1)                    }
+        0x58,                                       // pop         eax/rax
+        0xeb, 0x14,                                 // jmp         exit_point
+
+// control_word:
+        0x66, 0xc7, 0x04, 0x24, 0x7f, 0x06,         // mov         word ptr [esp], 67fh     }
+        0xd9, 0x7c, 0x24, 0x02,                     // fnstcw      word ptr [esp+2]         }
+        0xd9, 0x2c, 0x24,                           // fldcw       word ptr [esp]           } frndint, rounding down
+        0xd9, 0xfc,                                 // frndint                              }
+        0xd9, 0x6c, 0x24, 0x02,                     // fldcw       word ptr [esp+2]         }
+        0x58,                                       // pop         eax/rax
+// exit_point:
         0xd9, 0xe0,                                 // fchs
-        0xda, 0xc1,                                 // fcmovb      st, st(1)
-        0xdd, 0xd9                                  // fstp        st(1)
     };
-    return Function("sign", 1, 1, sizeof(code), code);
+    return Function("ceil", 1, 2, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        c.round(c.arg(0), c.arg(0), 2);
+        return true;
+    });
 }
 
 
-inline Function Signp()
+inline Function Round()
 {
-    static uint8_t code[]  =  {
-        0xd9, 0xe8,                                 // fld1
-        0xd9, 0xee,                                 // fldz
-        0xdb, 0xf2,                                 // fcomi       st, st(2)
-        0xdd, 0xda,                                 // fstp        st(2)
-        0xdb, 0xc1,                                 // fcmovnb     st, st(1)
+    static uint8_t code[] = {
+        0xd9, 0xfc                                  // frndint
+    };
+    return Function("round", 1, 0, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        c.round(c.arg(0), c.arg(0), 0);
+        return true;
+    });
+}
+
+
+inline Function Int()
+{
+    static uint8_t code[] = {
+        0xd9, 0xfc                                  // frndint
+    };
+    return Function("int", 1, 0, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        c.round(c.arg(0), c.arg(0), 0);
+        return true;
+    });
+}
+
+
+inline Function Mod()
+{
+    static uint8_t code[] = {
+        0xd9, 0xc9,                                 // fxch        st(1)
+        0xd9, 0xf8,                                 // fprem
         0xdd, 0xd9                                  // fstp        st(1)
     };
-    return Function("signp", 1, 2, sizeof(code), code);
+    return Function("mod", 2, 0, sizeof(code), code);
+}
+
+
+inline Function Less_than()
+{
+    static uint8_t code[] = {
+        0xdf, 0xf1,                                 // fcomip      st,st(1)  
+        0xdd, 0xd8,                                 // fstp        st(0)  
+        0xd9, 0xe8,                                 // fld1  
+        0xd9, 0xee,                                 // fldz  
+        0xdb, 0xd1,                                 // fcmovnbe    st,st(1)  
+        0xdd, 0xd9,                                 // fstp        st(1)  
+    };
+    return Function("less_than", 2, 0, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        c.compare_select(c.arg(0), c.arg(0), c.arg(1), CMP_LT, 1.0, 0.0);
+        return true;
+    });
 }
 
 
-inline Function Sqrt()
+inline Function Bnd()
 {
     static uint8_t code[] = {
-        0xd9, 0xfa                                  // fsqrt
+        0xd9, 0xc9,                                 // fxch        st(1)
+        0xd9, 0xf8,                                 // fprem
+        0xd9, 0xc0,                                 // fld         st(0)
+        0xdc, 0xc2,                                 // fadd        st(2), st
+        0xd9, 0xee,                                 // fldz
+        0xdf, 0xf1,                                 // fcomip      st,st(1)
+        0xdd, 0xd8,                                 // fstp        st(0)
+        0xdb, 0xc1,                                 // fcmovnb     st,st(1)
+        0xdd, 0xd9                                  // fstp        st(1)
     };
-    return Function("sqrt", 1, 0, sizeof(code), code);
+    return Function("bnd", 2, 2, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        // r = a - trunc(a/b) * b, which FMA computes exactly, like fprem, while the quotient
+        // is below 2^53 (fprem itself only gives a partial remainder for much larger ones).
+        // If a/b rounds up to an integer, r is off by b, but for b > 0 the result is the same.
+        if (!c.fma || !c.sse41) {
+            return false;
+        }
+        int a = c.arg(0), b = c.arg(1), q = c.tmp(0), zero = c.tmp(1), r = c.tmp(2), sum = c.tmp(0);
+        c.arith(SIMD_DIV, q, a, b);
+        c.round(q, q, 3);
+        c.mov(r, a);
+        c.fnmadd(r, q, b);
+        c.load_constant(zero, 0.0);
+        int mask = c.compare(q, zero, CMP_EQ, c.tmp(3));
+        c.select(r, mask, a, r);                        // |a| < |b|, including b = inf where q*b is NaN
+        mask = c.compare(r, zero, CMP_NLE, c.tmp(3));   // r > 0, or NaN
+        c.arith(SIMD_ADD, sum, r, b);
+        c.select(a, mask, r, sum);
+        return true;
+    });
 }
 
 
 inline
-void pow_optimizer(elist_it_t it, evaluator* ev, elist_t* elist)
+pair<elist_it_t, elist_it_t> get_dependent_chunk(elist_it_t it)
 {
-    auto f = static_pointer_cast<Function>(*it);
+    auto it_end = next(it);
+    while ( (*it) ->element_type == CFUNC) {
+        Function* f = static_cast<Function*>(*it );
+        if (!f->num_args) {
+            break;
+        }
+        it = f->args[f->num_args-1];
+    }
+    return make_pair(it, it_end);
+}
 
-    if ((*f->args[0])->element_type == CCONST) {
-        auto v = static_pointer_cast<Constant>(*f->args[0]);
 
-        double v_d = v->get_data_as_double();
-        double r_d = round(v_d);
-        double a_d = abs(v_d);
+struct elist_comparison {
+    bool operator()(const elist_t& a, const elist_t& b) const {
 
-        bool matched = true;
-        mexce_charstream s;
+        // empty element lists cannot exist
+        assert(a.size() && b.size());
 
-        // a special case, that the exponent is 0.5
-        if (v_d == 0.5) {
-            s < 0xd9 < 0xfa;                // fsqrt
+        // if their size differs, we use that for comparison
+        if (a.size() != b.size()) {
+            return a.size() > b.size();
         }
-        else
-        if (r_d == v_d && a_d <= 65536.0) {
-
-            // find the closest power of two
-            uint32_t npo2 = (uint32_t)a_d;
-            npo2--;
-            npo2 |= npo2 >> 1;
-            npo2 |= npo2 >> 2;
-            npo2 |= npo2 >> 4;
-            npo2 |= npo2 >> 8;
-            npo2 |= npo2 >> 16;
-            npo2++;
-            npo2>>=1;
-
-            double diff_high = npo2*2 - a_d;
-            double diff_low  = a_d - npo2;
-
-            if (a_d == 0.0) {
-                s < 0xdd < 0xd8             // fstp st(0)
-                  < 0xd9 < 0xe8;            // fld1
-            }
-            else
-            if (a_d == 1.0) {
-                // do nothing
-            }
-            else
-            if (diff_high < 28 &&  diff_low < 28) {
-                if (diff_high && diff_low) {
-                    // the exponent is not an exact po2, thus we will have to multiply
-                    // or divide to get to the result, thus we keep the base in st(1)
-                    s < 0xd9 < 0xc0;        // fld  st(0)
-                }
-                while (npo2 >>= 1) {        // multiply to reach npo2
-                    s < 0xdc < 0xc8;        // fmul st(0)
-                }
 
-                if (diff_high < diff_low) {
-                    s < 0xdc < 0xc8;        // fmul st(0)
+        // they are the same size, thus we need to traverse both
+        auto ita = a.begin();
+        auto itb = b.begin();
+        for (; ita != a.end(); ita++, itb++) {
+            // start by comparing element types
+            if ((*ita)->element_type != (*itb)->element_type) {
+                return (*ita)->element_type > (*itb)->element_type;
+            }
 
-                    // divide as many times as the difference
-                    // and then get rid of the temporary
-                    if (diff_high > 0.0) {
-                        while (--diff_high) {
-                            s < 0xd8 < 0xf1;    // fdivr  st(0), st(1)
-                        }
-                        s < 0xde < 0xf1;        // fdivrp st(1), st(0)
+            // if they are constants, we compare the values
+            if ((*ita)->element_type == CCONST) {
+                double da = static_cast<Constant*>(*ita)->get_data_as_double();
+                double db = static_cast<Constant*>(*itb)->get_data_as_double();
+                if (da != da && db != db) { // i.e. if both of them are NaN
+                    // not all NaNs are the same, we compare binary
+                    auto mcr = memcmp(&da, &db, sizeof(double));
+                    if (mcr != 0) {
+                        return mcr < 0;
                     }
                 }
-                else {
-                    // multiply as many times as the difference
-                    // and then get rid of the temporary
-                    if (diff_low > 0) {
-                        while (--diff_low) {
-                            s < 0xd8 < 0xc9;    // fmul  st(0), st(1)
-                        }
-                        s < 0xde < 0xc9;        // fmulp st(1), st(0)
-                    }
+                else
+                if (da != db) {
+                    return da < db;
                 }
+                continue; // it is the same... move on
+            }
 
-                if (diff_high &&  diff_low) {
-                    // now we get rid of the temporary we used earlier
-                    s < 0xde < 0xc9;            // fmulp st(1), st(0)
+            // if they are variables, we compare addresses, or offsets in the context
+            if ((*ita)->element_type == CVAR) {
+                auto va = static_cast<Variable*>(*ita);
+                auto vb = static_cast<Variable*>(*itb);
+                if (va->in_context != vb->in_context) {
+                    return va->in_context < vb->in_context;
                 }
-            }
-            else {
-                matched = false;
+                if (va->context_offset != vb->context_offset) {
+                    return va->context_offset < vb->context_offset;
+                }
+                volatile void* aa = va->address;
+                volatile void* ab = vb->address;
+                if (aa != ab) {
+                    return aa < ab;
+                }
+                continue; // it is the same... move on
             }
 
-            if (matched && v_d < 0) {
-                s < 0xd9 < 0xe8                 // fld1
-                  < 0xde < 0xf1;                // fdivrp  st(1),st   // inverse
+            // if they are functions, we compare their code
+            if ((*ita)->element_type == CFUNC) {
+                auto fa = static_cast<Function*>(*ita);
+                auto fb = static_cast<Function*>(*itb);
+
+                int mcr = memcmp(fa->code, fb->code, std::min(fa->code_size, fb->code_size));
+                if (mcr != 0) {
+                    return mcr < 0;
+                }
+                if (fa->code_size != fb->code_size) {
+                    return fa->code_size < fb->code_size;
+                }
+                continue; // it is the same... move on [this one is not really required]
             }
         }
-        else {
-            matched = false;
-        }
 
-        if (!matched) {
-            // this is almost the generic pow, except that it does not try to figure out
-            // if the exponent is an integer
+        return false; // they are equal
+    }
+};
 
-            s < 0xd9 < 0xc9                         // fxch                                 }
-              < 0xd9 < 0xe4                         // ftst                                 }
-              < 0x9b                                // wait                                 } if base is 0, leave it in st(0)
-              < 0xdf < 0xe0                         // fnstsw      ax                       } and exit
-              < 0x9e                                // sahf                                 }
-              < 0x74 < 0x14                         // je          store_and_exit           }
-              < 0xd9 < 0xe1                         // fabs
-              < 0xd9 < 0xf1                         // fyl2x                                }
-              < 0xd9 < 0xe8                         // fld1                                 }
-              < 0xd9 < 0xc1                         // fld         st(1)                    }
-              < 0xd9 < 0xf8                         // fprem                                } b^n = 2^(n*log2(b))
-              < 0xd9 < 0xf0                         // f2xm1                                }
-              < 0xde < 0xc1                         // faddp       st(1), st                }
-              < 0xd9 < 0xfd                         // fscale                               }
-              < 0x77 < 0x02                         // ja          store_and_exit
-              < 0xd9 < 0xe0                         // fchs
-// store_and_exit:
-              < 0xdd < 0xd9;                        // fstp        st(1)
-        }
 
 
-        uint8_t* cc = push_intermediate_code(ev, s.s.str());
-        auto f_opt = make_shared<Function>("pow_opt", 2-matched, 0, s.s.str().size(), cc, nullptr);
+inline
+bool emit_load_special_constant(impl::mexce_charstream& s, double v)
+{
+    // only the exact ones - the rest (fldpi etc.) are more precise than the double they replace
+    if (v == 0.0 && !std::signbit(v)) { s < 0xd9 < 0xee; return true; }   // fldz
+    if (v == 1.0)                     { s < 0xd9 < 0xe8; return true; }   // fld1
+    return false;
+}
 
-        if (matched) {
-            f_opt->args[0] = f->args[1];
-            elist->erase(f->args[0]);
+
+
+// An instruction of the x87 code, as compile_elist emits it, before the peephole pass
+struct X87_instruction
+{
+    enum Kind {
+        OTHER,          // may change eax/rax, e.g. the code of a function with jumps, which is kept whole
+        X87,            // any other x87 instruction, which leaves eax/rax alone
+        ADDRESS,        // loads eax/rax with the address of a value (see emit_value_address)
+        LOAD,           // fld/fild from memory, fldz, fld1
+        FLD_ST0,        // fld         st(0)
+        FSTP_ST0,       // fstp        st(0)
+        FXCH,           // fxch        st(1)
+        POP_ARITH,      // faddp, fmulp, fsubp, fsubrp, fdivp, fdivrp st(1), st(0)
+        STORE_TEMP,     // fstp        tbyte ptr [esp/rsp+disp32]
+        LOAD_TEMP       // fld         tbyte ptr [esp/rsp+disp32]
+    };
+
+    Kind                    kind;
+    string                  bytes;
+    vector<Pool_reference>  pool_references;    // relative to the start of the instruction
+};
+
+
+struct X87_listing
+{
+    vector<X87_instruction> code;
+    mexce_charstream        s;          // the instruction being emitted
+
+    void end(X87_instruction::Kind kind)
+    {
+        X87_instruction in = { kind, s.s.str(), s.pool_references };
+        code.push_back(in);
+        s.s.str("");
+        s.pool_references.clear();
+    }
+};
+
+
+// Emits an x87 instruction with a memory operand that refers to v
+// opcode, reg: the opcode byte and the ModRM.reg field of the instruction, e.g. 0xdd, 0 for fld qword ptr
+inline
+void emit_x87_memory_operation(X87_listing& x, uint8_t opcode, uint8_t reg,
+    const impl::Value* v, const impl::Variable_addressing* va, X87_instruction::Kind kind)
+{
+    int32_t offset = block_offset(v, va);
+    if (offset >= 0) {
+        if (offset < 128) {
+            x.s < opcode < (0x45 | reg << 3) < offset;          // [ebp/rbp+disp8]
         }
         else {
-            f_opt->args[0] = f->args[0];
-            f_opt->args[1] = f->args[1];
+            x.s < opcode < (0x85 | reg << 3);                   // [ebp/rbp+disp32]
+            x.s << offset;
         }
-        *it = f_opt;
     }
+    else
+    if (emit_value_address(x.s, v, va)) {
+        x.end(X87_instruction::ADDRESS);
+        x.s < opcode < (reg << 3);              // [eax/rax]
+    }
+    else {
+        x.s < opcode < (reg << 3 | 5);          // [immediate address] or [rip+disp32]
+        emit_direct_address(x.s, v);
+    }
+    x.end(kind);
 }
 
 
-inline Function Pow()
+// Appends the code of a function, split to its instructions, if they all are x87 instructions
+// on registers or on the frame (which is the case for most functions). Otherwise it is kept as
+// one instruction.
+inline
+void emit_x87_function(X87_listing& x, const Function* f)
 {
-    static uint8_t code[]  =  {
-        0xd9, 0xc0,                                 // fld         st(0)                    }
-        0xd9, 0xfc,                                 // frndint                              }
-        0xd8, 0xd1,                                 // fcom        st(1)                    } if (abs(exponent) != round(abs(exponent)))
-        0xdf, 0xe0,                                 // fnstsw      ax                       }    goto generic_pow;
-        0x9e,                                       // sahf                                 }
-        0x75, 0x3c,                                 // jne         pop_before_generic_pow   }
+    using I = X87_instruction;
+    const uint8_t* c = f->code;
+    size_t n = f->code_size;
+
+    // the length of the instruction at i, or 0 if it is not one of those
+    auto length = [&](size_t i) -> size_t {
+        if (c[i] == 0x9b) {                                             // wait
+            return 1;
+        }
+        if (c[i] == 0xdb && i + 7 <= n && (c[i+1] == 0xbc || c[i+1] == 0xac) && c[i+2] == 0x24) {
+            return 7;                                                   // fstp/fld tbyte ptr [esp/rsp+disp32]
+        }
+        if (c[i] >= 0xd8 && c[i] <= 0xdf && i + 2 <= n && c[i+1] >= 0xc0 &&
+            !(c[i] == 0xdf && c[i+1] == 0xe0))                          // fnstsw ax
+        {
+            return 2;
+        }
+        return 0;
+    };
 
-        0xd9, 0xe1,                                 // fabs                                 }
-        0x66, 0xc7, 0x44, 0x24, 0xfe, 0xff, 0xff,   // mov         word ptr [esp-2],0ffffh  }
-        0xdf, 0x5c, 0x24, 0xfe,                     // fistp       word ptr [esp-2]         }
-        0x66, 0x8b, 0x44, 0x24, 0xfe,               // mov         ax, word ptr [esp-2]     } if (abs(exponent) > 32)
-        0x66, 0x83, 0xe8, 0x01,                     // sub         ax, 1                    }    goto generic_pow;
-        0x66, 0x83, 0xf8, 0x21,                     // cmp         ax, 1fh                  } 
-        0x77, 0x22,                                 // ja          generic_pow              }
-
-        0xd9, 0xc1,                                 // fld         st(1)
-// loop_start:
-        0x66, 0x85, 0xc0,                           // test        ax, ax  
-        0x74, 0x08,                                 // je          loop_end
-        0xdc, 0xca,                                 // fmul        st(2), st  
-        0x66, 0x83, 0xe8, 0x01,                     // sub         ax, 1
-        0xeb, 0xf3,                                 // jmp         loop_start
+    for (size_t i = 0, len; i < n; i += len) {
+        if (!(len = length(i))) {
+            x.s.s.write((const char*)c, n);
+            x.end(I::OTHER);
+            return;
+        }
+    }
 
-// loop_end:
+    for (size_t i = 0, len; i < n; i += len) {
+        len = length(i);
+        x.s.s.write((const char*)c + i, len);
+        uint8_t op = c[i], modrm = len > 1 ? c[i+1] : 0;
+        x.end(
+            len == 1                                            ? I::X87        :
+            len == 7                                            ? (modrm == 0xbc ? I::STORE_TEMP : I::LOAD_TEMP) :
+            op == 0xd9 && modrm == 0xc0                         ? I::FLD_ST0    :
+            op == 0xdd && modrm == 0xd8                         ? I::FSTP_ST0   :
+            op == 0xd9 && modrm == 0xc9                         ? I::FXCH       :
+            op == 0xde && (modrm & 0xc7) == 0xc1 &&
+                (modrm & 0x38) != 0x10 && (modrm & 0x38) != 0x18 ? I::POP_ARITH  :
+                                                                  I::X87);
+    }
+}
 
-        0xdd, 0xd8,                                 // fstp        st(0)                    }
-        0xd9, 0xe4,                                 // ftst                                 }
-        0xdf, 0xe0,                                 // fnstsw      ax                       } if the exponent was NOT negative
-        0x9e,                                       // sahf                                 }     goto exit_point
-        0xdd, 0xd8,                                 // fstp        st(0)                    }
-        0x77, 0x36,                                 // ja          exit_point               }
 
-        0xd9, 0xe8,                                 // fld1                                 }
-        0xde, 0xf1,                                 // fdivrp      st(1),st                 } inverse
-        0xeb, 0x30,                                 // jmp         exit_point               }
+// Removes the redundancies where the fixed code of the elements meets, in one pass over the
+// instructions, where each one is matched against the end of the instructions before it:
+//   load, fstp st(0)                         (nothing)
+//   fld st(0), f[op]p st(1), st(0)           f[op] st(0), st(0)
+//   fxch, fxch                               (nothing)
+//   fxch, faddp/fmulp                        faddp/fmulp
+//   fxch, fsubp/fsubrp/fdivp/fdivrp          fsubrp/fsubp/fdivrp/fdivp
+//   fld st(0), fxch                          fld st(0)
+//   fld st(0), fstp tbyte [t], fld tbyte [t] fld st(0), fstp tbyte [t], fld st(0)
+//   a load of eax/rax with the address it already holds, or one that is loaded again before use
+inline
+void peephole_x87(vector<X87_instruction>& code, mexce::peephole_counters& counters)
+{
+    using I = X87_instruction;
 
-// pop_before_generic_pow:
-        0xdd, 0xd8,                                 // fstp        st(0)
-// generic_pow:
-        0xd9, 0xe4,                                 // ftst                                 }
-        0xdf, 0xe0,                                 // fnstsw      ax                       }
-        0x9e,                                       // sahf                                 }
-        0x75, 0x08,                                 // jne         non_zero_exponent        } if exponent is 0
-        0xdd, 0xd8,                                 // fstp        st(0)                    } return 1
-        0xdd, 0xd8,                                 // fstp        st(0)                    }
-        0xd9, 0xe8,                                 // fld1                                 }
-        0xeb, 0x1f,                                 // jmp         exit_point               }
-// non_zero_exponent:
-        0xd9, 0xc9,                                 // fxch                                 }
-        0xd9, 0xe4,                                 // ftst                                 }
-        0xdf, 0xe0,                                 // fnstsw      ax                       } if base is 0, leave it in st(0)
-        0x9e,                                       // sahf                                 } and exit
-        0x74, 0x14,                                 // je          store_and_exit           }
-        0xd9, 0xe1,                                 // fabs
-        0xd9, 0xf1,                                 // fyl2x                                }
-        0xd9, 0xe8,                                 // fld1                                 }
-        0xd9, 0xc1,                                 // fld         st(1)                    }
-        0xd9, 0xf8,                                 // fprem                                } b^n = 2^(n*log2(b))
-        0xd9, 0xf0,                                 // f2xm1                                }
-        0xde, 0xc1,                                 // faddp       st(1), st                }
-        0xd9, 0xfd,                                 // fscale                               }
-        0x77, 0x02,                                 // ja          store_and_exit
-        0xd9, 0xe0,                                 // fchs
-// store_and_exit:
-        0xdd, 0xd9,                                 // fstp        st(1)
-// exit_point:
+    vector<I> out;
+    string rax;                                 // the address instruction that eax/rax holds
+
+    auto tail = [&](size_t i) -> I::Kind {
+        return out.size() > i ? out[out.size() - 1 - i].kind : I::OTHER;
     };
-    return Function("pow", 2, 1, sizeof(code), code, pow_optimizer);
-}
 
+    for (auto& in : code) {
+        if (in.kind == I::ADDRESS) {
+            if (in.bytes == rax) {
+                counters.addresses_reused++;
+                continue;
+            }
+            if (tail(0) == I::ADDRESS) {
+                out.pop_back();
+                counters.addresses_reused++;
+            }
+            rax = in.bytes;
+        }
+        if (in.kind == I::OTHER) {
+            rax.clear();
+        }
 
-inline Function Exp()
-{
-    static uint8_t code[]  =  {
-        0xd9, 0xea,                                 // fldl2e  
-        0xde, 0xc9,                                 // fmulp       st(1), st  
-        0xd9, 0xe8,                                 // fld1  
-        0xd9, 0xc1,                                 // fld         st(1)  
-        0xd9, 0xf8,                                 // fprem  
-        0xd9, 0xf0,                                 // f2xm1  
-        0xde, 0xc1,                                 // faddp       st(1), st  
-        0xd9, 0xfd,                                 // fscale  
-        0xdd, 0xd9,                                 // fstp        st(1)
-    };
-    return Function("exp", 1, 1, sizeof(code), code);
+        I::Kind last = tail(0);
+        if (in.kind == I::FSTP_ST0 && (last == I::LOAD || last == I::FLD_ST0 || last == I::LOAD_TEMP)) {
+            out.pop_back();
+            counters.loads_discarded++;
+            continue;
+        }
+        if (in.kind == I::POP_ARITH && last == I::FLD_ST0) {
+            out.back().kind  = I::X87;
+            out.back().bytes = string(1, '\xd8') + char(0xc0 | (in.bytes[1] & 0x38));
+            counters.copies_folded++;
+            continue;
+        }
+        if (in.kind == I::FXCH && (last == I::FXCH || last == I::FLD_ST0)) {
+            if (last == I::FXCH) {
+                out.pop_back();
+            }
+            counters.exchanges_removed++;
+            continue;
+        }
+        if (in.kind == I::POP_ARITH && last == I::FXCH) {
+            out.pop_back();
+            uint8_t reg = (in.bytes[1] >> 3) & 7;
+            if (reg >= 4) {
+                in.bytes[1] ^= 0x08;            // fsubp <-> fsubrp, fdivp <-> fdivrp
+            }
+            counters.exchanges_removed++;
+        }
+        if (in.kind == I::LOAD_TEMP && last == I::STORE_TEMP && tail(1) == I::FLD_ST0 &&
+            out.back().bytes.substr(3) == in.bytes.substr(3))
+        {
+            in.kind  = I::FLD_ST0;
+            in.bytes = "\xd9\xc0";
+            counters.stores_forwarded++;
+        }
+        out.push_back(in);
+    }
+    code.swap(out);
 }
 
 
-inline Function Logb()  // implementation with base
+
+// The stores and loads that keep the evaluation within the 8 registers of the x87 stack
+struct X87_spill
 {
-    static uint8_t code[]  =  {
-        0xd9, 0xe8,                                 // fld1
-        0xd9, 0xc9,                                 // fxch        st(1)
-        0xd9, 0xf1,                                 // fyl2x
-        0xd9, 0xc9,                                 // fxch        st(1)
-        0xd9, 0xe8,                                 // fld1
-        0xd9, 0xc9,                                 // fxch        st(1)
-        0xd9, 0xf1,                                 // fyl2x
-        0xde, 0xf9                                  // fdivp       st(1),st
-    };
-    return Function("logb", 2, 1, sizeof(code), code);
-}
+    enum Op { STORE, LOAD, EXCHANGE } op;
+    int32_t slot;                       // the frame slot after the temporaries, for STORE/LOAD
+};
 
 
-inline Function Ln()
+struct X87_node
 {
-    static uint8_t code[]  =  {
-        0xd9, 0xe8,                                 // fld1
-        0xd9, 0xc9,                                 // fxch        st(1)
-        0xd9, 0xf1,                                 // fyl2x
-        0xd9, 0xea,                                 // fldl2e
-        0xde, 0xf9                                  // fdivp       st(1),st
-    };
-    return Function("ln", 1, 1, sizeof(code), code);
-}
+    size_t          first;              // the index of its first element
+    int             need;               // registers, to evaluate it without spilling
+    vector<size_t>  args;               // the indices of the last elements of its arguments
+};
 
 
-// this is an alias, because of C's math.h
-inline Function Log()
+// Plans the evaluation of the node at index x (the index of its last element) with avail
+// registers, by the Sethi-Ullman labels in need: where an argument needs more registers than
+// are left by the results of the previous ones, those are stored to the frame (slot onwards),
+// and loaded again before the function. Returns the number of slots used, from 0.
+inline
+int32_t plan_x87_spills(const vector<X87_node>& nodes, const vector<Element*>& e, size_t x,
+    int avail, int32_t slot, vector<vector<X87_spill>>& before)
 {
-    Function f = Ln();
-    f.name="log";
-    return f;
+    const auto& args = nodes[x].args;
+    size_t n = args.size();
+    size_t in_registers = 0;            // the first argument whose result is in a register
+    int32_t num_slots = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        auto& a = nodes[args[i]];
+        int live = int(i - in_registers);
+        if (live && live + a.need > avail) {
+            for (size_t j = i; j-- > in_registers; ) {
+                X87_spill sp = { X87_spill::STORE, slot + int32_t(j) };
+                before[a.first].push_back(sp);
+            }
+            in_registers = i;
+            live = 0;
+        }
+        num_slots = std::max(num_slots,
+            plan_x87_spills(nodes, e, args[i], avail - live, slot + int32_t(in_registers), before));
+    }
+
+    if (in_registers) {
+        auto& b = before[x];
+        if (n == 2) {
+            // st(0) is the 2nd argument, which is exchanged with the 1st after loading it,
+            // unless the operation commutes
+            X87_spill ld = { X87_spill::LOAD, slot };
+            b.push_back(ld);
+            int op = static_cast<Function*>(e[x])->simd_arithmetic;
+            if (op != SIMD_ADD && op != SIMD_MUL) {
+                X87_spill xch = { X87_spill::EXCHANGE, 0 };
+                b.push_back(xch);
+            }
+        }
+        else {
+            // the arguments that are still in registers are stored too, then all loaded in order
+            for (size_t j = n; j-- > in_registers; ) {
+                X87_spill sp = { X87_spill::STORE, slot + int32_t(j) };
+                b.push_back(sp);
+            }
+            for (size_t j = 0; j < n; j++) {
+                X87_spill ld = { X87_spill::LOAD, slot + int32_t(j) };
+                b.push_back(ld);
+            }
+        }
+        num_slots = std::max(num_slots, slot + int32_t(n == 2 ? 1 : n));
+    }
+    return num_slots;
 }
 
 
-inline Function Log10()
+
+// Compiles the elements in [first, last) to x87 code, which is then passed through the peephole
+// pass (the rewrites are added to counters). The temporaries are at the start of the frame, and
+// the intermediate results that do not fit in the FPU stack are spilled after them.
+// Returns the number of slots of the frame that the code uses (see emit_x87_frame).
+inline
+int32_t compile_elist(impl::mexce_charstream& code_buffer, const impl::elist_const_it_t first,
+    const impl::elist_const_it_t last, mexce::peephole_counters& counters,
+    const impl::Variable_addressing* va = nullptr, int32_t num_temporaries = 0)
 {
-    static uint8_t code[]  =  {
-        0xd9, 0xe8,                                 // fld1
-        0xd9, 0xc9,                                 // fxch        st(1)
-        0xd9, 0xf1,                                 // fyl2x
-        0xd9, 0xe9,                                 // fldl2t
-        0xde, 0xf9                                  // fdivp       st(1),st
-    };
-    return Function("log10", 1, 1, sizeof(code), code);
-}
+    using namespace impl;
 
+    vector<Element*> e(first, last);
 
-inline Function Log2()
-{
-    static uint8_t code[] = {
-        0xd9, 0xe8,                                 // fld1
-        0xd9, 0xc9,                                 // fxch        st(1)
-        0xd9, 0xf1                                  // fyl2x
+    // A value that is followed by a basic arithmetic operation is used directly from
+    // memory, which saves one place in the FPU stack. The FPU has limited support for
+    // 64-bit integers, thus M64INT cannot be used this way.
+    auto arithmetic_with = [&](size_t i) -> int {
+        if (i + 1 == e.size() || e[i+1]->element_type != CFUNC) {
+            return 0;
+        }
+        auto tn = static_cast<Value*>(e[i]);
+        if (tn->element_type == CTEMP || tn->numeric_data_type == M64INT) {
+            return 0;
+        }
+        return static_cast<Function*>(e[i+1])->simd_arithmetic;
     };
-    return Function("log2", 1, 0, sizeof(code), code);
-}
 
+    // the tree of the postfix list, labelled with the registers that each node needs
+    vector<X87_node> nodes(e.size());
+    vector<size_t> stack;
+    for (size_t i = 0; i < e.size(); i++) {
+        auto& x = nodes[i];
+        x.first = i;
+        if (e[i]->element_type != CFUNC) {
+            x.need = arithmetic_with(i) ? 0 : 1;
+            stack.push_back(i);
+            continue;
+        }
+        auto f = static_cast<Function*>(e[i]);
+        size_t n = f->num_args;
+        assert(stack.size() >= n);
+        x.args.assign(stack.end() - n, stack.end());
+        stack.resize(stack.size() - n);
+        if (n) {
+            x.first = nodes[x.args[0]].first;
+        }
+        x.need = (n && !nodes[x.args.back()].need) ? 1 : std::max(1, int(n + f->stack_req));
+        for (size_t k = 0; k < n; k++) {
+            x.need = std::max(x.need, int(k) + nodes[x.args[k]].need);
+        }
+        stack.push_back(i);
+    }
 
-inline Function Ylog2()
-{
-    static uint8_t code[] = {
-        0xd9, 0xf1                                  // fyl2x
-    };
-    return Function("ylog2", 2, 0, sizeof(code), code);
-}
+    vector<vector<X87_spill>> before(e.size());
+    int32_t num_spills = 0;
+    for (size_t k = 0; k < stack.size(); k++) {
+        num_spills = std::max(num_spills,
+            plan_x87_spills(nodes, e, stack[k], 8 - int(k), 0, before));
+    }
 
+    using I = X87_instruction;
+    X87_listing x;
 
-inline Function Max()
-{
-    static uint8_t code[] = {
-        0xdb, 0xf1,                                 // fcomi       st,st(1)
-        0xda, 0xc1,                                 // fcmovb      st,st(1)
-        0xdd, 0xd9                                  // fstp        st(1)
-    };
-    return Function("max", 2, 0, sizeof(code), code);
-}
+    for (size_t i = 0; i < e.size(); i++) {
+        for (auto& sp : before[i]) {
+            switch (sp.op) {
+                case X87_spill::STORE:
+                    x.s < 0xdb < 0xbc < 0x24;               // fstp        tbyte ptr [esp/rsp+disp32]
+                    x.s << Temporary::x87_offset(num_temporaries + sp.slot);
+                    x.end(I::STORE_TEMP);
+                    break;
+                case X87_spill::LOAD:
+                    x.s < 0xdb < 0xac < 0x24;               // fld         tbyte ptr [esp/rsp+disp32]
+                    x.s << Temporary::x87_offset(num_temporaries + sp.slot);
+                    x.end(I::LOAD_TEMP);
+                    break;
+                case X87_spill::EXCHANGE:
+                    x.s < 0xd9 < 0xc9;                      // fxch        st(1)
+                    x.end(I::FXCH);
+                    break;
+            }
+        }
 
+        if (e[i]->element_type == CFUNC) {
+            emit_x87_function(x, (Function *) e[i]);
+            continue;
+        }
 
-inline Function Min()
-{
-    static uint8_t code[] = {
-        0xdb, 0xf1,                                 // fcomi       st,st(1)
-        0xd9, 0xc9,                                 // fxch        st(1)
-        0xda, 0xc1,                                 // fcmovb      st,st(1)
-        0xdd, 0xd9                                  // fstp        st(1)
-    };
-    return Function("min", 2, 0, sizeof(code), code);
-}
+        Value * tn = (Value *) e[i];
 
+        if (tn->element_type == CTEMP) {
+            x.s < 0xdb < 0xac < 0x24;               // fld         tbyte ptr [esp/rsp+disp32]
+            x.s << Temporary::x87_offset(static_cast<Temporary*>(tn)->index);
+            x.end(I::LOAD_TEMP);
+            continue;
+        }
 
-inline Function Floor()
-{
-    static uint8_t code[] = {
-        0x66, 0xc7, 0x44, 0x24, 0xfc, 0x7f, 0x06,   // mov         word ptr [esp-4], 67fh
-        0xd9, 0x7c, 0x24, 0xfe,                     // fnstcw      word ptr [esp-2]
-        0xd9, 0x6c, 0x24, 0xfc,                     // fldcw       word ptr [esp-4]
-        0xd9, 0xfc,                                 // frndint
-        0xd9, 0x6c, 0x24, 0xfe                      // fldcw       word ptr [esp-2]
-    };
-    return Function("floor", 1, 0, sizeof(code), code);
+        if (int op = arithmetic_with(i)) {
+            auto next_f = (Function*)e[i+1];
+            if (op == SIMD_MUL && tn->element_type == CCONST && *(double*)tn->address == 2.0) {
+                x.s < 0xd8 < 0xc0;                  // fadd        st(0), st(0)
+                x.end(I::X87);
+            }
+            else {
+                // fadd, fmul, fsub, fsubr, fdiv, fdivr
+                uint8_t reg = op == SIMD_ADD ? 0 : op == SIMD_MUL ? 1 : op == SIMD_SUB ? 4 : 6;
+                reg += next_f->reversed;
+                switch (tn->numeric_data_type) {
+                    case M16INT: emit_x87_memory_operation(x, 0xde, reg, tn, va, I::X87); break; // fi[op] word  ptr
+                    case M32INT: emit_x87_memory_operation(x, 0xda, reg, tn, va, I::X87); break; // fi[op] dword ptr
+                    case M32FP:  emit_x87_memory_operation(x, 0xd8, reg, tn, va, I::X87); break; // f[op]  dword ptr
+                    default:     emit_x87_memory_operation(x, 0xdc, reg, tn, va, I::X87); break; // f[op]  qword ptr
+                }
+            }
+            i++;
+            continue;
+        }
+
+        if (tn->element_type == CCONST && emit_load_special_constant(x.s, *(double*)tn->address)) {
+            x.end(I::LOAD);
+            continue;
+        }
+
+        switch (tn->numeric_data_type) {
+            case M32FP:   emit_x87_memory_operation(x, 0xd9, 0, tn, va, I::LOAD); break; // fld  dword ptr
+            case M64FP:   emit_x87_memory_operation(x, 0xdd, 0, tn, va, I::LOAD); break; // fld  qword ptr
+            case M16INT:  emit_x87_memory_operation(x, 0xdf, 0, tn, va, I::LOAD); break; // fild word  ptr
+            case M32INT:  emit_x87_memory_operation(x, 0xdb, 0, tn, va, I::LOAD); break; // fild dword ptr
+            case M64INT:  emit_x87_memory_operation(x, 0xdf, 5, tn, va, I::LOAD); break; // fild qword ptr
+        }
+    }
+
+    peephole_x87(x.code, counters);
+    for (auto& in : x.code) {
+        append_code(code_buffer, in.bytes, in.pool_references);
+    }
+    return num_temporaries + num_spills;
 }
 
 
-inline Function Ceil()
+
+// Emits the entry of a generated function, which keeps its arguments in registers that are
+// preserved across calls: the context pointer (the 1st argument) in ebx/rbx, where the
+// variables that are bound at an offset are addressed relative to it, if context is set, and
+// the output array (the 2nd argument) in esi/rsi, if outputs is set. If block is set, it is
+// loaded to ebp/rbp, for the variables in the variable block. Returns the number of pushes.
+inline
+int emit_keep_arguments(mexce_charstream& s, bool context, bool outputs, const void* block = nullptr)
 {
-    static uint8_t code[] = {
-        0x66, 0xc7, 0x44, 0x24, 0xfc, 0x7f, 0x0a,   // mov         word ptr [esp-4], a7fh
-        0xd9, 0x7c, 0x24, 0xfe,                     // fnstcw      word ptr [esp-2]
-        0xd9, 0x6c, 0x24, 0xfc,                     // fldcw       word ptr [esp-4]
-        0xd9, 0xfc,                                 // frndint
-        0xd9, 0x6c, 0x24, 0xfe                      // fldcw       word ptr [esp-2]
-    };
-    return Function("ceil", 1, 0, sizeof(code), code);
+    int pushes = 0;
+    if (context) {
+        s < 0x53;                                               // push        ebx/rbx
+        pushes++;
+#ifdef MEXCE_64
+  #ifdef _WIN32
+        s < 0x48 < 0x89 < 0xcb;                                 // mov         rbx, rcx
+  #else
+        s < 0x48 < 0x89 < 0xfb;                                 // mov         rbx, rdi
+  #endif
+#else
+        s < 0x8b < 0x5c < 0x24 < 0x08;                          // mov         ebx, dword ptr [esp+8]
+#endif
+    }
+    if (outputs) {
+        s < 0x56;                                               // push        esi/rsi
+        pushes++;
+#ifdef MEXCE_64
+  #ifdef _WIN32
+        s < 0x48 < 0x89 < 0xd6;                                 // mov         rsi, rdx
+  #endif
+#else
+        s < 0x8b < 0x74 < 0x24 < (8 + 4 * pushes);              // mov         esi, dword ptr [esp+0Ch/10h]
+#endif
+    }
+    if (block) {
+        s < 0x55;                                               // push        ebp/rbp
+        pushes++;
+#ifdef MEXCE_64
+        s < 0x48;                                               // REX.W
+#endif
+        s < 0xbd;                                               // mov         ebp/rbp, imm32/imm64
+        s << block;
+    }
+    return pushes;
 }
 
 
-inline Function Round()
+inline
+void emit_restore_arguments(mexce_charstream& s, bool context, bool outputs, bool block = false)
 {
-    static uint8_t code[] = {
+    if (block) {
+        s < 0x5d;                                               // pop         ebp/rbp
+    }
+    if (outputs) {
+        s < 0x5e;                                               // pop         esi/rsi
+    }
+    if (context) {
+        s < 0x5b;                                               // pop         ebx/rbx
+    }
+}
 
-        // NOTE: In this case, saving/restoring the control word is most likely redundant.
 
-        0x66, 0xc7, 0x44, 0x24, 0xfc, 0x7f, 0x02,   // mov         word ptr [esp-4], 27fh
-        0xd9, 0x7c, 0x24, 0xfe,                     // fnstcw      word ptr [esp-2]
-        0xd9, 0x6c, 0x24, 0xfc,                     // fldcw       word ptr [esp-4]
-        0xd9, 0xfc,                                 // frndint
-        0xd9, 0x6c, 0x24, 0xfe                      // fldcw       word ptr [esp-2]
-    };
-    return Function("round", 1, 0, sizeof(code), code);
+// Reserves or frees the frame of the x87 code, which holds the temporaries and the spilled
+// intermediate results
+inline
+void emit_x87_frame(mexce_charstream& s, int32_t num_slots, bool reserve)
+{
+    if (!num_slots) {
+        return;
+    }
+#ifdef MEXCE_64
+    s < 0x48;                                                   // REX.W
+#endif
+    s < 0x81 < (reserve ? 0xec : 0xc4);                         // sub/add     esp/rsp, imm32
+    s << Temporary::x87_offset(num_slots);
 }
 
 
-inline Function Int()
+// Copies its argument to a temporary (whose index is in folded_arg) and leaves it in place.
+// It follows the first occurrence of a common subexpression.
+inline
+Function* make_temporary_store(evaluator* ev, int32_t index)
 {
-    static uint8_t code[] = {
-        0xd9, 0xfc                                  // frndint
-    };
-    return Function("int", 1, 0, sizeof(code), code);
+    mexce_charstream s;
+    s < 0xd9 < 0xc0;                                            // fld         st(0)
+    s < 0xdb < 0xbc < 0x24;                                     // fstp        tbyte ptr [esp/rsp+disp32]
+    s << Temporary::x87_offset(index);
+    auto code = s.s.str();
+
+    Function f("tee", 1, 1, code.size(), push_intermediate_code(ev, code), nullptr, [](Simd_compiler& c) {
+        c.store_slot((int)c.function->folded_arg, c.arg(0));
+        return true;
+    });
+    f.folded_arg = index;
+    return make_function(ev, f);
 }
 
 
-inline Function Mod()
+// FNV-1a
+inline
+uint64_t hash_bytes(const void* p, size_t n, uint64_t h = 14695981039346656037ull)
 {
-    static uint8_t code[] = {
-        0xd9, 0xc9,                                 // fxch        st(1)
-        0xd9, 0xf8,                                 // fprem
-        0xdd, 0xd9                                  // fstp        st(1)
-    };
-    return Function("mod", 2, 0, sizeof(code), code);
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ ((const uint8_t*)p)[i]) * 1099511628211ull;
+    }
+    return h;
 }
 
 
-inline Function Less_than()
+inline
+uint64_t element_hash(const Element* e)
 {
-    static uint8_t code[] = {
-        0xdf, 0xf1,                                 // fcomip      st,st(1)  
-        0xdd, 0xd8,                                 // fstp        st(0)  
-        0xd9, 0xe8,                                 // fld1  
-        0xd9, 0xee,                                 // fldz  
-        0xdb, 0xd1,                                 // fcmovnb     st,st(1)  
-        0xdd, 0xd9,                                 // fstp        st(1)  
-    };
-    return Function("less_than", 2, 0, sizeof(code), code);
+    uint64_t h = hash_bytes(&e->element_type, sizeof(e->element_type));
+    if (e->element_type == CCONST) {
+        double v = static_cast<const Constant*>(e)->get_data_as_double();
+        return hash_bytes(&v, sizeof(v), h);
+    }
+    if (e->element_type == CVAR) {
+        auto v = static_cast<const Variable*>(e);
+        auto address = v->address;
+        h = hash_bytes(&v->context_offset, sizeof(v->context_offset), h);
+        return hash_bytes(&address, sizeof(address), h);
+    }
+    if (e->element_type == CFUNC) {
+        auto f = static_cast<const Function*>(e);
+        return hash_bytes(f->code, f->code_size, h);
+    }
+    return hash_bytes(&e, sizeof(e), h);
 }
 
 
-inline Function Bnd()
+// Whether two elements compute the same. Unlike elist_comparison, which serves the optimizer,
+// constants are compared by their bits (0 and -0 differ), and functions by all that affects
+// the generated code.
+inline
+bool same_element(const Element* a, const Element* b)
 {
-    static uint8_t code[] = {
-        0xd9, 0xc9,                                 // fxch        st(1)
-        0xd9, 0xf8,                                 // fprem
-        0xd9, 0xc0,                                 // fld         st(0)
-        0xdc, 0xc2,                                 // fadd        st(2), st
-        0xd9, 0xee,                                 // fldz
-        0xdf, 0xf1,                                 // fcomip      st,st(1)
-        0xdd, 0xd8,                                 // fstp        st(0)
-        0xdb, 0xc1,                                 // fcmovnb     st,st(1)
-        0xdd, 0xd9                                  // fstp        st(1)
-    };
-    return Function("bnd", 2, 2, sizeof(code), code);
+    if (a->element_type != b->element_type) {
+        return false;
+    }
+    if (a->element_type == CCONST) {
+        double da = static_cast<const Constant*>(a)->get_data_as_double();
+        double db = static_cast<const Constant*>(b)->get_data_as_double();
+        return memcmp(&da, &db, sizeof(double)) == 0;
+    }
+    if (a->element_type == CVAR) {
+        auto va = static_cast<const Variable*>(a);
+        auto vb = static_cast<const Variable*>(b);
+        return va->in_context == vb->in_context && va->context_offset == vb->context_offset &&
+            va->address == vb->address && va->numeric_data_type == vb->numeric_data_type;
+    }
+    if (a->element_type == CFUNC) {
+        auto fa = static_cast<const Function*>(a);
+        auto fb = static_cast<const Function*>(b);
+        return fa->num_args == fb->num_args && fa->code_size == fb->code_size &&
+            memcmp(fa->code, fb->code, fa->code_size) == 0 && fa->simd == fb->simd &&
+            fa->simd_arithmetic == fb->simd_arithmetic &&
+            memcmp(&fa->folded_arg, &fb->folded_arg, sizeof(double)) == 0;
+    }
+    return a == b;
 }
 
 
+// sin and cos of the same argument, by one fsincos: it leaves one of them (cos, if keep_cos) and
+// stores the other to the temporary at index (see fuse_sin_cos). Like fsin and fcos, fsincos
+// leaves arguments beyond 2^63 as they are, without pushing the second result, and then the
+// argument is taken for both.
 inline
-pair<elist_it_t, elist_it_t> get_dependent_chunk(elist_it_t it)
+Function* make_sin_cos(evaluator* ev, int32_t index, bool keep_cos)
 {
-    auto it_end = next(it);
-    while ( (*it) ->element_type == CFUNC) {
-        shared_ptr<Function> f = static_pointer_cast<Function>( *it );
-        if (!f->args.size()) {
-            break;
-        }
-        it = f->args[f->args.size()-1];
+    mexce_charstream s;
+    s < 0xd9 < 0xfb;                                            // fsincos
+    s < 0xdf < 0xe0;                                            // fnstsw      ax
+    s < 0x9e;                                                   // sahf
+    s < 0x7b < 0x02;                                            // jnp         in_range
+    s < 0xd9 < 0xc0;                                            // fld         st(0)
+    if (keep_cos) {                                             // in_range:
+        s < 0xd9 < 0xc9;                                        // fxch        st(1)
     }
-    return make_pair(it, it_end);
+    s < 0xdb < 0xbc < 0x24;                                     // fstp        tbyte ptr [esp/rsp+disp32]
+    s << Temporary::x87_offset(index);
+    auto code = s.s.str();
+
+    Function f = keep_cos ?
+        Function("cos_sin", 1, 1, code.size(), push_intermediate_code(ev, code), nullptr, [](Simd_compiler& c) {
+            return simd_trigonometric(c, TRIG_COS_SIN);
+        }) :
+        Function("sin_cos", 1, 1, code.size(), push_intermediate_code(ev, code), nullptr, [](Simd_compiler& c) {
+            return simd_trigonometric(c, TRIG_SIN_COS);
+        });
+    f.folded_arg = index;
+    return make_function(ev, f);
 }
 
 
-struct elist_comparison {
-    bool operator()(const elist_t& a, const elist_t& b) const {
-
-        // empty element lists cannot exist
-        assert(a.size() && b.size());
+// Computes sin(x) and cos(x) of the same x at once, where an expression has both (e.g. in a
+// rotation): the first of the two to occur is replaced by make_sin_cos, which stores the other to
+// a temporary, and the occurrences of the other are replaced by the temporary. The arguments are
+// grouped by elist_comparison, and then compared by their elements, which also tells 0 from -0.
+// The largest are fused first, as those inside them may disappear with them. Returns the number
+// of temporaries.
+inline
+int32_t fuse_sin_cos(evaluator* ev, elist_t& elist)
+{
+#ifdef MEXCE_ACCURACY
+    // cos is computed by its series, which fsincos would not repeat
+    return 0;
+#else
+    struct Occurrence
+    {
+        elist_it_t      first;              // of the argument
+        elist_it_t      last;               // sin or cos
+        const void*     nodes[2];           // of first and last, which identify them after they are erased
+        bool            cos;
+    };
 
-        // if their size differs, we use that for comparison
-        if (a.size() != b.size()) {
-            return a.size() > b.size();
+    map<elist_t, vector<Occurrence>, elist_comparison> by_argument;
+    vector<elist_it_t> operands;            // where each one starts
+    for (auto it = elist.begin(); it != elist.end(); it++) {
+        auto first = it;
+        if ((*it)->element_type == CFUNC) {
+            auto f = static_cast<Function*>(*it);
+            if (f->num_args) {
+                first = operands[operands.size() - f->num_args];
+                operands.resize(operands.size() - f->num_args);
+            }
+            string name = f->name;
+            if (name == "sin" || name == "cos") {
+                Occurrence o = { first, it, { &*first, &*it }, name == "cos" };
+                by_argument[elist_t(first, it)].push_back(o);
+            }
         }
+        operands.push_back(first);
+    }
 
-        // they are the same size, thus we need to traverse both
-        auto ita = a.begin();
-        auto itb = b.begin();
-        for (; ita != a.end(); ita++, itb++) {
-            // start by comparing element types
-            if ((*ita)->element_type != (*itb)->element_type) {
-                return (*ita)->element_type > (*itb)->element_type;
+    // elist_comparison orders the larger lists first
+    std::set<const void*> erased;
+    int32_t num_temporaries = 0;
+    for (auto& a : by_argument) {
+        vector<Occurrence> occurrences;
+        for (auto& o : a.second) {
+            if (!erased.count(o.nodes[0]) && !erased.count(o.nodes[1])) {
+                occurrences.push_back(o);
             }
+        }
 
-            // if they are constants, we compare the values
-            if ((*ita)->element_type == CCONST) {
-                double da = static_pointer_cast<Constant>(*ita)->get_data_as_double();
-                double db = static_pointer_cast<Constant>(*itb)->get_data_as_double();
-                if (da != da && db != db) { // i.e. if both of them are NaN
-                    // not all NaNs are the same, we compare binary
-                    auto mcr = memcmp(&da, &db, sizeof(double));
-                    if (mcr != 0) {
-                        return mcr < 0;
+        while (!occurrences.empty()) {
+            auto x = occurrences[0];
+            auto same_argument = [&](const Occurrence& y) {
+                for (auto i = x.first, j = y.first; i != x.last; i++, j++) {
+                    if (!same_element(*i, *j)) {
+                        return false;
                     }
                 }
-                else
-                if (da != db) {
-                    return da < db;
+                return true;
+            };
+
+            // the occurrences of the other function, with the same argument, and the rest
+            vector<Occurrence> others, rest;
+            for (size_t k = 1; k < occurrences.size(); k++) {
+                auto& y = occurrences[k];
+                if (y.cos != x.cos && same_argument(y)) {
+                    others.push_back(y);
                 }
-                continue; // it is the same... move on
-            }
-
-            // if they are variables, we compare addresses
-            if ((*ita)->element_type == CVAR) {
-                volatile void* aa = static_pointer_cast<Variable>(*ita)->address;
-                volatile void* ab = static_pointer_cast<Variable>(*itb)->address;
-                if (aa != ab) {
-                    return aa < ab;
+                else {
+                    rest.push_back(y);
                 }
-                continue; // it is the same... move on
+            }
+            occurrences.swap(rest);
+            if (others.empty()) {
+                continue;
             }
 
-            // if they are functions, we compare their code
-            if ((*ita)->element_type == CFUNC) {
-                string fna = static_pointer_cast<Function>(*ita)->code;
-                string fnb = static_pointer_cast<Function>(*itb)->code;
-
-                if (fna != fnb) {
-                    return fna < fnb;
+            int32_t index = num_temporaries++;
+            *x.last = make_sin_cos(ev, index, x.cos);
+            auto t = make_temporary(ev, index);
+            for (auto& y : others) {
+                for (auto e = y.first; e != y.last; e = elist.erase(e)) {
+                    erased.insert(&*e);
                 }
-                continue; // it is the same... move on [this one is not really required]
+                *y.last = t;
             }
         }
-
-        return false; // they are equal
     }
-};
-
+    return num_temporaries;
+#endif
+}
 
 
-template <uint8_t OP>
-void emit_apply_op_with_value(impl::mexce_charstream& s, shared_ptr<impl::Value> v)
+// Computes each subexpression that occurs more than once, in one or across the expressions
+// of an evaluator, only where it first occurs: a store to a temporary follows it there, and
+// the other occurrences are replaced by the temporary. The subexpressions are hash-consed, i.e.
+// each distinct one is numbered by its function and the numbers of its arguments, which makes
+// the list a DAG, and the largest that repeat are replaced first, since the smaller ones that
+// they contain disappear with them. roots holds the last element of each expression, and is
+// updated if a store follows it. The temporaries are numbered from num_temporaries, which are
+// already in use (see fuse_sin_cos). Returns the number of temporaries, with those.
+inline
+int32_t eliminate_common_subexpressions(evaluator* ev, elist_t& elist, vector<elist_it_t>& roots,
+    int32_t num_temporaries)
 {
-    using namespace impl;
-#ifdef MEXCE_64
-    s < 0x48 < 0xb8;                        // mov            rax, qword ptr
-#else
-    s < 0xb8;                               // mov            eax, dword ptr
-#endif
-    s << v->address;                        //                   [the address]
-    switch(v->numeric_data_type) {
-        case M16INT: s < 0xde < OP; break;  // f[OP]  word  ptr [eax/rax]  
-        case M32INT: s < 0xda < OP; break;  // f[OP]  dword ptr [eax/rax]  
-        case M32FP:  s < 0xd8 < OP; break;  // f[OP]  dword ptr [eax/rax]
-        case M64FP:  s < 0xdc < OP; break;  // f[OP]  qword ptr [eax/rax]
+    struct Subexpression
+    {
+        elist_it_t      first;
+        elist_it_t      last;               // the function that computes it
+        const void*     node;               // of last, which identifies it after it is erased
+        size_t          size;
+        size_t          depth;              // of its result in the FPU stack (at most)
+        int             number;
+    };
 
-        // the FPU has limited support for 64-bit integers and M64INT cannot be supported here
-        default: assert(false);
+    // the distinct elements, by their hash, and the distinct subexpressions, by their key:
+    // the number of the element, followed by those of the arguments
+    map<uint64_t, vector<pair<const Element*, int> > > elements;
+    int num_elements = 0;
+    map<vector<int>, int> numbers;
+
+    // the occurrences of the functions, in the order of the list
+    vector<Subexpression> subexpressions;
+    vector<Subexpression> operands;
+    for (auto it = elist.begin(); it != elist.end(); it++) {
+        auto& bucket = elements[element_hash(*it)];
+        int element = -1;
+        for (auto& e : bucket) {
+            if (same_element(e.first, *it)) {
+                element = e.second;
+                break;
+            }
+        }
+        if (element < 0) {
+            element = num_elements++;
+            bucket.push_back(make_pair(*it, element));
+        }
+        vector<int> key(1, element);
+
+        Subexpression x = { it, it, &*it, 1, 0, 0 };
+        size_t n = (*it)->element_type == CFUNC ? static_cast<Function*>(*it)->num_args : 0;
+        if (n) {
+            auto arg = operands.end() - n;
+            x.first = arg->first;
+            for (; arg != operands.end(); arg++) {
+                x.size += arg->size;
+                key.push_back(arg->number);
+            }
+            operands.resize(operands.size() - n);
+        }
+        x.number = numbers.insert(make_pair(key, (int)numbers.size())).first->second;
+        x.depth  = operands.size() + 1;
+        if (n) {
+            subexpressions.push_back(x);
+        }
+        operands.push_back(x);
     }
-}
 
+    // the classes of equal subexpressions that occur more than once, by the index of their occurrences
+    vector<vector<size_t> > classes(numbers.size());
+    for (size_t i = 0; i < subexpressions.size(); i++) {
+        classes[subexpressions[i].number].push_back(i);
+    }
+    classes.erase(std::remove_if(classes.begin(), classes.end(),
+        [](const vector<size_t>& c) { return c.size() < 2; }), classes.end());
+    std::sort(classes.begin(), classes.end(), [&](const vector<size_t>& a, const vector<size_t>& b) {
+        size_t sa = subexpressions[a[0]].size;
+        size_t sb = subexpressions[b[0]].size;
+        return sa != sb ? sa > sb : a[0] < b[0];
+    });
+
+    std::set<const void*> erased;
+    for (auto& c : classes) {
+        vector<const Subexpression*> occurrences;
+        for (auto i : c) {
+            if (!erased.count(subexpressions[i].node)) {
+                occurrences.push_back(&subexpressions[i]);
+            }
+        }
+
+        // the store needs one more place in the FPU stack
+        if (occurrences.size() < 2 || occurrences[0]->depth >= 8) {
+            continue;
+        }
+
+        int32_t index = num_temporaries++;
+        auto x = occurrences[0];
+        auto store = elist.insert(next(x->last), make_temporary_store(ev, index));
+        for (auto& r : roots) {
+            if (r == x->last) {
+                r = store;
+            }
+        }
 
-template <uint8_t OP>
-void emit_apply_op_with_constant(evaluator* ev, impl::mexce_charstream& s, double v)
-{
-    emit_apply_op_with_value<OP>(s, impl::make_intermediate_constant(ev, v));
+        auto t = make_temporary(ev, index);
+        for (size_t k = 1; k < occurrences.size(); k++) {
+            auto y = occurrences[k];
+            for (auto e = y->first; e != y->last; e = elist.erase(e)) {
+                erased.insert(&*e);
+            }
+            erased.insert(y->node);
+            *y->last = t;
+        }
+    }
+    return num_temporaries;
 }
 
 
 
+// With fast math and FMA: marks the add/sub operations that take the result of a mul, as in
+// a*b+c, to be computed by one FMA instruction, without rounding the product (see
+// Simd_compiler::compile_function). This shortens the dependency chain only if c is computed
+// before a*b, e.g. in x*(x*(x*c3+c2)+c1)+c0, but lengthens it in a*b+c*d, where each product
+// would wait for the other, so a product is contracted only where it is the deeper operand.
 inline
-void emit_load_constant(evaluator* ev, impl::mexce_charstream& s, double v)
+void contract_multiply_add(elist_t& elist)
 {
-    using namespace impl;
-
-    double av = abs(v);
-    bool hit = false;
-
-    if (av == 0.0)                         { s < 0xd9 < 0xee; hit = true; } else  // fldz
-    if (av == 1.0)                         { s < 0xd9 < 0xe8; hit = true; } else  // fld1
-    if (av == 3.1415926535897932384626433) { s < 0xd9 < 0xeb; hit = true; } else  // fldpi
-    if (av == 3.32192809488736234787)      { s < 0xd9 < 0xe9; hit = true; } else  // fldl2t
-    if (av == 1.44269504088896340736)      { s < 0xd9 < 0xea; hit = true; } else  // fldl2e
-    if (av == 0.3010299956639811952137)    { s < 0xd9 < 0xec; hit = true; } else  // fldlg2
-    if (av == 0.6931471805599453094172)    { s < 0xd9 < 0xed; hit = true; }       // fldln2
+    struct Operand
+    {
+        Function*   f;              // that computes it, or null for values
+        int         depth;          // of the operations that it depends on
+        int         args_depth;     // of its arguments
+    };
 
-    if (hit) {
-        if (v < 0) {
-            s < 0xd9 < 0xe0;  // fchs
+    vector<Operand> operands;
+    for (auto e : elist) {
+        Operand x = { nullptr, 0, 0 };
+        size_t n = 0;
+        if (e->element_type == CFUNC) {
+            x.f = static_cast<Function*>(e);
+            n = x.f->num_args;
+            for (auto a = operands.end() - n; a != operands.end(); a++) {
+                x.args_depth = std::max(x.args_depth, a->depth);
+            }
+            x.depth = x.args_depth + 1;
         }
-        return;
+        if (n == 2 && (x.f->simd_arithmetic == SIMD_ADD || x.f->simd_arithmetic == SIMD_SUB) && !x.f->reversed) {
+            for (int i = 0; i < 2; i++) {
+                auto& g = operands[operands.size() - 1 - i];
+                auto& c = operands[operands.size() - 2 + i];
+                if (g.f && g.f->simd_arithmetic == SIMD_MUL && !g.f->reversed && c.depth < g.depth) {
+                    g.f->contracted = true;
+                    x.f->fused_arg  = i;
+                    x.depth = g.depth;
+                    break;
+                }
+            }
+        }
+        operands.resize(operands.size() - n);
+        operands.push_back(x);
     }
-
-    auto sc = make_intermediate_constant(ev, v);
-
-#ifdef MEXCE_64
-    s < 0x48 < 0xb8;                            // mov            rax, qword ptr
-    s << (void*)(sc->address);
-    s < 0xdd < 0x00;                            // fld            [rax]
-#else
-    s < 0xdd < 0x05;                            // fld            [immediate address]
-    s << (void*)(sc->address);
-#endif
 }
 
 
+inline Function RSub();
+inline Function RDiv();
 
-inline
-void compile_elist(impl::mexce_charstream& code_buffer, const impl::elist_const_it_t first, const impl::elist_const_it_t last)
-{
-    using namespace impl;
-
-    elist_const_it_t it = first;
 
-    for (; it != last; it++) {
-        if ((*it)->element_type == CVAR  ||
-            (*it)->element_type == CCONST)
-        {
-            Value * tn = (Value *) it->get();
+// Sethi-Ullman ordering of the operands, for the 8 registers of the x87 stack: the operands
+// of the basic arithmetic operations are swapped, where evaluating the second one first needs
+// fewer registers, with fsubr/fdivr for the operations that do not commute. A value that is
+// the second operand of such an operation needs no register, as it is used from memory (see
+// compile_elist), e.g. x-sin(y) is computed as sin(y), then fsubr with x.
+inline
+void order_operands(evaluator* ev, elist_t& elist)
+{
+    struct Operand
+    {
+        elist_it_t  first;
+        int         need;           // registers, to evaluate it
+        bool        from_memory;    // it is a value, which can be used from memory
+    };
 
-#ifdef MEXCE_64
-            code_buffer << (uint16_t)0xb848;   // move input address to rax (opcode)
-            code_buffer << (void*)tn->address;
-#endif
+    vector<Operand> operands;
+    for (auto it = elist.begin(); it != elist.end(); it++) {
+        if ((*it)->element_type != CFUNC) {
+            Operand v = { it, 1, static_cast<Value*>(*it)->numeric_data_type != M64INT };
+            operands.push_back(v);
+            continue;
+        }
 
-            switch (tn->numeric_data_type) {
-#ifdef MEXCE_64
-                // On x64, variable addresses are already supplied in rax.
-                case M32FP:   code_buffer < 0xd9 < 0x00; break;
-                case M64FP:   code_buffer < 0xdd < 0x00; break;
-                case M16INT:  code_buffer < 0xdf < 0x00; break;
-                case M32INT:  code_buffer < 0xdb < 0x00; break;
-                case M64INT:  code_buffer < 0xdf < 0x28; break;
-#else
-                // On 32-bit x86, variable addresses are explicitly specified.
-                case M32FP:   code_buffer < 0xd9 < 0x05; break;
-                case M64FP:   code_buffer < 0xdd < 0x05; break;
-                case M16INT:  code_buffer < 0xdf < 0x05; break;
-                case M32INT:  code_buffer < 0xdb < 0x05; break;
-                case M64INT:  code_buffer < 0xdf < 0x2d; break;
-#endif
+        auto f = static_cast<Function*>(*it);
+        size_t n = f->num_args;
+        Operand x = { it, std::max(1, int(n + f->stack_req)), false };
+        if (n == 2 && f->simd_arithmetic && !f->reversed) {
+            auto& a = operands[operands.size() - 2];
+            auto& b = operands.back();
+            int in_order = std::max(a.need, (b.from_memory ? 0 : b.need) + 1);
+            int swapped  = std::max(b.need, (a.from_memory ? 0 : a.need) + 1);
+            x.first = a.first;
+            x.need  = in_order;
+            if (swapped < in_order) {
+                elist.splice(a.first, elist, b.first, it);
+                x.first = b.first;
+                x.need  = swapped;
+                if (f->simd_arithmetic == SIMD_SUB) {
+                    *it = make_function(ev, RSub());
+                }
+                if (f->simd_arithmetic == SIMD_DIV) {
+                    *it = make_function(ev, RDiv());
+                }
             }
-
-#ifndef MEXCE_64
-            code_buffer << (void*)(tn->address);
-#endif
         }
-        else {
-            Function * tf = (Function *) it->get();
-            code_buffer.s.write(tf->code.data(), tf->code.size());
+        else
+        if (n) {
+            x.first = operands[operands.size() - n].first;
+            for (size_t i = 0; i < n; i++) {
+                x.need = std::max(x.need, int(i) + operands[operands.size() - n + i].need);
+            }
         }
+        operands.resize(operands.size() - n);
+        operands.push_back(x);
     }
 }
 
 
 
-inline shared_ptr<Function> make_function(const string& name);
+inline Function* make_function(evaluator* ev, const string& name);
 
 
 inline string infix_operator_to_function_name(const string& op)
@@ -1390,17 +5255,17 @@ string elist_to_string(const elist_t& elist)
     for (auto it = elist.rbegin(); it != elist.rend(); it++) {
         auto e = *it;
         if (e->element_type == CFUNC) {
-            auto f = static_pointer_cast<Function>(e);
-            st.push_back(make_tuple(string(), f->args.size() + 1, vector<string>{f->name} ));
+            auto f = static_cast<Function*>(e);
+            st.push_back(make_tuple(string(), f->num_args + 1, vector<string>{f->name} ));
         }
         else
         if (e->element_type == CCONST) {
-            auto c = static_pointer_cast<Constant>(e);
+            auto c = static_cast<Constant*>(e);
             get<2>(st.back()).push_back( double_to_pretty_string(c->get_data_as_double()) );
         }
         else
-        if (e->element_type == CVAR) {
-            auto v = static_pointer_cast<Variable>(e);
+        if (e->element_type == CVAR || e->element_type == CTEMP) {
+            auto v = static_cast<Value*>(e);
             get<2>(st.back()).push_back( v->name );
         }
 
@@ -1447,409 +5312,1145 @@ string elist_to_string(const elist_t& elist)
 }
 
 
-inline
-void asmd_optimizer(elist_it_t it, evaluator* ev, elist_t* elist)
+// Combines terms with op as a balanced tree, e.g. (a+b)+(c+d), whose depth is log2(n)
+// operations instead of n-1, and returns the result
+inline
+elist_t balanced_chain(evaluator* ev, vector<elist_t> terms, const char* op)
+{
+    while (terms.size() > 1) {
+        vector<elist_t> pairs;
+        for (size_t i = 0; i + 1 < terms.size(); i += 2) {
+            terms[i].splice(terms[i].end(), terms[i + 1]);
+            terms[i].push_back(make_function(ev, op));
+            pairs.push_back(std::move(terms[i]));
+        }
+        if (terms.size() % 2) {
+            pairs.push_back(std::move(terms.back()));
+        }
+        terms.swap(pairs);
+    }
+    return std::move(terms[0]);
+}
+
+
+// Replaces a simplified add/sub or mul/div chain with plain elements. Terms with a
+// positive sign come first, so that the chain starts from one of them rather than
+// from a constant, and code generation takes single values directly from memory.
+// A constant divisor other than 1 divides the chain at the end (see asmd_optimizer).
+// With fast math, the terms of each sign are combined as balanced trees instead, and the
+// result is a single subtraction or division of them, e.g. a*b/(c*d) instead of a*b/c/d.
+// A sum without positive terms whose constant is -0, e.g. -a-b, starts with neg(a) rather
+// than -0-a, which keeps the sign of NaN as fchs does.
+inline
+void rebuild_asmd_chain(elist_it_t it, evaluator* ev, elist_t* elist, int fclass,
+    const map<elist_t, int, elist_comparison>& sig_map, double ac_final, double divisor)
+{
+    double neutral = fclass==1 ? 0.0 : 1.0;
+    const char* op[2] = { fclass==1 ? "add" : "mul", fclass==1 ? "sub" : "div" };
+
+    bool has_positive = false;
+    bool has_negative = false;
+    for (auto &e : sig_map) {
+        has_positive |= e.second > 0;
+        has_negative |= e.second < 0;
+    }
+    bool negated = !has_positive && has_negative && fclass==1 && ac_final == 0.0 && std::signbit(ac_final);
+
+    elist_t seq;
+
+    if (ev->get_fast_math()) {
+        vector<elist_t> terms[2];
+        if (!has_positive && !negated) {
+            terms[0].push_back(elist_t(1, make_intermediate_constant(ev, ac_final)));
+        }
+        for (auto &e : sig_map) {
+            if (e.second == 0) {
+                continue;
+            }
+            elist_t term = e.first;
+            int factor = abs(e.second);
+            if (factor != 1) {
+                term.push_back(make_intermediate_constant(ev, factor));
+                term.push_back(make_function(ev, fclass==1 ? "mul" : "pow"));
+            }
+            terms[e.second < 0].push_back(term);
+        }
+        if (has_positive && ac_final != neutral) {
+            terms[0].push_back(elist_t(1, make_intermediate_constant(ev, ac_final)));
+        }
+        if (negated) {
+            seq = balanced_chain(ev, terms[1], op[0]);
+            seq.push_back(make_function(ev, "neg"));
+        }
+        else {
+            seq = balanced_chain(ev, terms[0], op[0]);
+            if (!terms[1].empty()) {
+                seq.splice(seq.end(), balanced_chain(ev, terms[1], op[0]));
+                seq.push_back(make_function(ev, op[1]));
+            }
+        }
+    }
+    else {
+        // if there is nothing to start the chain with, start from the constant, i.e. c-a-b, c/a/b
+        if (!has_positive && !negated) {
+            seq.push_back(make_intermediate_constant(ev, ac_final / divisor));
+        }
+
+        for (int sign = 1; sign >= -1; sign -= 2) {
+            for (auto &e : sig_map) {
+                if (e.second * sign <= 0) {
+                    continue;
+                }
+                bool chained = !seq.empty();
+                seq.insert(seq.end(), e.first.begin(), e.first.end());
+                int factor = abs(e.second);
+                if (factor != 1) {
+                    seq.push_back(make_intermediate_constant(ev, factor));
+                    seq.push_back(make_function(ev, fclass==1 ? "mul" : "pow"));
+                }
+                if (chained) {
+                    seq.push_back(make_function(ev, op[sign < 0]));
+                }
+                else
+                if (negated) {
+                    seq.push_back(make_function(ev, "neg"));
+                }
+            }
+        }
+
+        if (has_positive && ac_final != neutral) {
+            seq.push_back(make_intermediate_constant(ev, ac_final));
+            seq.push_back(make_function(ev, op[0]));
+        }
+        if (has_positive && divisor != 1.0) {
+            seq.push_back(make_intermediate_constant(ev, divisor));
+            seq.push_back(make_function(ev, op[1]));
+        }
+    }
+
+    link_arguments(seq);
+    for (auto y = seq.begin(); y != seq.end(); y++) {
+        if ((*y)->element_type == CFUNC && static_cast<Function*>(*y)->optimizer == pow_optimizer) {
+            pow_optimizer(y, ev, &seq);
+        }
+    }
+    link_arguments(seq);
+
+    // the last element takes the place of the chain, the rest goes before it
+    auto seq_last = prev(seq.end());
+    *it = *seq_last;
+    seq.erase(seq_last);
+    elist->splice(it, seq);
+}
+
+
+inline void merge_factors(evaluator* ev, list<elist_t>* absorbed);
+
+
+inline
+void asmd_optimizer(elist_it_t it, evaluator* ev, elist_t* elist)
+{
+    auto f = static_cast<Function*>(*it);
+    auto fname = string(f->name);
+    int fclass = (fname == "add" || fname == "sub") ? 1 : (fname == "mul" || fname == "div") ? 2 : 0;
+    assert(fclass);
+
+    // -0 rather than 0, since -0 + x is x also for x = 0
+    double neutral = fclass==1 ? -0.0 : 1.0;
+
+    bool arg2_inv = (fname == "sub" || fname == "div");
+
+    if (f->parent != elist->end() &&  (*f->parent)->element_type == CFUNC) {
+        Function* pf = static_cast<Function*>(*f->parent);
+        auto pname = string(pf->name);
+        int pclass = (pname == "add" || pname == "sub") ? 1 : (pname == "mul" || pname == "div") ? 2 : 0;
+        bool parg2_inv = (pname == "sub" || pname == "div");
+
+        if (pclass && pclass == fclass) {
+
+            // the function will be absorbed by its parent
+
+            bool parent_inv_op = f->parent_arg_index == 0 && parg2_inv; // arg 0 in postfix, is the second infix argument
+
+            // this is the first infix argument (postfix order is inverse)
+            auto arg1_chunk = get_dependent_chunk(f->args[1]);
+            pf->absorbed[parent_inv_op           ].push_back(elist_t(arg1_chunk.first, arg1_chunk.second));
+            elist->erase(arg1_chunk.first, arg1_chunk.second);
+
+            // the second infix argument
+            auto arg0_chunk = get_dependent_chunk(f->args[0]);
+            pf->absorbed[parent_inv_op ^ arg2_inv].push_back(elist_t(arg0_chunk.first, arg0_chunk.second));
+            elist->erase(arg0_chunk.first, arg0_chunk.second);
+
+            pf->absorbed[ parent_inv_op].splice(pf->absorbed[ parent_inv_op].end(), f->absorbed[0]);
+            pf->absorbed[!parent_inv_op].splice(pf->absorbed[!parent_inv_op].end(), f->absorbed[1]);
+
+            pf->force_not_constant = true;
+
+            *it = make_intermediate_constant(ev, neutral);
+
+            return;
+        }
+    }
+
+    // end of chain - simplify and rebuild
+
+    // accumulate own args
+
+    // first infix argument
+    auto arg1_chunk = get_dependent_chunk(f->args[1]);
+    f->absorbed[0       ].push_back(elist_t(arg1_chunk.first, arg1_chunk.second));
+    elist->erase(arg1_chunk.first, arg1_chunk.second);
+
+    // second infix argument
+    auto arg0_chunk = get_dependent_chunk(f->args[0]);
+    f->absorbed[arg2_inv].push_back(elist_t(arg0_chunk.first, arg0_chunk.second));
+    elist->erase(arg0_chunk.first, arg0_chunk.second);
+
+    // at this point, this is a function of 0 arguments, all of them were absorbed
+    f->num_args = 0;
+
+    if (fclass == 2) {
+        merge_factors(ev, f->absorbed);
+    }
+
+    // reduce constants - the subtracted ones from +0, so that ac[0] - ac[1] keeps -0
+    double ac[2] = {neutral, fclass==1 ? 0.0 : neutral};
+    for (int i=0; i<2; i++) {
+        for (auto e = f->absorbed[i].begin(); e!=f->absorbed[i].end(); ) {
+            auto next_e = next(e);
+            if (e->size()==1 && e->front()->element_type == CCONST) {
+                auto v = static_cast<Constant*>(e->front());
+                if (fclass==1) {
+                    ac[i] += *((double*)v->address);
+                }
+                else {
+                    ac[i] *= *((double*)v->address);
+                }
+                f->absorbed[i].erase(e);
+            }
+            e = next_e;
+        }
+    }
+    double ac_final = (fclass==1) ? (ac[0] -ac[1]) : (ac[0] / ac[1]);
+
+    // The constants of a product are folded into one factor where their quotient is exact,
+    // e.g. x*3/6 = x*0.5. Otherwise x/3 is not x*(1/3), which differs in the last bit for
+    // some x, so the divisor stays, unless fast math allows the reciprocal.
+    double divisor = 1.0;
+    if (fclass == 2 && !ev->get_fast_math() && std::fma(ac_final, ac[1], -ac[0]) != 0.0) {
+        ac_final = ac[0];
+        divisor  = ac[1];
+    }
+
+    // sort and gather chunks
+    map<elist_t, int, elist_comparison> sig_map;
+    for (auto &e : f->absorbed[0]) { sig_map[e]++; }
+    for (auto &e : f->absorbed[1]) { sig_map[e]--; }
+
+    // a term that cancels out, as in x-x, is +0, which turns a constant of -0 into +0
+    for (auto &e : sig_map) {
+        if (fclass == 1 && e.second == 0) {
+            ac_final += 0.0;
+        }
+    }
+
+    // f stays in the arena until the expression is replaced, but its chunks are no longer needed
+    f->absorbed[0].clear();
+    f->absorbed[1].clear();
+
+    rebuild_asmd_chain(it, ev, elist, fclass, sig_map, ac_final, divisor);
+}
+
+
+inline Function Add()
+{
+    static uint8_t code[] = {
+        0xde, 0xc1                                  // faddp       st(1), st
+    };
+    Function f("add", 2, 0, sizeof(code), code, asmd_optimizer);
+    f.simd_arithmetic = SIMD_ADD;
+    return f;
+}
+
+
+inline Function Sub()
+{
+    static uint8_t code[] = {
+        0xde, 0xe9                                  // fsubp       st(1), st
+    };
+    Function f("sub", 2, 0, sizeof(code), code, asmd_optimizer);
+    f.simd_arithmetic = SIMD_SUB;
+    return f;
+}
+
+
+inline Function Mul()
+{
+    static uint8_t code[] = {
+        0xde, 0xc9                                  // fmulp       st(1), st
+    };
+    Function f("mul", 2, 0, sizeof(code), code, asmd_optimizer);
+    f.simd_arithmetic = SIMD_MUL;
+    return f;
+}
+
+
+inline Function Div()
+{
+    static uint8_t code[] = {
+        0xde, 0xf9                                  // fdivp       st(1), st
+    };
+    Function f("div", 2, 0, sizeof(code), code, asmd_optimizer);
+    f.simd_arithmetic = SIMD_DIV;
+    return f;
+}
+
+
+// Subtraction and division, with the subtrahend/divisor evaluated first (see order_operands)
+inline Function RSub()
+{
+    static uint8_t code[] = {
+        0xde, 0xe1                                  // fsubrp      st(1), st
+    };
+    Function f("rsub", 2, 0, sizeof(code), code);
+    f.simd_arithmetic = SIMD_SUB;
+    f.reversed = true;
+    return f;
+}
+
+
+inline Function RDiv()
+{
+    static uint8_t code[] = {
+        0xde, 0xf1                                  // fdivrp      st(1), st
+    };
+    Function f("rdiv", 2, 0, sizeof(code), code);
+    f.simd_arithmetic = SIMD_DIV;
+    f.reversed = true;
+    return f;
+}
+
+
+inline Function Neg()
+{
+    // TODO: this does not need its own internal name, it is a special case of add_sub
+    static uint8_t code[] = {
+        0xd9, 0xe0                                  // fchs
+    };
+    return Function("neg", 1, 0, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        c.load_constant(c.tmp(0), -0.0);
+        c.logic(SIMD_XOR, c.arg(0), c.arg(0), c.tmp(0));
+        return true;
+    });
+}
+
+
+inline Function Gain()
+{
+    //                            x
+    //                 ------------------------  if x < 0.5
+    //                 (1 / a - 2) (1 - 2x) + 1
+    // gain(x, a) =                                               for x, a in [0, 1]
+    //                 (1 / a - 2) (1 - 2x) - x
+    //                 ------------------------  if x >= 0.5
+    //                 (1 / a - 2) (1 - 2x) - 1
+
+    static uint8_t code[] = {                       //                       ; FPU stack
+        0xd9, 0xc1,                                 // fld         st(1)     ; x, a, x
+        0xd8, 0xc2,                                 // fadd        st,st(2)  ; 2x, a, x
+        0xd9, 0xe8,                                 // fld1                  ; 1, 2x, a, x
+        0xdf, 0xf1,                                 // fcomip      st,st(1)  ; 2x, a, x
+        0xdd, 0xd8,                                 // fstp        st(0)     ; a, x
+        0xd9, 0xc0,                                 // fld         st(0)     ; a, a, x
+        0xd8, 0xc1,                                 // fadd        st,st(1)  ; 2a, a, x
+        0xd9, 0xe8,                                 // fld1                  ; 1, 2a, a, x
+        0xde, 0xe9,                                 // fsubp       st(1),st  ; 2a-1, a, x
+        0xde, 0xf1,                                 // fdivrp      st(1),st  ; (2a-1)/a, x
+        0xd9, 0xc1,                                 // fld         st(1)     ; x, (2a-1)/a, x
+        0xdc, 0xc0,                                 // fadd        st(0),st  ; 2x, (2a-1)/a, x 
+        0xd9, 0xe8,                                 // fld1                  ; 1, 2x, (2a-1)/a, x
+        0xde, 0xe9,                                 // fsubp       st(1),st  ; 2x-1, (2a-1)/a, x
+        0xde, 0xc9,                                 // fmulp       st(1),st  ; (2x-1)*(2a-1)/a, x
+        0xd9, 0xe8,                                 // fld1                  ; 1, (2x-1)*(2a-1)/a, x
+        0x72, 0x06,                                 // jb          x_ge_half
+        0xde, 0xc1,                                 // faddp       st(1),st  ; (2x-1)*(2a-1)/a+1, x
+        0xde, 0xf9,                                 // fdivp       st(1),st  ; x/((2x-1)*(2a-1)/a+1) [result]
+        0xeb, 0x0a,                                 // jmp         gain_exit
+// x_ge_half:
+        0xd9, 0xc1,                                 // fld         st(1)     ; (2x-1)*(2a-1)/a, 1, (2x-1)*(2a-1)/a, x
+        0xde, 0xe9,                                 // fsubp       st(1),st  ; 1-(2x-1)*(2a-1)/a, (2x-1)*(2a-1)/a, x
+        0xd9, 0xc9,                                 // fxch        st(1)     ; (2x-1)*(2a-1)/a, 1-(2x-1)*(2a-1)/a, x
+        0xde, 0xea,                                 // fsubp       st(2),st  ; 1-(2x-1)*(2a-1)/a, x-(2x-1)*(2a-1)/a
+        0xde, 0xf9,                                 // fdivp       st(1),st  ; (x-(2x-1)*(2a-1)/a)/(1-(2x-1)*(2a-1)/a)  [result]
+// gain_exit:
+    };
+    return Function("gain", 2, 2, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        int x = c.arg(0), a = c.arg(1), one = c.tmp(0), d = c.tmp(1), u = c.tmp(2);
+        c.load_constant(one, 1.0);
+        c.arith(SIMD_ADD, d, a, a);
+        c.arith(SIMD_SUB, d, d, one);
+        c.arith(SIMD_DIV, d, d, a);                     // (2a-1)/a
+        c.arith(SIMD_ADD, u, x, x);
+        int mask = c.compare(u, one, CMP_NLE, a);       // 2x > 1, or NaN - a is not needed anymore
+        c.arith(SIMD_SUB, u, u, one);
+        c.arith(SIMD_MUL, d, d, u);                     // (2x-1)(2a-1)/a
+        c.arith(SIMD_ADD, u, d, one);
+        c.arith(SIMD_DIV, u, x, u);                     // x/(d+1)
+        c.arith(SIMD_SUB, x, x, d);
+        c.arith(SIMD_SUB, d, one, d);
+        c.arith(SIMD_DIV, x, x, d);                     // (x-d)/(1-d)
+        c.select(x, mask, x, u);
+        return true;
+    });
+}
+
+
+inline Function Bias()
 {
-    auto f = static_pointer_cast<Function>(*it);
-    auto fname = string(f->name);
-    int fclass = (fname == "add" || fname == "sub") ? 1 : (fname == "mul" || fname == "div") ? 2 : 0;
-    assert(fclass);
+    //                         x
+    // bias(x, a) = -----------------------    for x, a in [0, 1]
+    //              (1 / a - 2) (1 - x) + 1
 
-    double neutral = fclass==1 ? 0.0 : 1.0;
+    static uint8_t code[] = {
+        0xd9, 0xe8,                                 // fld1
+        0xdc, 0xf1,                                 // fdivr       st(1), st
+        0xdc, 0xe9,                                 // fsub        st(1), st
+        0xdc, 0xe9,                                 // fsub        st(1), st
+        0xd8, 0xe2,                                 // fsub        st, st(2)
+        0xde, 0xc9,                                 // fmulp       st(1), st
+        0xd9, 0xe8,                                 // fld1
+        0xde, 0xc1,                                 // faddp       st(1), st
+        0xde, 0xf9                                  // fdivp       st(1), st
+    };
+    return Function("bias", 2, 1, sizeof(code), code, nullptr, [](Simd_compiler& c) {
+        int x = c.arg(0), a = c.arg(1), one = c.tmp(0), t = c.tmp(1), u = c.tmp(2);
+        c.load_constant(one, 1.0);
+        c.arith(SIMD_DIV, t, one, a);                   // 1/a
+        c.load_constant(u, 2.0);
+        c.arith(SIMD_SUB, t, t, u);                     // 1/a - 2
+        c.arith(SIMD_SUB, u, one, x);                   // 1 - x
+        c.arith(SIMD_MUL, t, t, u);
+        c.arith(SIMD_ADD, t, t, one);
+        c.arith(SIMD_DIV, x, x, t);
+        return true;
+    });
+}
 
-    bool arg2_inv = (fname == "sub" || fname == "div");
 
-    if (f->parent != elist->end() &&  (*f->parent)->element_type == CFUNC) {
-        shared_ptr<Function> pf = static_pointer_cast<Function>(*f->parent);
-        auto pname = string(pf->name);
-        int pclass = (pname == "add" || pname == "sub") ? 1 : (pname == "mul" || pname == "div") ? 2 : 0;
-        bool parg2_inv = (pname == "sub" || pname == "div");
 
-        if (pclass && pclass == fclass) {
+#ifndef _MSC_VER
 
-            // the function will be absorbed by its parent
+// The x87 instructions that have no exact equivalent in C++, for the reference implementations
+// below. long double is the x87 extended format with GCC and Clang, so the rest of the arithmetic
+// is performed by the same instructions, in the same precision, as in the compiled code.
 
-            bool parent_inv_op = f->parent_arg_index == 0 && parg2_inv; // arg 0 in postfix, is the second infix argument
+inline long double x87_fsin(long double x)     { __asm__ ("fsin"    : "+t" (x)); return x; }
+inline long double x87_fcos(long double x)     { __asm__ ("fcos"    : "+t" (x)); return x; }
+inline long double x87_fsqrt(long double x)    { __asm__ ("fsqrt"   : "+t" (x)); return x; }
+inline long double x87_frndint(long double x)  { __asm__ ("frndint" : "+t" (x)); return x; }
+inline long double x87_f2xm1(long double x)    { __asm__ ("f2xm1"   : "+t" (x)); return x; }
+inline long double x87_fldl2e()                { long double r; __asm__ ("fldl2e" : "=t" (r)); return r; }
+inline long double x87_fldl2t()                { long double r; __asm__ ("fldl2t" : "=t" (r)); return r; }
 
-            // this is the first infix argument (postfix order is inverse)
-            auto arg1_chunk = get_dependent_chunk(f->args[1]);
-            pf->absorbed[parent_inv_op           ].push_back(elist_t(arg1_chunk.first, arg1_chunk.second));
-            elist->erase(arg1_chunk.first, arg1_chunk.second);
+// st(0) := st(0) rem st(1) - a partial remainder, if the exponents differ by more than 63
+inline long double x87_fprem(long double x, long double y)
+{
+    __asm__ ("fprem" : "+t" (x) : "u" (y));
+    return x;
+}
 
-            // the second infix argument
-            auto arg0_chunk = get_dependent_chunk(f->args[0]);
-            pf->absorbed[parent_inv_op ^ arg2_inv].push_back(elist_t(arg0_chunk.first, arg0_chunk.second));
-            elist->erase(arg0_chunk.first, arg0_chunk.second);
+inline long double x87_fscale(long double x, long double y)
+{
+    __asm__ ("fscale" : "+t" (x) : "u" (y));
+    return x;
+}
+
+// y * log2(x)
+inline long double x87_fyl2x(long double x, long double y)
+{
+    long double r;
+    __asm__ ("fyl2x" : "=t" (r) : "0" (x), "u" (y) : "st(1)");
+    return r;
+}
 
-            pf->absorbed[ parent_inv_op].insert(pf->absorbed[ parent_inv_op].end(),
-                f->absorbed[0].begin(), f->absorbed[0].end() );
-            pf->absorbed[!parent_inv_op].insert(pf->absorbed[!parent_inv_op].end(),
-                f->absorbed[1].begin(), f->absorbed[1].end() );
+// the significand and the exponent
+inline long double x87_fxtract(long double x, long double* exponent)
+{
+    long double significand;
+    __asm__ ("fxtract" : "=t" (significand), "=u" (*exponent) : "0" (x));
+    return significand;
+}
 
-            pf->force_not_constant = true;
+inline long double x87_fptan(long double x)
+{
+    // beyond ±2^63 fptan leaves its operand as is, without pushing 1, and the compiled
+    // code pops the empty register below it, which gives the indefinite NaN
+    if (std::fabs(x) >= 9223372036854775808.0L) {
+        return -std::numeric_limits<long double>::quiet_NaN();
+    }
+    long double one;
+    __asm__ ("fptan" : "=t" (one), "=u" (x) : "0" (x));
+    return x;
+}
 
-            *it = make_shared<Constant>( neutral );
+// frndint with the rounding control of the given control word, like floor, ceil and round
+inline long double x87_frndint(long double x, uint16_t control_word)
+{
+    uint16_t saved;
+    __asm__ ("fnstcw %1\n\t" "fldcw %2\n\t" "frndint\n\t" "fldcw %1"
+        : "+t" (x), "=m" (saved) : "m" (control_word));
+    return x;
+}
 
-            return;
+// the generic and the integer paths of the pow code
+inline long double x87_pow(long double a, long double b)
+{
+    long double rb = x87_frndint(b);
+    if (rb == b && std::fabs(b) <= 63) {
+        uint32_t n = uint32_t(std::fabs(b));
+        long double r = 1, p = a;
+        for (; n; n >>= 1) {
+            if (n & 1) {
+                r *= p;
+            }
+            if (n > 1) {
+                p *= p;
+            }
         }
+        return b < 0 ? 1 / r : r;
+    }
+    if (std::isnan(b)) {
+        return 1;
     }
+    if (a == 0 || std::isnan(a)) {
+        return a;
+    }
+    long double y = x87_fyl2x(std::fabs(a), b);
+    long double r = x87_fscale(x87_f2xm1(x87_fprem(y, 1)) + 1, y);
+    bool even = rb == b && std::fabs(b) <= 2147483647 && std::fmod(b, 2) == 0;
+    return a > 0 || even ? r : -r;
+}
 
-    // end of chain - simplify and generate code
+#endif
 
-    // accumulate own args
 
-    // first infix argument
-    auto arg1_chunk = get_dependent_chunk(f->args[1]);
-    f->absorbed[0       ].push_back(elist_t(arg1_chunk.first, arg1_chunk.second));
-    elist->erase(arg1_chunk.first, arg1_chunk.second);
+// Reference implementations of the built-in functions, for constant folding. Each one repeats
+// the steps of the x87 code of its function, so that a folded constant is exactly what the
+// compiled code would have computed, without having to compile and run it.
+// The arguments are in the order they are written. MSVC cannot embed x87 instructions on x64,
+// so there the map is empty, and the constants are folded by compiling them.
+using reference_t = long double (*)(const long double* a);
 
-    // second infix argument
-    auto arg0_chunk = get_dependent_chunk(f->args[0]);
-    f->absorbed[arg2_inv].push_back(elist_t(arg0_chunk.first, arg0_chunk.second));
-    elist->erase(arg0_chunk.first, arg0_chunk.second);
+inline const map<string, reference_t>& reference_map()
+{
+    using ld = long double;
+    static const map<string, reference_t> rmap = {
+#ifndef _MSC_VER
+        { "sin",        [](const ld* a) { return x87_fsin(a[0]); }                          },
+#ifndef MEXCE_ACCURACY
+        { "cos",        [](const ld* a) { return x87_fcos(a[0]); }                          },
+#endif
+        { "tan",        [](const ld* a) { return x87_fptan(a[0]); }                         },
+        { "abs",        [](const ld* a) { return std::fabs(a[0]); }                         },
+        { "sfc",        [](const ld* a) { ld e; return x87_fxtract(a[0], &e); }             },
+        { "expn",       [](const ld* a) { ld e; x87_fxtract(a[0], &e); return e; }          },
+        { "sign",       [](const ld* a) { return 0 < a[0] || std::isnan(a[0]) ? ld(1) : ld(-1); } },
+        { "signp",      [](const ld* a) { return 0 < a[0] || std::isnan(a[0]) ? ld(1) : ld(0); } },
+        { "sqrt",       [](const ld* a) { return x87_fsqrt(a[0]); }                         },
+        { "pow",        [](const ld* a) { return x87_pow(a[0], a[1]); }                     },
+        { "exp",        [](const ld* a) {
+            ld t = a[0] * x87_fldl2e();
+            return x87_fscale(x87_f2xm1(x87_fprem(t, 1)) + 1, t);
+        } },
+        { "less_than",  [](const ld* a) { return a[0] < a[1] ? ld(1) : ld(0); }               },
+        { "log",        [](const ld* a) { return x87_fyl2x(a[0], 1) / x87_fldl2e(); }       },
+        { "ln",         [](const ld* a) { return x87_fyl2x(a[0], 1) / x87_fldl2e(); }       },
+        { "log10",      [](const ld* a) { return x87_fyl2x(a[0], 1) / x87_fldl2t(); }       },
+        { "log2",       [](const ld* a) { return x87_fyl2x(a[0], 1); }                      },
+        { "logb",       [](const ld* a) { return x87_fyl2x(a[1], 1) / x87_fyl2x(a[0], 1); } },
+        { "ylog2",      [](const ld* a) { return x87_fyl2x(a[1], a[0]); }                   },
+        { "max",        [](const ld* a) { return a[1] < a[0] || std::isunordered(a[0], a[1]) ? a[0] : a[1]; } },
+        { "min",        [](const ld* a) { return a[1] < a[0] || std::isunordered(a[0], a[1]) ? a[1] : a[0]; } },
+        { "floor",      [](const ld* a) { return x87_frndint(a[0], 0x67f); }                },
+        { "ceil",       [](const ld* a) { return x87_frndint(a[0], 0xa7f); }                },
+        { "round",      [](const ld* a) { return x87_frndint(a[0], 0x27f); }                },
+        { "int",        [](const ld* a) { return x87_frndint(a[0]); }                       },
+        { "mod",        [](const ld* a) { return x87_fprem(a[0], a[1]); }                   },
+        { "bnd",        [](const ld* a) {
+            ld r = x87_fprem(a[0], a[1]);
+            return 0 < r || std::isnan(r) ? r : a[1] + r;
+        } },
+        { "add",        [](const ld* a) { return a[0] + a[1]; }                             },
+        { "sub",        [](const ld* a) { return a[0] - a[1]; }                             },
+        { "mul",        [](const ld* a) { return a[0] * a[1]; }                             },
+        { "div",        [](const ld* a) { return a[0] / a[1]; }                             },
+        { "neg",        [](const ld* a) { return -a[0]; }                                   },
+        { "bias",       [](const ld* a) {
+            ld t = (1 / a[1] - 1 - 1) * (1 - a[0]);
+            return a[0] / (t + 1);
+        } },
+        { "gain",       [](const ld* a) {
+            ld x = a[0];
+            bool ge_half = 1 < x + x || std::isnan(x);
+            ld d = (a[1] + a[1] - 1) / a[1] * (x + x - 1);
+            return ge_half ? (x - d) / (1 - d) : x / (d + 1);
+        } },
+#endif
+    };
+    return rmap;
+}
 
-    // at this point, this is a function of 0 arguments, all of them were absorbed
-    f->args.clear();
 
-    // reduce constants
-    double ac[2] = {neutral, neutral};
-    for (int i=0; i<2; i++) {
-        for (auto e = f->absorbed[i].begin(); e!=f->absorbed[i].end(); ) {
-            auto next_e = next(e);
-            if (e->size()==1 && e->front()->element_type == CCONST) {
-                auto v = static_pointer_cast<Constant>(e->front());
-                if (fclass==1) {
-                    ac[i] += *((double*)v->address);
-                }
-                else {
-                    ac[i] *= *((double*)v->address);
-                }
-                f->absorbed[i].erase(e);
-            }
-            e = next_e;
-        }
+inline const map<string, Function>& make_function_map()
+{
+    static Function f[] = {
+        Sin(), Cos(), Tan(), Abs(), Sign(), Signp(), Expn(), Sfc(), Sqrt(), Pow(), Exp(), Less_than(),
+        Log(), Log2(), Ln(), Log10(), Logb(), Ylog2(), Max(), Min(), Floor(), Ceil(), Round(), Int(), Mod(),
+        Bnd(), Add(), Sub(), Neg(), Mul(), Div(), Bias(), Gain()
+    };
+
+    static map<string, Function> ret;
+    for (auto& e : f) {
+        assert(ret.find(e.name) == ret.end()); //if it fails, some functions share the same name.
+        ret.insert(make_pair(e.name, e));
     }
-    double ac_final = (fclass==1) ? (ac[0] -ac[1]) : (ac[0] * 1.0/ac[1]);
+    return ret;
+}
 
-    // sort and gather chunks
-    map<elist_t, int, elist_comparison> sig_map;
-    for (auto &e : f->absorbed[0]) { sig_map[e]++; }
-    for (auto &e : f->absorbed[1]) { sig_map[e]--; }
 
-    mexce_charstream s;
+inline const map<string, Function>& function_map()
+{
+    static const map<string, Function>& fname_map = make_function_map();
+    return fname_map;
+}
 
-    // TODO: assert that none of the values are constant
 
-    if (fclass==1) {    // NOTE: children can be mul/div, but they cannot be add/sub
+inline Function* make_function(evaluator* ev, const string& name) {
+    auto fn = function_map().find(name);
+    return make_function(ev, fn->second);
+}
 
-        bool constant_added = false;
 
-        for (auto &e : sig_map) {
+// Rules that rewrite a function with its arguments into a simpler subexpression, which
+// set_expressions applies before the optimizer of the function (see simplify_function). The
+// rules with fast_math apply only when the evaluator allows them (see evaluator::set_fast_math),
+// because they change the result for some values. To add a rule, add it to simplification_rules:
+// rewrite returns false if it does not apply to the function at it.
+struct Simplification_rule
+{
+    const char*         function;
+    bool                fast_math;
+    bool              (*rewrite)(elist_it_t it, evaluator* ev, elist_t* elist);
+};
 
-            if (e.second == 0) {
-                // factor 0 in add_sub means 0*a which has no effect.
-                continue;
-            }
 
-            // if the stack is not empty and the elist is only one element and the
-            // factor in e.second is 1 or -1,
-            // we can multiply directly from memory, to save one place in the FPU
-            // stack. This is a tradeoff, as it might be slightly slower to do so.
+// A copy of the subexpression that ends at it
+inline
+elist_t subexpression(elist_it_t it)
+{
+    auto chunk = get_dependent_chunk(it);
+    return elist_t(chunk.first, chunk.second);
+}
 
-            if (constant_added && next(e.first.begin()) == e.first.end() && abs(e.second)==1.0 &&
-                (e.first.front()->element_type == CCONST || e.first.front()->element_type == CVAR) )
-            {
-                auto v = static_pointer_cast<Value>(e.first.front());
-                if (v->numeric_data_type != M64INT) { // see emit_apply_op_with_value implementation
-                    if (e.second == 1) {
-                        emit_apply_op_with_value<0x00>(s, v);
-                    }
-                    else {
-                        emit_apply_op_with_value<0x20>(s, v);
-                    }
-                    continue;
-                }
-            }
 
-            compile_elist(s, e.first.begin(), e.first.end());
+inline
+bool same_elements(const elist_t& a, const elist_t& b)
+{
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), same_element);
+}
 
-            if (e.second == 1) {
-                // 1*a == a
-                // we loaded the expression, there is nothing further to do                
-            }
-            else
-            if (e.second == -1) {
-                s < 0xd9 < 0xe0;  // fchs
-            }
-            else
-            if (e.second == 2) {
-                s < 0xd8 < 0xc0;  // fadd st(0), st(0)
-            }
-            else
-            if (e.second == -2) {
-                s < 0xd8 < 0xc0;  // fadd st(0), st(0)
-                s < 0xd9 < 0xe0;  // fchs
-            }
-            else {
-                emit_apply_op_with_constant<0x08>(ev, s, e.second);
-            }
 
-            if (!constant_added) {
-                // add the constant
+// e, if it is the function of that name
+inline
+Function* function_named(Element* e, const char* name)
+{
+    if (e->element_type != CFUNC || strcmp(static_cast<Function*>(e)->name, name)) {
+        return nullptr;
+    }
+    return static_cast<Function*>(e);
+}
+
+
+// Replaces the function at it and its arguments with seq, whose last element takes the place of
+// the function, so that the parent of the function (and m_roots) still refer to it. seq may reuse
+// the elements of the arguments (see subexpression).
+inline
+void replace_subexpression(elist_it_t it, elist_t* elist, elist_t& seq)
+{
+    auto f = static_cast<Function*>(*it);
+    auto parent = f->parent;
+    size_t parent_arg_index = f->parent_arg_index;
+
+    elist->erase(get_dependent_chunk(it).first, it);
+    *it = seq.back();
+    seq.pop_back();
+    auto first = seq.empty() ? it : seq.begin();
+    elist->splice(it, seq);
+
+    link_arguments(*elist, first, next(it));
+    if ((*it)->element_type == CFUNC) {
+        static_cast<Function*>(*it)->parent = parent;
+        static_cast<Function*>(*it)->parent_arg_index = parent_arg_index;
+    }
+}
 
-                // doing this here and not in the beginning requires one place
-                // less in the fpu stack (and 1 instruction less too)
 
-                if (ac_final != neutral) {
-                    emit_apply_op_with_constant<0x00>(ev, s, ac_final);
+// Links seq, a subexpression that a rule has built, and optimizes it as set_expressions does
+// with the whole expression: the functions of constants are folded, where they have a reference
+// implementation, and the rest are passed to their optimizer.
+inline
+void optimize_subexpression(evaluator* ev, elist_t& seq)
+{
+    link_arguments(seq);
+    for (auto y = seq.begin(); y != seq.end(); ) {
+        auto y_next = next(y);
+        if ((*y)->element_type == CFUNC) {
+            auto f = static_cast<Function*>(*y);
+            bool all_args_are_const = !f->force_not_constant;
+            for (size_t j = 0; j < f->num_args; j++) {
+                all_args_are_const &= (*f->args[j])->element_type == CCONST;
+            }
+            auto ref = reference_map().find(f->name);
+            if (all_args_are_const && ref != reference_map().end()) {
+                elist_it_t first_arg_it = y;
+                std::advance(first_arg_it, -(int64_t)f->num_args);
+                long double a[2];
+                size_t j = 0;
+                for (auto z = first_arg_it; z != y; z++) {
+                    a[j++] = static_cast<Constant*>(*z)->get_data_as_double();
                 }
-                constant_added = true;
+                seq.erase(first_arg_it, y);
+                *y = make_intermediate_constant(ev, (double)ref->second(a));
             }
-            else {
-                s < 0xde < 0xc1;  // faddp       st(1), st
+            else
+            if (f->optimizer != 0) {
+                f->optimizer(y, ev, &seq);
             }
         }
+        y = y_next;
+    }
+}
 
-        if (!constant_added) { // we did nothing, we should at least load the constant
-            emit_load_constant(ev, s, ac_final);
-        }
+
+// Whether e is -x, as neg(x) or as the unary minus, which is parsed as -0-x, and x if it is.
+// With any_zero, 0-x is taken as -x too, which it is but for the sign of zero.
+inline
+bool is_negation(Element* e, elist_it_t& x, bool any_zero = false)
+{
+    if (auto g = function_named(e, "neg")) {
+        x = g->args[0];
+        return true;
     }
-    else {
-        // NOTE: children can be powers, but they cannot be mul/div.
-        // They can also be add/sub, but this is not interesting for optimization.
+    // the first argument of a sub that absorbed a chain is a placeholder (see asmd_optimizer)
+    auto g = function_named(e, "sub");
+    if (!g || !g->absorbed[0].empty() || !g->absorbed[1].empty() || (*g->args[1])->element_type != CCONST) {
+        return false;
+    }
+    double c = static_cast<Constant*>(*g->args[1])->get_data_as_double();
+    if (c != 0.0 || !(any_zero || std::signbit(c))) {
+        return false;
+    }
+    x = g->args[0];
+    return true;
+}
 
-        bool constant_multiplied = false;
 
-        for (auto &e : sig_map) {
+// abs(abs(x)) = abs(-x) = abs(x)
+inline
+bool simplify_abs(elist_it_t it, evaluator*, elist_t* elist)
+{
+    auto f = static_cast<Function*>(*it);
+    auto x = f->args[0];
+    if (function_named(*x, "abs")) {
+        x = static_cast<Function*>(*x)->args[0];
+    }
+    else
+    if (!is_negation(*x, x, true)) {
+        return false;
+    }
+    elist_t seq = subexpression(x);
+    seq.push_back(f);
+    replace_subexpression(it, elist, seq);
+    return true;
+}
 
-            if (e.second == 0) {
-                // factor 0 in mul_div means a^0, which has no effect.
-                continue;
-            }
 
-            // if the stack is not empty and the elist is only one element and the
-            // factor in e.second is 1 or -1,
-            // we can multiply directly from memory, to save one place in the FPU
-            // stack. This is a tradeoff, as it might be slightly slower to do so.
+// -(-x) = x, for neg and for the unary minus
+inline
+bool simplify_neg(elist_it_t it, evaluator*, elist_t* elist)
+{
+    elist_it_t x;
+    if (!is_negation(*it, x) || !is_negation(*x, x)) {
+        return false;
+    }
+    elist_t seq = subexpression(x);
+    replace_subexpression(it, elist, seq);
+    return true;
+}
 
-            if (constant_multiplied && next(e.first.begin()) == e.first.end() && abs(e.second)==1.0 &&
-                (e.first.front()->element_type == CCONST || e.first.front()->element_type == CVAR) )
-            {
-                auto v = static_pointer_cast<Value>(e.first.front());
-                if (v->numeric_data_type != M64INT) { // see emit_apply_op_with_value implementation
-                    if (e.second == 1) {
-                        emit_apply_op_with_value<0x08>(s, v);
-                    }
-                    else {
-                        emit_apply_op_with_value<0x30>(s, v);
-                    }
-                    continue;
-                }
-            }
 
-            if (e.second >= -2 && e.second <=2) {  // cannot be 0, it has been handled above
-                compile_elist(s, e.first.begin(), e.first.end());
+// max(x, x) = min(x, x) = x
+inline
+bool simplify_same_arguments(elist_it_t it, evaluator*, elist_t* elist)
+{
+    auto f = static_cast<Function*>(*it);
+    elist_t seq = subexpression(f->args[0]);
+    if (!same_elements(seq, subexpression(f->args[1]))) {
+        return false;
+    }
+    replace_subexpression(it, elist, seq);
+    return true;
+}
 
-                if (e.second == 1) {
-                    // a^1 == a
-                    // we loaded the expression, there is nothing further to do                
-                }
-                else
-                if (e.second == -1) {   //  1/a
-                    s < 0xd9 < 0xe8;    // fld1
-                    s < 0xde < 0xf1;    // fdivrp   st(1), st
-                }
-                else
-                if (e.second == 2) {    //  a*a
-                    s < 0xdc < 0xc8;    // fmul st(0), st(0)
-                }
-                else
-                if (e.second == -2) {   //  1/(a*a)
-                    s < 0xdc < 0xc8;    // fmul st(0), st(0)
-                    s < 0xd9 < 0xe8;    // fld1
-                    s < 0xde < 0xf1;    // fdivrp   st(1), st
-                }
-            }
-            else {
-                elist_t pow_list = e.first;
-                pow_list.push_back(make_intermediate_constant(ev, e.second));
-                auto pow_f = make_function("pow");
-                pow_list.push_back(pow_f);
-                link_arguments(pow_list);
-                pow_f->optimizer(prev(pow_list.end()), ev, &pow_list);
 
-                compile_elist(s, pow_list.begin(), pow_list.end());
-            }
+// x < x = 0, also for NaN
+inline
+bool simplify_less_than(elist_it_t it, evaluator* ev, elist_t* elist)
+{
+    auto f = static_cast<Function*>(*it);
+    if (!same_elements(subexpression(f->args[0]), subexpression(f->args[1]))) {
+        return false;
+    }
+    elist_t seq = { make_intermediate_constant(ev, 0.0) };
+    replace_subexpression(it, elist, seq);
+    return true;
+}
 
-            if (!constant_multiplied) {
-                // add the constant
 
-                // doing this here and not in the beginning requires one place
-                // less in the fpu stack (and 1 instruction less too)
+// sqrt(x^2) = abs(x), where x*x has become x^2 (see asmd_optimizer). It differs where x^2
+// overflows or underflows.
+inline
+bool simplify_sqrt(elist_it_t it, evaluator* ev, elist_t* elist)
+{
+    auto g = function_named(*static_cast<Function*>(*it)->args[0], "pow_opt");
+    if (!g || g->num_args != 1 || g->folded_arg != 2.0) {
+        return false;
+    }
+    elist_t seq = subexpression(g->args[0]);
+    seq.push_back(make_function(ev, "abs"));
+    replace_subexpression(it, elist, seq);
+    return true;
+}
+
 
-                if (ac_final != neutral) {
-                    emit_apply_op_with_constant<0x08>(ev, s, ac_final);
-                }
-                constant_multiplied = true;
-            }
-            else {
-                s < 0xde < 0xc9;                       // fmulp       st(1), st
-            }
+// log(x^k) = k*log(x), or k*log(abs(x)) if k is even, for a constant k, with any of the
+// logarithms of one argument. x^k is NaN for negative x where k*log(x) is, and 0 (or inf) where
+// log(x) is -inf, so they only differ where x^k overflows or underflows, and there k*log(x)
+// is the accurate result.
+inline
+bool simplify_log(elist_it_t it, evaluator* ev, elist_t* elist)
+{
+    auto f = static_cast<Function*>(*it);
+    auto g = function_named(*f->args[0], "pow_opt");
+    if (!g) {
+        return false;
+    }
+    double k = g->folded_arg;
+    if (k == 0.0) {
+        return false;   // x^0 is 1 also for 0, inf and NaN, where 0*log(abs(x)) is not 0
+    }
+    elist_t seq = subexpression(g->args[g->num_args - 1]);
+    if (std::fmod(k, 2.0) == 0.0 && !function_named(seq.back(), "abs")) {
+        seq.push_back(make_function(ev, "abs"));
+    }
+    seq.push_back(f);
+    seq.push_back(make_intermediate_constant(ev, std::abs(k)));
+    seq.push_back(make_function(ev, "mul"));
+
+    // 0 - |k|*log(x) for negative k, so that log(1^k) is still +0
+    if (k < 0) {
+        seq.push_front(make_intermediate_constant(ev, 0.0));
+        seq.push_back(make_function(ev, "sub"));
+    }
+    replace_subexpression(it, elist, seq);
+    return true;
+}
+
+
+inline
+const vector<Simplification_rule>& simplification_rules()
+{
+    static const vector<Simplification_rule> rules = {
+        { "abs",        false,  simplify_abs                },
+        { "neg",        false,  simplify_neg                },
+        { "sub",        false,  simplify_neg                },
+        { "max",        false,  simplify_same_arguments     },
+        { "min",        false,  simplify_same_arguments     },
+        { "less_than",  false,  simplify_less_than          },
+        { "sqrt",       true,   simplify_sqrt               },
+        { "ln",         false,  simplify_log                },
+        { "log",        false,  simplify_log                },
+        { "log2",       false,  simplify_log                },
+        { "log10",      false,  simplify_log                },
+    };
+    return rules;
+}
+
+
+// Applies the first of the simplification rules that rewrites the function at it. Returns false
+// if none does.
+inline
+bool simplify_function(elist_it_t it, evaluator* ev, elist_t* elist)
+{
+    auto f = static_cast<Function*>(*it);
+    for (auto& r : simplification_rules()) {
+        if (strcmp(f->name, r.function) == 0 && (!r.fast_math || ev->get_fast_math()) &&
+            r.rewrite(it, ev, elist))
+        {
+            return true;
         }
+    }
+    return false;
+}
+
+
+// Rules that merge two factors of a mul/div chain into one, which asmd_optimizer applies to the
+// factors with the same key (see merge_factors). key returns false for a factor that the rule
+// does not merge, and merge replaces a with a*b, or with a/b if divided. The factors are copies
+// of the subexpressions, whose functions are not linked to their arguments. The rules with
+// fast_math apply as in Simplification_rule.
+struct Factor_rule
+{
+    bool                fast_math;
+    bool              (*key)(const elist_t& x, evaluator* ev, elist_t& k);
+    bool              (*merge)(elist_t& a, const elist_t& b, bool divided, evaluator* ev);
+};
+
+
+// A factor as base^exponent. The exponent is either a subexpression, or a constant (the
+// exponent of pow_opt, a constant exponent of pow, or 1 if the factor is not a power).
+struct Power_factor
+{
+    elist_t             base;
+    elist_t             exponent;
+    double              constant    = 1.0;
+    bool                is_power    = false;
+};
+
 
-        if (!constant_multiplied) { // we did nothing, we should at least load the constant
-            emit_load_constant(ev, s, ac_final);
+inline
+Power_factor power_factor(const elist_t& x)
+{
+    Power_factor p;
+    auto last = prev(x.end());
+    if (function_named(*last, "pow_opt")) {
+        auto f = static_cast<Function*>(*last);
+        p.base.assign(x.begin(), f->num_args == 1 ? last : prev(last));
+        p.constant = f->folded_arg;
+        p.is_power = true;
+    }
+    else
+    if (function_named(*last, "pow")) {
+        // the exponent is the last argument, which starts where it has no operands left to take
+        auto e = last;
+        for (int64_t needed = 1; needed > 0; ) {
+            e--;
+            needed += ((*e)->element_type == CFUNC ? (int64_t)static_cast<Function*>(*e)->num_args : 0) - 1;
+        }
+        p.base.assign(x.begin(), e);
+        if (next(e) == last && (*e)->element_type == CCONST) {
+            p.constant = static_cast<Constant*>(*e)->get_data_as_double();
+        }
+        else {
+            p.exponent.assign(e, last);
         }
+        p.is_power = true;
     }
-
-    string new_name = (fclass == 1) ? "add_sub_opt" : "mul_div_opt";
-
-    uint8_t* cc = push_intermediate_code(ev, s.s.str());
-    auto f_opt = make_shared<Function>(new_name, 0, 0, s.s.str().size(), cc, nullptr);
-    
-    *it = f_opt;
-    return;
+    else {
+        p.base = x;
+    }
+    return p;
 }
 
 
-inline Function Add()
+// Whether x^e, with a constant e, is computed by multiplications (see split_pow_exponent)
+inline
+bool is_multiplied_exponent(double e)
 {
-    static uint8_t code[] = {
-        0xde, 0xc1                                  // faddp       st(1), st
-    };
-    return Function("add", 2, 0, sizeof(code), code, asmd_optimizer);
+    uint32_t m;
+    int roots;
+    return split_pow_exponent(e, m, roots) && roots == 0;
 }
 
 
-inline Function Sub()
+// The base of a power, for merge_powers
+inline
+bool power_key(const elist_t& x, evaluator* ev, elist_t& k)
 {
-    static uint8_t code[] = {
-        0xde, 0xe9                                  // fsubp       st(1), st
-    };
-    return Function("sub", 2, 0, sizeof(code), code, asmd_optimizer);
+    if (x.size() == 1 && x.front()->element_type == CCONST) {
+        return false;   // folded with the other constants
+    }
+    Power_factor p = power_factor(x);
+    if (!ev->get_fast_math() && !(p.exponent.empty() && is_multiplied_exponent(p.constant))) {
+        return false;
+    }
+    k = std::move(p.base);
+    return true;
 }
 
 
-inline Function Mul()
+// x^m * x^n = x^(m+n), x^m / x^n = x^(m-n). Without fast math, only for integer exponents, as
+// x * x^2 = x^3 or x^2 / x = x, where the two sides only differ as x/x and 1 do, for x = 0 or inf.
+// With fractional or variable exponents, the two sides also differ for negative x, e.g.
+// sqrt(x) * sqrt(x) is NaN where x is not.
+inline
+bool merge_powers(elist_t& a, const elist_t& b, bool divided, evaluator* ev)
 {
-    static uint8_t code[] = {
-        0xde, 0xc9                                  // fmulp       st(1), st
-    };
-    return Function("mul", 2, 0, sizeof(code), code, asmd_optimizer);
-}
+    if ((a.size() == 1 && a.front()->element_type == CCONST) ||
+        (b.size() == 1 && b.front()->element_type == CCONST))
+    {
+        return false;   // folded with the other constants
+    }
+    Power_factor p = power_factor(a);
+    Power_factor q = power_factor(b);
+    if (!same_elements(p.base, q.base)) {
+        return false;
+    }
 
+    bool constant = p.exponent.empty() && q.exponent.empty();
+    double e = divided ? p.constant - q.constant : p.constant + q.constant;
+    if (!ev->get_fast_math() && !(constant &&
+        is_multiplied_exponent(p.constant) && is_multiplied_exponent(q.constant) && is_multiplied_exponent(e)))
+    {
+        return false;
+    }
 
-inline Function Div()
-{
-    static uint8_t code[] = {
-        0xde, 0xf9                                  // fdivp       st(1), st
-    };
-    return Function("div", 2, 0, sizeof(code), code, asmd_optimizer);
+    elist_t seq = p.base;
+    if (constant) {
+        if (e == 0.0) {
+            a = { make_intermediate_constant(ev, 1.0) };
+            return true;
+        }
+        if (e == 1.0) {
+            a = p.base;
+            return true;
+        }
+        // pow_optimizer runs once on the rebuilt chain (see rebuild_asmd_chain), rather than
+        // on each partial product
+        seq.push_back(make_intermediate_constant(ev, e));
+        seq.push_back(make_function(ev, "pow"));
+        a = seq;
+        return true;
+    }
+    else {
+        for (auto r : { &p, &q }) {
+            if (r->exponent.empty()) {
+                seq.push_back(make_intermediate_constant(ev, r->constant));
+            }
+            else {
+                seq.insert(seq.end(), r->exponent.begin(), r->exponent.end());
+            }
+        }
+        seq.push_back(make_function(ev, divided ? "sub" : "add"));
+    }
+    seq.push_back(make_function(ev, "pow"));
+    optimize_subexpression(ev, seq);
+    a = seq;
+    return true;
 }
 
 
-inline Function Neg()
+// exp itself, for merge_exponentials, which merges any two exponentials
+inline
+bool exponential_key(const elist_t& x, evaluator*, elist_t& k)
 {
-    // TODO: this does not need its own internal name, it is a special case of add_sub
-    static uint8_t code[] = {
-        0xd9, 0xe0                                  // fchs
-    };
-    return Function("neg", 1, 0, sizeof(code), code);
+    if (!function_named(x.back(), "exp")) {
+        return false;
+    }
+    k.assign(1, x.back());
+    return true;
 }
 
 
-inline Function Gain()
+// exp(x) * exp(y) = exp(x+y), exp(x) / exp(y) = exp(x-y), which differ where x+y is large, since
+// the error of exp grows with its argument, or where exp(x) or exp(y) overflows
+inline
+bool merge_exponentials(elist_t& a, const elist_t& b, bool divided, evaluator* ev)
 {
-    //                            x
-    //                 ------------------------  if x < 0.5
-    //                 (1 / a - 2) (1 - 2x) + 1
-    // gain(x, a) =                                               for x, a in [0, 1]
-    //                 (1 / a - 2) (1 - 2x) - x
-    //                 ------------------------  if x >= 0.5
-    //                 (1 / a - 2) (1 - 2x) - 1
-
-    static uint8_t code[] = {                       //                       ; FPU stack
-        0xd9, 0xc1,                                 // fld         st(1)     ; x, a, x
-        0xd8, 0xc2,                                 // fadd        st,st(2)  ; 2x, a, x
-        0xd9, 0xe8,                                 // fld1                  ; 1, 2x, a, x
-        0xdf, 0xf1,                                 // fcomip      st,st(1)  ; 2x, a, x
-        0xdd, 0xd8,                                 // fstp        st(0)     ; a, x
-        0xd9, 0xc0,                                 // fld         st(0)     ; a, a, x
-        0xd8, 0xc1,                                 // fadd        st,st(1)  ; 2a, a, x
-        0xd9, 0xe8,                                 // fld1                  ; 1, 2a, a, x
-        0xde, 0xe9,                                 // fsubp       st(1),st  ; 2a-1, a, x
-        0xde, 0xf1,                                 // fdivrp      st(1),st  ; (2a-1)/a, x
-        0xd9, 0xc1,                                 // fld         st(1)     ; x, (2a-1)/a, x
-        0xdc, 0xc0,                                 // fadd        st(0),st  ; 2x, (2a-1)/a, x 
-        0xd9, 0xe8,                                 // fld1                  ; 1, 2x, (2a-1)/a, x
-        0xde, 0xe9,                                 // fsubp       st(1),st  ; 2x-1, (2a-1)/a, x
-        0xde, 0xc9,                                 // fmulp       st(1),st  ; (2x-1)*(2a-1)/a, x
-        0xd9, 0xe8,                                 // fld1                  ; 1, (2x-1)*(2a-1)/a, x
-        0x72, 0x06,                                 // jb          x_ge_half
-        0xde, 0xc1,                                 // faddp       st(1),st  ; (2x-1)*(2a-1)/a+1, x
-        0xde, 0xf9,                                 // fdivp       st(1),st  ; x/((2x-1)*(2a-1)/a+1) [result]
-        0xeb, 0x0a,                                 // jmp         gain_exit
-// x_ge_half:
-        0xd9, 0xc1,                                 // fld         st(1)     ; (2x-1)*(2a-1)/a, 1, (2x-1)*(2a-1)/a, x
-        0xde, 0xe9,                                 // fsubp       st(1),st  ; 1-(2x-1)*(2a-1)/a, (2x-1)*(2a-1)/a, x
-        0xd9, 0xc9,                                 // fxch        st(1)     ; (2x-1)*(2a-1)/a, 1-(2x-1)*(2a-1)/a, x
-        0xde, 0xea,                                 // fsubp       st(2),st  ; 1-(2x-1)*(2a-1)/a, x-(2x-1)*(2a-1)/a
-        0xde, 0xf9,                                 // fdivp       st(1),st  ; (x-(2x-1)*(2a-1)/a)/(1-(2x-1)*(2a-1)/a)  [result]
-// gain_exit:
-    };
-    return Function("gain", 2, 1, sizeof(code), code);
+    auto a_last = prev(a.end());
+    auto b_last = prev(b.end());
+    if (!function_named(*a_last, "exp") || !function_named(*b_last, "exp")) {
+        return false;
+    }
+    elist_t seq(a.begin(), a_last);
+    seq.insert(seq.end(), b.begin(), b_last);
+    seq.push_back(make_function(ev, divided ? "sub" : "add"));
+    seq.push_back(*a_last);
+    optimize_subexpression(ev, seq);
+    a = seq;
+    return true;
 }
 
 
-inline Function Bias()
+inline
+const vector<Factor_rule>& factor_rules()
 {
-    //                         x
-    // bias(x, a) = -----------------------    for x, a in [0, 1]
-    //              (1 / a - 2) (1 - x) + 1
-
-    static uint8_t code[] = {
-        0xd9, 0xe8,                                 // fld1
-        0xdc, 0xf1,                                 // fdivr       st(1), st
-        0xdc, 0xe9,                                 // fsub        st(1), st
-        0xdc, 0xe9,                                 // fsub        st(1), st
-        0xd8, 0xe2,                                 // fsub        st, st(2)
-        0xde, 0xc9,                                 // fmulp       st(1), st
-        0xd9, 0xe8,                                 // fld1
-        0xde, 0xc1,                                 // faddp       st(1), st
-        0xde, 0xf9                                  // fdivp       st(1), st
+    static const vector<Factor_rule> rules = {
+        { false,    power_key,          merge_powers        },
+        { true,     exponential_key,    merge_exponentials  },
     };
-    return Function("bias", 2, 1, sizeof(code), code);
+    return rules;
 }
 
 
-
-inline const map<string, Function>& make_function_map()
+// Merges the factors of a mul/div chain, absorbed[0] being the numerator and absorbed[1] the
+// denominator, by the factor rules, until no two of them merge. Two factors of the numerator or
+// of the denominator are multiplied, and a factor of the denominator divides one of the numerator.
+// The factors are gathered by the key of each rule, and each one is merged into the first factor
+// of its key that takes it, so that a product of n factors takes about n log n comparisons.
+inline
+void merge_factors(evaluator* ev, list<elist_t>* absorbed)
 {
-    static Function f[] = {
-        Sin(), Cos(), Tan(), Abs(), Sign(), Signp(), Expn(), Sfc(), Sqrt(), Pow(), Exp(), Less_than(),
-        Log(), Log2(), Ln(), Log10(), Logb(), Ylog2(), Max(), Min(), Floor(), Ceil(), Round(), Int(), Mod(),
-        Bnd(), Add(), Sub(), Neg(), Mul(), Div(), Bias(), Gain()
-    };
+    typedef std::pair<int, list<elist_t>::iterator> factor_t;   // side and position
 
-    static map<string, Function> ret;
-    for (auto& e : f) {
-        assert(ret.find(e.name) == ret.end()); //if it fails, some functions share the same name.
-        ret.insert(make_pair(e.name, e));
+    for (bool merged = true; merged; ) {
+        merged = false;
+        for (auto& r : factor_rules()) {
+            if (r.fast_math && !ev->get_fast_math()) {
+                continue;
+            }
+
+            // the factors of each key, which the following ones of the key are merged into
+            map<elist_t, vector<factor_t>, elist_comparison> merged_into;
+            elist_t k;
+            for (int i = 0; i < 2; i++) {
+                for (auto b = absorbed[i].begin(); b != absorbed[i].end(); ) {
+                    auto next_b = next(b);
+                    if (r.key(*b, ev, k)) {
+                        auto& factors = merged_into[k];
+                        bool done = false;
+                        for (auto& a : factors) {
+                            // a factor of the denominator only takes others of the denominator
+                            if (a.first <= i && r.merge(*a.second, *b, a.first != i, ev)) {
+                                absorbed[i].erase(b);
+                                done = merged = true;
+                                break;
+                            }
+                        }
+                        if (!done) {
+                            factors.push_back(factor_t(i, b));
+                        }
+                    }
+                    b = next_b;
+                }
+            }
+        }
     }
-    return ret;
 }
 
 
-inline const map<string, Function>& function_map()
+// the function of an infix operator
+inline const Function& infix_function(char op)
 {
-    static const map<string, Function>& fname_map = make_function_map();
-    return fname_map;
-}
-
-
-inline shared_ptr<Function> make_function(const string& name) {
-    auto fn = function_map().find(name);
-    return make_shared<Function>(fn->second);
+    static const map<char, const Function*> op_map = [] {
+        map<char, const Function*> ret;
+        for (char op : string("+-*/^<")) {
+            ret[op] = &function_map().find(infix_operator_to_function_name(string(1, op)))->second;
+        }
+        return ret;
+    }();
+    return *op_map.find(op)->second;
 }
 
 
@@ -1863,18 +6464,18 @@ inline const map<string, shared_ptr<Constant> >& built_in_constants_map()
 }
 
 
+// an operator, function or parenthesis, waiting in the stack of the parser
 struct Token
 {
     int             type        = 0;
     int             priority    = 0;
-    size_t          position    = 0;
-    string          content;
-    Token() = default;
-    Token(int type, size_t position, char content):
-        type      ( type               ),
-        priority  ( type               ),
-        position  ( position           ),
-        content   ( string() + content ) {}
+    char            symbol      = 0;
+    const Function* function    = nullptr;     // the function of an operator or function name
+    Token(int type, char symbol, const Function* function = nullptr):
+        type      ( type     ),
+        priority  ( type     ),
+        symbol    ( symbol   ),
+        function  ( function ) {}
 };
 
 
@@ -1894,6 +6495,15 @@ inline bool is_numeric(   char c) { return  c>='0' && c<='9'; }
 } // mexce_impl
 
 
+template <typename T>
+column::column(const std::string& variable_name, const T* data, ptrdiff_t stride):
+    variable_name       ( variable_name             ),
+    data                ( data                      ),
+    stride              ( stride                    ),
+    numeric_data_type   ( impl::get_ndt<T>()        )
+{}
+
+
 inline
 evaluator::evaluator():
     m_constants(impl::built_in_constants_map())
@@ -1906,11 +6516,13 @@ inline
 evaluator::~evaluator()
 {
     impl::free_executable_buffer(evaluate_fptr, m_buffer_size);
+    impl::free_executable_buffer(evaluate_all_fptr, m_buffer_size);
+    impl::free_executable_buffer(m_batch_fptr.load(), m_batch_buffer_size);
 }
 
 
-template <typename T, typename ...Args>
-void evaluator::bind(T& v, const std::string& s, Args&... args)
+inline
+void evaluator::check_variable_name(const std::string& s) const
 {
     using namespace impl;
     if (function_map().find(s) != function_map().end()) {
@@ -1919,12 +6531,75 @@ void evaluator::bind(T& v, const std::string& s, Args&... args)
     if (built_in_constants_map().find(s) != built_in_constants_map().end()) {
         throw std::logic_error("Attempted to bind a variable, named as an existing constant");
     }
+}
+
+
+template <typename T, typename ...Args>
+void evaluator::bind(T& v, const std::string& s, Args&... args)
+{
+    using namespace impl;
+    check_variable_name(s);
     m_variables[s] = make_shared<Variable>(&v, s, get_ndt<T>());
 
     bind(args...);
 }
 
 
+template <typename T>
+void evaluator::bind_offset(size_t offset, const std::string& s)
+{
+    using namespace impl;
+    check_variable_name(s);
+    if (offset > (size_t)std::numeric_limits<int32_t>::max()) {
+        throw std::logic_error("The offset of a variable must fit in 31 bits");
+    }
+    m_variables[s] = make_shared<Variable>(int32_t(offset), s, get_ndt<T>());
+}
+
+
+template <typename S, typename T>
+void evaluator::bind_member(T S::* member, const std::string& s)
+{
+    // the offset of the member, in storage for an S (which is not constructed)
+    alignas(S) static const char storage[sizeof(S)] = {};
+    auto record = reinterpret_cast<const S*>(storage);
+    bind_offset<T>(size_t((const char*)&(record->*member) - (const char*)record), s);
+}
+
+
+template <typename T>
+T& evaluator::var(const std::string& s)
+{
+    using namespace impl;
+    auto it = m_variables.find(s);
+    if (it != m_variables.end() && it->second->in_block) {
+        if (it->second->numeric_data_type != get_ndt<T>()) {
+            throw std::logic_error("Attempted to allocate a variable of the block with another type");
+        }
+        return *(T*)it->second->address;
+    }
+    check_variable_name(s);
+
+    if (!m_variable_block) {
+        m_variable_block.reset(new char[variable_block_size + Code_arena::alignment]);
+        auto p = (uintptr_t)m_variable_block.get();
+        m_variable_block_base = (char*)((p + Code_arena::alignment - 1) & ~(uintptr_t)(Code_arena::alignment - 1));
+    }
+    size_t offset = (m_variable_block_used + alignof(T) - 1) & ~(alignof(T) - 1);
+    if (offset + sizeof(T) > variable_block_size) {
+        throw std::logic_error("The variable block is full");
+    }
+    m_variable_block_used = offset + sizeof(T);
+
+    T* v = new (m_variable_block_base + offset) T();
+    auto variable = make_shared<Variable>(v, s, get_ndt<T>());
+    variable->in_block = true;
+    variable->context_offset = int32_t(offset);
+    m_variables[s] = variable;
+    return *v;
+}
+
+
 template <typename ...Args>
 void evaluator::unbind(const std::string& s, Args&... args)
 {
@@ -1952,64 +6627,465 @@ void evaluator::unbind_all()
 }
 
 
+inline
+void evaluator::set_backend(mexce::backend b)
+{
+#ifdef MEXCE_64
+    if (b == backend::avx && !impl::cpu_features().avx) {
+        throw std::logic_error("The CPU does not support AVX");
+    }
+#else
+    if (b != backend::x87) {
+        throw std::logic_error("Only the x87 backend is available on 32-bit x86");
+    }
+#endif
+    m_backend = b;
+    set_expressions(m_expressions);
+}
+
+
+inline
+void evaluator::set_accuracy(mexce::accuracy a)
+{
+    m_accuracy = a;
+    set_expressions(m_expressions);
+}
+
+
+inline
+void evaluator::set_fast_math(bool enabled)
+{
+    m_fast_math = enabled;
+    set_expressions(m_expressions);
+}
+
+
 inline
 double evaluator::evaluate() {
     if (is_constant_expression) {
         return constant_expression_value;
     }
-    return evaluate_fptr();
+    if (m_uses_context) {
+        throw std::logic_error("The expression has variables bound at an offset, use evaluate_in");
+    }
+    return evaluate_in(nullptr);
+}
+
+
+inline
+double evaluator::evaluate_in(const void* context) {
+    if (is_constant_expression) {
+        return constant_expression_value;
+    }
+    if (m_roots.size() > 1) {
+        throw std::logic_error("There are several expressions, use evaluate(out) or evaluate_in(context, out)");
+    }
+    return evaluate_fptr(context);
+}
+
+
+inline
+void evaluator::evaluate(double* out) {
+    if (m_uses_context) {
+        throw std::logic_error("The expressions have variables bound at an offset, use evaluate_in");
+    }
+    evaluate_in(nullptr, out);
+}
+
+
+inline
+void evaluator::evaluate_in(const void* context, double* out) {
+    if (m_roots.size() > 1) {
+        evaluate_all_fptr(context, out);
+    }
+    else {
+        out[0] = evaluate_in(context);
+    }
+}
+
+
+inline
+void evaluator::evaluate_batch(size_t n, std::initializer_list<column> inputs, double* out)
+{
+    evaluate_batch(n, nullptr, 0, out, inputs);
+}
+
+
+inline
+void evaluator::evaluate_batch(size_t n, const void* records, ptrdiff_t stride, double* out,
+    std::initializer_list<column> inputs)
+{
+    using namespace impl;
+
+    for (auto& c : inputs) {
+        auto it = m_variables.find(c.variable_name);
+        if (it == m_variables.end()) {
+            throw std::logic_error("Attempted to evaluate a column of an unknown variable");
+        }
+        if (it->second->numeric_data_type != c.numeric_data_type) {
+            throw std::logic_error("The type of the column does not match the type of the variable");
+        }
+    }
+
+    if (is_constant_expression) {
+        std::fill(out, out + n, constant_expression_value);
+        return;
+    }
+
+    // the first call after the expression is set compiles the kernel, if several threads
+    // get here at once, one of them compiles it and the others wait
+    auto kernel = m_batch_fptr.load(std::memory_order_acquire);
+    if (!kernel) {
+        std::lock_guard<std::mutex> lock(m_batch_mutex);
+        kernel = m_batch_fptr.load(std::memory_order_relaxed);
+        if (!kernel) {
+            compile_batch_kernel();
+            kernel = m_batch_fptr.load(std::memory_order_relaxed);
+        }
+    }
+
+    // with several expressions, their results are written through cursors too, after those of the variables
+    size_t num_outputs = m_roots.size() > 1 ? m_roots.size() : 0;
+    vector<Column_cursor> cursors(m_batch_variables.size() + num_outputs);
+    for (size_t i = 0; i < num_outputs; i++) {
+        cursors[m_batch_variables.size() + i].data   = out + i * n;
+        cursors[m_batch_variables.size() + i].stride = sizeof(double);
+    }
+    for (size_t i = 0; i < m_batch_variables.size(); i++) {
+        auto v = m_batch_variables[i];
+        bool has_column = false;
+        for (auto& c : inputs) {
+            if (c.variable_name == v->name) {
+                cursors[i].data   = c.data;
+                cursors[i].stride = c.stride;
+                has_column = true;
+            }
+        }
+        if (has_column) {
+            continue;
+        }
+        if (v->in_context) {
+            if (!records) {
+                throw std::logic_error("A variable that was bound at an offset requires records or a column");
+            }
+            cursors[i].data   = (const char*)records + v->context_offset;
+            cursors[i].stride = stride;
+        }
+        else {
+            cursors[i].data   = (const void*)v->address;
+            cursors[i].stride = 0;
+        }
+    }
+
+    kernel(n, cursors.data(), out);
+}
+
+
+
+inline
+void evaluator::set_expression(std::string e)
+{
+    set_expressions({ e });
+}
+
+
+inline
+void evaluator::set_expressions(const std::vector<std::string>& expressions)
+{
+    // if the expressions do not compile, the previous ones are compiled again (unless they no
+    // longer do either, e.g. after unbind), so that the evaluator stays usable, and set_backend,
+    // set_accuracy and set_fast_math recompile them
+    try {
+        compile_expressions(expressions);
+    }
+    catch (...) {
+        if (expressions != m_expressions) {
+            try {
+                compile_expressions(m_expressions);
+            }
+            catch (...) {
+            }
+        }
+        throw;
+    }
+    m_expressions = expressions;
 }
 
 
-
 inline
-void evaluator::set_expression(std::string e)
+void evaluator::compile_expressions(const std::vector<std::string>& expressions)
 {
     using namespace impl;
-    using mpe = mexce_parsing_exception;
-
-    deque<Token> tokens;
 
+    m_elist.clear();
+    m_roots.clear();
+    m_num_temporaries = 0;
     m_intermediate_constants.clear();
     m_intermediate_code.clear();
-    m_elist.clear();
+    m_arena.clear();
 
     if (evaluate_fptr) {
         free_executable_buffer(evaluate_fptr, m_buffer_size);
         evaluate_fptr = nullptr;
     }
+    if (evaluate_all_fptr) {
+        free_executable_buffer(evaluate_all_fptr, m_buffer_size);
+        evaluate_all_fptr = nullptr;
+    }
+    free_executable_buffer(m_batch_fptr.load(), m_batch_buffer_size);
+    m_batch_fptr = nullptr;
+    m_batch_variables.clear();
+    m_uses_context = false;
+    m_uses_block = false;
 
     auto x = m_variables.begin();
     for (; x != m_variables.end(); x++)
         x->second->referenced = false;
 
+    if (expressions.empty()) {
+        throw (std::logic_error("Expected an expression"));
+    }
+
+    // the expressions follow each other in the list, m_roots holds the last element of each
+    for (auto& e : expressions) {
+        auto elist = parse(e);
+        m_elist.splice(m_elist.end(), elist);
+        m_roots.push_back(std::prev(m_elist.end()));
+    }
+
+    for (auto& el : m_elist) {
+        if (el->element_type == CVAR) {
+            static_cast<Variable*>(el)->referenced = true;
+            m_uses_context |= static_cast<Variable*>(el)->in_context;
+            m_uses_block   |= static_cast<Variable*>(el)->in_block;
+        }
+    }
+    for (auto& v : m_variables) {
+        if (v.second->referenced) {
+            m_arena.retain(v.second);
+        }
+    }
+
+    // link functions to their arguments (1)
+    link_arguments(m_elist);
+
+    // choose more suitable functions, where applicable
+    for (auto y = m_elist.begin(); y != m_elist.end(); ) {
+        auto y_next = next(y);
+        if ((*y)->element_type == CFUNC) {
+            auto f = static_cast<Function*>(*y);
+
+            // eliminate constants
+            if (!f->force_not_constant) {
+                bool all_args_are_const = true;
+                for (size_t j = 0; j < f->num_args; j++) {
+                    if ((*f->args[j])->element_type != CCONST) {
+                        all_args_are_const = false;
+                        break;
+                    }
+                }
+                if (all_args_are_const) {
+                    elist_it_t first_arg_it = y;
+                    std::advance(first_arg_it, -(int64_t)f->num_args);
+                    double res;
+                    auto ref = reference_map().find(f->name);
+                    if (ref != reference_map().end()) {
+                        long double a[2];
+                        size_t j = 0;
+                        for (auto z = first_arg_it; z != y; z++) {
+                            a[j++] = static_cast<Constant*>(*z)->get_data_as_double();
+                        }
+                        res = (double)ref->second(a);
+                    }
+                    else {
+                        compile_and_finalize_elist(first_arg_it, next(y), backend::x87);
+                        res = evaluate_fptr(nullptr);
+                        free_executable_buffer(evaluate_fptr, m_buffer_size);
+                        evaluate_fptr = nullptr;
+                    }
+                    m_elist.erase(first_arg_it, y);
+                    *y = make_intermediate_constant(this, res);
+                    y = y_next;
+                    continue;
+                }
+            }
+
+            // the result of a rule is processed again, as it may be simplified further
+            if (simplify_function(y, this, &m_elist)) {
+                continue;
+            }
+
+            if (f->optimizer != 0) {
+                f->optimizer(y, this, &m_elist);
+            }
+        }
+        y = y_next;
+    }
+
+    if (m_backend == backend::x87) {
+        order_operands(this, m_elist);
+    }
+    m_num_temporaries = fuse_sin_cos(this, m_elist);
+    m_num_temporaries = eliminate_common_subexpressions(this, m_elist, m_roots, m_num_temporaries);
+    if (m_fast_math && m_backend == backend::avx && cpu_features().fma) {
+        contract_multiply_add(m_elist);
+    }
+    m_peephole_counters = peephole_counters();
+
+    is_constant_expression = m_roots.size()==1 && m_elist.size()==1 && m_elist.back()->element_type == CCONST;
+    if (is_constant_expression) {
+        auto v = static_cast<Constant*>(m_elist.back());
+        constant_expression_value = v->get_data_as_double();
+    }
+    else
+    if (m_roots.size() == 1) {
+        compile_and_finalize_elist(m_elist.begin(), m_elist.end(), m_backend);
+    }
+    else {
+        compile_and_finalize_outputs();
+    }
+}
+
+
+
+// Parses an expression to its list of elements, in postfix order
+inline
+impl::elist_t evaluator::parse(std::string e)
+{
+    using namespace impl;
+    using mpe = mexce_parsing_exception;
+
     if (e.length() == 0){
         throw (std::logic_error("Expected an expression"));
     }
 
     e += ' ';
 
-    //stage 1: checking expression syntax
-    Token temp;
+    // The expression is parsed in a single pass: the state machine below checks the syntax
+    // and hands each token over to the shunting-yard algorithm, which appends the elements
+    // to the list in postfix order. Names and literals are only read from the expression.
+    elist_t elist;
+    vector<Token> tstack;                       // pending operators, functions and parentheses
+    vector<elist_it_t> operands;                // the first element of each complete operand
+    string name;
+
+    auto emit_value = [&](Element* v) {
+        operands.push_back(elist.insert(elist.end(), v));
+    };
+
+    auto emit_operator = [&](const Token& t) {
+        if (t.type == UNARY) {
+            if (t.symbol == '-') { // unary '+' is ignored
+
+                // Rather than having an individual function for the unary minus
+                // we insert a zero before its argument (which is already in
+                // the list), and use a subtraction instead.
+                // The reason is to allow the optimizer to group
+                // addition/subtraction chains. Clearly, this is a bit unorthodox
+                // and could be done in the optimizer too, but the optimizer is
+                // complex enough already.
+                // The zero is -0, so that -0-x is -x also for x = 0.
+
+                operands.back() = elist.insert(operands.back(), make_intermediate_constant(this, -0.0));
+                elist.push_back(make_function(this, *t.function));
+            }
+            return;
+        }
+        auto it = elist.insert(elist.end(), make_function(this, *t.function));
+        if (t.function->num_args) {
+            it = operands[operands.size() - t.function->num_args];
+            operands.resize(operands.size() - t.function->num_args);
+        }
+        operands.push_back(it);
+    };
+
+    auto push_infix = [&](char op) {
+        Token t(get_infix_rank(op), op, &infix_function(op));
+        if (t.type != INFIX_1) {
+            while (!tstack.empty()) {
+                int sp = tstack.back().priority;
+                if (sp < INFIX_1 || sp > t.type) {
+                    break;
+                }
+                emit_operator(tstack.back());
+                tstack.pop_back();
+            }
+        }
+        tstack.push_back(t);
+    };
+
+    auto push_unary = [&](char op) {
+        Token t(UNARY, op, &infix_function('-'));
+        t.priority = (!tstack.empty() && tstack.back().priority == INFIX_1) ?
+            INFIX_1 : INFIX_3;
+        tstack.push_back(t);
+    };
+
+    auto right_parenthesis = [&]() {
+        while (tstack.back().type != LEFT_PARENTHESIS) {
+            emit_operator(tstack.back());
+            tstack.pop_back();
+        }
+        tstack.pop_back();
+    };
+
+    auto function_right_parenthesis = [&]() {
+        int type;
+        do {
+            type = tstack.back().type;
+            emit_operator(tstack.back());
+            tstack.pop_back();
+        }
+        while (type != FUNCTION_NAME);
+    };
+
+    auto comma = [&]() {
+        while (tstack.back().type != FUNCTION_NAME) {
+            emit_operator(tstack.back());
+            tstack.pop_back();
+        }
+    };
+
+    auto emit_literal = [&](size_t start) {
+        emit_value(make_intermediate_constant(this, atof(e.c_str() + start)));
+    };
+
+    // a name that is followed by ')', ',' or an operator
+    auto emit_name = [&](size_t i) {
+        auto v = m_variables.find(name);
+        if (v != m_variables.end()) {
+            emit_value(v->second.get());
+            return;
+        }
+        auto c = m_constants.find(name);
+        if (c == m_constants.end()) {
+            throw (mpe(name + " is not a known constant or variable name", i));
+        }
+        emit_value(c->second.get());
+    };
+
     vector< pair<int, int> > bdarray(1);
     map<string, Function>::const_iterator i_fnc;
     int state = 0;
     size_t i = 0;
+    size_t token_start = 0;
     int function_parentheses = 0;
     for (; i < e.length(); i++) {
         switch(state) {
             case 0: //start of expression
                 if (e[i] == '-' || e[i] == '+') {
-                    tokens.push_back(Token(UNARY, i, e[i]));
+                    push_unary(e[i]);
                     state = 4;
                     break;
                 }
                 if (e[i] == ')') {
                     if (bdarray.back().first != 0)
                         throw (mpe("Expected an expression", i));
+                    if (function_parentheses <= 0)
+                        throw (mpe("\")\" not expected", i));
                     if (bdarray.back().second != 0)
                         throw (mpe("Expected more arguments", i));
-                    tokens.push_back(Token(FUNCTION_RIGHT_PARENTHESIS, i, ')'));
+                    function_right_parenthesis();
                     function_parentheses--;
                     bdarray.pop_back();
                     state = 5;
@@ -2019,27 +7095,27 @@ void evaluator::set_expression(std::string e)
                 if (e[i] == ' ')
                     break;
                 if (is_numeric(e[i])) {
-                    temp = Token(NUMERIC_LITERAL, i, e[i]);
+                    token_start = i;
                     state = 1;
                     break;
                 }
                 if (e[i] == '.') {
-                    temp = Token(NUMERIC_LITERAL, i, e[i]);
+                    token_start = i;
                     state = 2;
                     break;
                 }
                 if (is_alphabetic(e[i])) {
-                    temp = Token(0, i, e[i]);
+                    token_start = i;
                     state = 3;
                     break;
                 }
                 if (e[i] == '-' || e[i] == '+') {
-                    tokens.push_back(Token(UNARY, i, e[i]));
+                    push_unary(e[i]);
                     state = 4;
                     break;
                 }
                 if (e[i] == '(') {
-                    tokens.push_back(Token(LEFT_PARENTHESIS, i, '('));
+                    tstack.push_back(Token(LEFT_PARENTHESIS, '('));
                     bdarray.back().first++;
                     state = 0;
                     break;
@@ -2049,24 +7125,22 @@ void evaluator::set_expression(std::string e)
                 }
             case 1: //currently reading a numeric literal
                 if (e[i] == '.') {
-                    temp.content += e[i];
                     state = 2;
                     break;
                 }
             case 2: // currently reading a numeric literal, found dot
                 if (is_numeric(e[i])) {
-                    temp.content += e[i];
                     break;
                 }
                 if (e[i] == ' ') {
-                    tokens.push_back(temp);
+                    emit_literal(token_start);
                     state = 5;
                     break;
                 }
                 if (e[i] == ')') {
-                    tokens.push_back(temp);
+                    emit_literal(token_start);
                     if (bdarray.back().first > 0) {
-                        tokens.push_back(Token(RIGHT_PARENTHESIS, i, ')'));
+                        right_parenthesis();
                         bdarray.back().first--;
                     }
                     else {
@@ -2074,7 +7148,7 @@ void evaluator::set_expression(std::string e)
                             throw (mpe("\")\" not expected", i));
                         if (bdarray.back().second != 1)
                             throw (mpe("Expected more arguments", i));
-                        tokens.push_back(Token(FUNCTION_RIGHT_PARENTHESIS, i, ')'));
+                        function_right_parenthesis();
                         function_parentheses--;
                         bdarray.pop_back();
                     }
@@ -2082,86 +7156,76 @@ void evaluator::set_expression(std::string e)
                     break;
                 }
                 if (is_operator(e[i])) {
-                    tokens.push_back(temp);
-                    tokens.push_back(Token( get_infix_rank(e[i]) , i, e[i]));
+                    emit_literal(token_start);
+                    push_infix(e[i]);
                     state = 4;
                     break;
                 }
                 if (e[i] == ',') {
-                    tokens.push_back(temp);
+                    emit_literal(token_start);
                     if (bdarray.back().first != 0)
                         throw (mpe("Expected a \")\"", i));
                     if (bdarray.back().second-- < 2)
                         throw (mpe("Don\'t expect any arguments here", i));
-                    tokens.push_back(Token(COMMA, i, ','));
+                    comma();
                     state = 0;
                     break;
                 }
                 if (e[i] == 'e' && state < 7) {
-                    temp.content += e[i];
                     state = 7;
                     break;
                 }
                 throw (mpe((string("\"")+e[i])+"\" not expected", i));
             case 7: // read the 'e' (exponent) while reading a numeric literal
                 if (e[i] == '+' || e[i] == '-') {
-                    temp.content += e[i];
                     state = 8;
                     break;
                 }
                 throw (mpe("expecting '+'/'-' followed by the exponent of the numeric literal", i));
             case 8: // reading the exponent of the numeric literal
                 if (is_numeric(e[i])) {
-                    temp.content += e[i];
                     state = 2;
                     break;
                 }
                 throw (mpe("expecting the exponent of the numeric literal", i));
             case 3: //currently reading alphanumeric
                 if (is_alphabetic(e[i]) || is_numeric(e[i])) {
-                    temp.content += e[i];
                     break;
                 }
+                name.assign(e, token_start, i - token_start);
                 if (e[i] == ' ') {
-                    if (m_variables.find(temp.content) != m_variables.end()) {
-                        temp.type = VARIABLE_NAME;
-                        tokens.push_back(temp);
+                    auto v = m_variables.find(name);
+                    if (v != m_variables.end()) {
+                        emit_value(v->second.get());
                         state = 5;
                         break;
                     }
-                    if (m_constants.find(temp.content) != m_constants.end()) {
-                        temp.type = CONSTANT_NAME;
-                        tokens.push_back(temp);
+                    auto c = m_constants.find(name);
+                    if (c != m_constants.end()) {
+                        emit_value(c->second.get());
                         state = 5;
                         break;
                     }
-                    if ((i_fnc = function_map().find(temp.content)) != function_map().end()) {
-                        temp.type = FUNCTION_NAME;
-                        tokens.push_back(temp);
-                        tokens.push_back(Token(FUNCTION_LEFT_PARENTHESIS, i, '('));
+                    if ((i_fnc = function_map().find(name)) != function_map().end()) {
+                        tstack.push_back(Token(FUNCTION_NAME, 0, &i_fnc->second));
                         bdarray.push_back(make_pair(0, i_fnc->second.num_args));
                         function_parentheses++;
                         state = 6;
                         break;
                     }
-                    throw (mpe(string(temp.content) +
-                        " is not a known constant, variable or function name", i));
+                    throw (mpe(name + " is not a known constant, variable or function name", i));
                 }
                 if (e[i] == ')') {
-                    temp.type = m_variables.find(temp.content) != m_variables.end() ? VARIABLE_NAME : 
-                                m_constants.find(temp.content) != m_constants.end() ? CONSTANT_NAME :
-                        throw (mpe(string(temp.content) +
-                            " is not a known constant or variable name", i));
-                    tokens.push_back(temp);
+                    emit_name(i);
                     if (bdarray.back().first > 0) {
-                        tokens.push_back(Token(RIGHT_PARENTHESIS, i, ')'));
+                        right_parenthesis();
                         bdarray.back().first--;
                     }
                     else
                     if (function_parentheses > 0) {
                         if (bdarray.back().second != 1)
                             throw (mpe("Expected more arguments", i));
-                        tokens.push_back(Token(FUNCTION_RIGHT_PARENTHESIS, i, ')'));
+                        function_right_parenthesis();
                         function_parentheses--;
                         bdarray.pop_back();
                     }
@@ -2172,38 +7236,28 @@ void evaluator::set_expression(std::string e)
                     break;
                 }
                 if (e[i] == '(') {
-                    if ((i_fnc = function_map().find(temp.content)) == function_map().end()) {
-                        throw (mpe(string(temp.content) + " is not a known function name", i));
+                    if ((i_fnc = function_map().find(name)) == function_map().end()) {
+                        throw (mpe(name + " is not a known function name", i));
                     }
-                    temp.type = FUNCTION_NAME;
-                    tokens.push_back(temp);
-                    tokens.push_back(Token(FUNCTION_LEFT_PARENTHESIS, i, '('));
+                    tstack.push_back(Token(FUNCTION_NAME, 0, &i_fnc->second));
                     bdarray.push_back(make_pair(0, i_fnc->second.num_args));
                     function_parentheses++;
                     state = 0;
                     break;
                 }
                 if (is_operator(e[i])) {
-                    temp.type = m_variables.find(temp.content) != m_variables.end() ? VARIABLE_NAME : 
-                                m_constants.find(temp.content) != m_constants.end() ? CONSTANT_NAME :
-                        throw (mpe(string(temp.content) +
-                            " is not a known constant or variable name", i));
-                    tokens.push_back(temp);
-                    tokens.push_back(Token(get_infix_rank(e[i]), i, e[i]));
+                    emit_name(i);
+                    push_infix(e[i]);
                     state = 4;
                     break;
                 }
                 if (e[i] == ',') {
-                    temp.type = m_variables.find(temp.content) != m_variables.end() ? VARIABLE_NAME : 
-                                m_constants.find(temp.content) != m_constants.end() ? CONSTANT_NAME :
-                        throw (mpe(string(temp.content)+" is not a "
-                            "known constant or variable name", i));
-                    tokens.push_back(temp);
+                    emit_name(i);
                     if (bdarray.back().first != 0)
                         throw (mpe("Expected a \")\"", i));
                     if (bdarray.back().second-- < 2)
                         throw (mpe("Don\'t expect any arguments here", i));
-                    tokens.push_back(Token(COMMA, i, ','));
+                    comma();
                     state = 0;
                     break;
                 }
@@ -2212,20 +7266,20 @@ void evaluator::set_expression(std::string e)
                 if (e[i] == ' ')
                     break;
                 if (is_operator(e[i])) {
-                    tokens.push_back(Token(get_infix_rank(e[i]), i, e[i]));
+                    push_infix(e[i]);
                     state = 4;
                     break;
                 }
                 if (e[i] == ')') {
                     if (bdarray.back().first > 0) {
-                        tokens.push_back(Token(RIGHT_PARENTHESIS, i, ')'));
+                        right_parenthesis();
                         bdarray.back().first--;
                     }
                     else
                     if (function_parentheses > 0) {
                         if (bdarray.back().second != 1)
                             throw (mpe("Expected more arguments", i));
-                        tokens.push_back(Token(FUNCTION_RIGHT_PARENTHESIS, i, ')'));
+                        function_right_parenthesis();
                         function_parentheses--;
                         bdarray.pop_back();
                     }
@@ -2240,7 +7294,7 @@ void evaluator::set_expression(std::string e)
                         throw (mpe("Expected a \")\"", i));
                     if (bdarray.back().second-- < 2)
                         throw (mpe("Don\'t expect any arguments here", i));
-                    tokens.push_back(Token(COMMA, i, ','));
+                    comma();
                     state = 0;
                     break;
                 }
@@ -2259,224 +7313,333 @@ void evaluator::set_expression(std::string e)
     if (state != 5) {
         throw (mpe("Unexpected end of expression", --i));
     }
+    while (!tstack.empty()) {
+        emit_operator(tstack.back());
+        tstack.pop_back();
+    }
+    return elist;
+}
 
-    //stage 2: transform expression to postfix
-    deque<Token> postfix;
-    vector<Token> tstack;
-    while (!tokens.empty()) {
-        temp = tokens.front();
-        tokens.pop_front();
-        switch (temp.type) {
-            case INFIX_4:
-            case INFIX_3:
-            case INFIX_2:
-                while(!tstack.empty()) {
-                    int sp = tstack.back().priority;
-                    if (sp < INFIX_1 || sp > temp.type) {
-                        break;
-                    }
-                    postfix.push_back(tstack.back());
-                    tstack.pop_back();
-                }
-            case INFIX_1:
-            case LEFT_PARENTHESIS:
-            case FUNCTION_NAME:
-                tstack.push_back(temp);
-                break;
-            case UNARY:
-                temp.priority = (!tstack.empty() && tstack.back().priority == INFIX_1) ?
-                    INFIX_1 : INFIX_3;
-                tstack.push_back(temp);
-                break;
-            case NUMERIC_LITERAL:
-            case CONSTANT_NAME:
-            case VARIABLE_NAME:
-                postfix.push_back(temp);
-                break;
-            case RIGHT_PARENTHESIS:
-                while(tstack.back().type != LEFT_PARENTHESIS) {
-                    postfix.push_back(tstack.back());
-                    tstack.pop_back();
-                }
-                tstack.pop_back();
-                break;
-            case FUNCTION_RIGHT_PARENTHESIS:
-                do {
-                    postfix.push_back(tstack.back());
-                    tstack.pop_back();
-                }
-                while(postfix.back().type != FUNCTION_NAME);
-                break;
-            case COMMA:
-                while(tstack.back().type != FUNCTION_NAME) {
-                    postfix.push_back(tstack.back());
-                    tstack.pop_back();
-                }
-                break;
-            case FUNCTION_LEFT_PARENTHESIS:
-                break;
-            default:
-                throw(mpe("internal error", 0));
-        }
+
+
+inline
+void evaluator::compile_and_finalize_elist(impl::elist_it_t first, impl::elist_it_t last, mexce::backend b)
+{
+    using namespace impl;
+
+    mexce_charstream code_buffer;
+
+    bool context = false;
+    Variable_addressing va;
+    for (auto it = first; it != last; it++) {
+        context       |= (*it)->element_type == CVAR && static_cast<Variable*>(*it)->in_context;
+        va.block_base |= (*it)->element_type == CVAR && static_cast<Variable*>(*it)->in_block;
     }
-    while(!tstack.empty()) {
-        postfix.push_back(tstack.back());
-        tstack.pop_back();
+    int pushes = emit_keep_arguments(code_buffer, context, false, va.block_base ? m_variable_block_base : nullptr);
+
+    if (b != backend::x87) {
+        // the result is left in xmm0, where the x64 calling conventions expect it
+        Simd_compiler sc(this, b, m_accuracy, 1, &va);
+        sc.reserve_slots(first, vector<elist_it_t>(1, std::prev(last)), m_num_temporaries);
+        sc.compile(first, last);
+
+        // after the return address and an odd number of pushes, rsp is 16-byte aligned
+        int32_t  frame_data = sc.frame_data_size();
+        uint32_t saved_xmm  = sc.callee_saved_xmm();
+        Simd_compiler::emit_prologue(code_buffer, frame_data, saved_xmm, pushes % 2 == 1);
+        append_code(code_buffer, sc.s);
+        Simd_compiler::emit_epilogue(code_buffer, frame_data, saved_xmm, pushes % 2 == 1);
     }
+    else {
+#ifdef MEXCE_64
+        // On x64 we are using rax to fetch/store addresses
+        code_buffer < 0x50; // push rax
+#endif
 
-    //stage 3: convert "Token" expression primitives to "Element *"
+        mexce_charstream body;
+        int32_t num_slots = compile_elist(body, first, last, m_peephole_counters, &va, m_num_temporaries);
+        emit_x87_frame(code_buffer, num_slots, true);
+        append_code(code_buffer, body);
+        emit_x87_frame(code_buffer, num_slots, false);
 
-    while (!postfix.empty()) {
-        temp = postfix.front();
-        postfix.pop_front();
-        switch (temp.type) {
-            case INFIX_4:
-            case INFIX_3:
-            case INFIX_2:
-            case INFIX_1: {
-                auto name = infix_operator_to_function_name(temp.content);
-                m_elist.push_back( make_function(name) );
-                break;
-            }
-            case FUNCTION_NAME:
-                m_elist.push_back(make_function(temp.content));
-                break;
-            case UNARY:
-                if (temp.content == "-") { // unary '+' is ignored
-
-                    // Rather than having an individual function for the unary minus
-                    // we insert a zero before the last argument (which is already in
-                    // the list), and use a subtraction instead.
-                    // The reason is to allow the optimizer to group
-                    // addition/subtraction chains. Clearly, this is a bit unorthodox
-                    // and could be done in the optimizer too, but the optimizer is
-                    // complex enough already.
-
-                    link_arguments(m_elist); 
-                    auto chunk = get_dependent_chunk(std::prev(m_elist.end()));
-                    m_elist.insert(chunk.first, make_intermediate_constant(this, 0.0));
-                    m_elist.push_back( make_function("sub") );
-                }
-                break;
-            case NUMERIC_LITERAL: {
-                double c_value = atof(temp.content.c_str());
-                m_elist.push_back(make_intermediate_constant(this, c_value));
-                break;
-            }
-            case CONSTANT_NAME: {
-                m_elist.push_back(m_constants.find(temp.content)->second);
-                break;
-            }
-            case VARIABLE_NAME: {
-                auto it = m_variables.find(temp.content);
-                assert(it != m_variables.end());
-                it->second->referenced = true;
-                m_elist.push_back(it->second);
-                break;
-            }
-        }
+#ifdef MEXCE_64
+        // Right before the function returns, in 32-bit x86, the result is in
+        // st(0), where it is expected to be. There is nothing further to do there
+        // other than return.
+        // In x64 however, the result is expected to be in xmm0, thus we should
+        // move it there and pop the FPU stack. To achieve that, we store the
+        // result to the slot of the rax that was pushed on entry, and load it to xmm0.
+        // Nothing is written outside the stack frame, so the code is reentrant.
+        code_buffer < 0xdd < 0x1c < 0x24;                       // fstp        qword ptr [rsp]
+        code_buffer < 0xf3 < 0x0f < 0x7e < 0x04 < 0x24;         // movq        xmm0, mmword ptr [rsp]
+        code_buffer < 0x58;                                     // pop         rax
+#endif
     }
 
-    // link functions to their arguments (1)
-    link_arguments(m_elist);
+    emit_restore_arguments(code_buffer, context, false, va.block_base);
+    code_buffer < 0xc3;                                         // ret
 
-    // choose more suitable functions, where applicable
-    for (auto y = m_elist.begin(); y != m_elist.end(); ) {
-        auto y_next = next(y);
-        if ((*y)->element_type == CFUNC) {
-            auto f = static_pointer_cast<Function>(*y);
+    auto code = link_code(code_buffer);
+    m_buffer_size = code.size();
+    evaluate_fptr = copy_to_executable_buffer<evaluate_fptr_t>(code);
+}
 
-            // eliminate constants
-            if (!f->force_not_constant) {
-                bool all_args_are_const = true;
-                for (size_t j = 0; j < f->num_args; j++) {
-                    if ((*f->args[j])->element_type != CCONST) {
-                        all_args_are_const = false;
-                        break;
-                    }
-                }
-                if (all_args_are_const) {
-                    elist_it_t first_arg_it = y;
-                    std::advance(first_arg_it, -(int64_t)f->num_args);
-                    compile_and_finalize_elist(first_arg_it, next(y));
-                    double res = evaluate_fptr();
-                    m_elist.erase(first_arg_it, y);
-                    *y = make_intermediate_constant(this, res);
-                    y = y_next;
-                    continue;
-                }
-            }
 
-            if (f->optimizer != 0) {
-                f->optimizer(y, this, &m_elist);
-            }
+
+// Generates the function of several expressions: void f(const void* context, double* out),
+// which computes them one after the other and stores the result of the i-th to out[i].
+inline
+void evaluator::compile_and_finalize_outputs()
+{
+    using namespace impl;
+
+    mexce_charstream code_buffer;
+    Variable_addressing va;
+    va.block_base = m_uses_block;
+    int pushes = emit_keep_arguments(code_buffer, m_uses_context, true, m_uses_block ? m_variable_block_base : nullptr);
+
+    if (m_backend != backend::x87) {
+        Simd_compiler sc(this, m_backend, m_accuracy, 1, &va);
+        sc.reserve_slots(m_elist.begin(), m_roots, m_num_temporaries);
+        auto first = m_elist.begin();
+        for (size_t i = 0; i < m_roots.size(); i++) {
+            auto last = next(m_roots[i]);
+            sc.compile(first, last);
+            sc.store_result(Mem(RSI, int32_t(i * sizeof(double))));
+            first = last;
         }
-        y = y_next;
-    }
 
-    is_constant_expression = m_elist.size()==1 && m_elist.back()->element_type == CCONST;
-    if (is_constant_expression) {
-        auto v = static_pointer_cast<Constant>(m_elist.back());
-        constant_expression_value = v->get_data_as_double();
+        int32_t  frame_data = sc.frame_data_size();
+        uint32_t saved_xmm  = sc.callee_saved_xmm();
+        Simd_compiler::emit_prologue(code_buffer, frame_data, saved_xmm, pushes % 2 == 1);
+        append_code(code_buffer, sc.s);
+        Simd_compiler::emit_epilogue(code_buffer, frame_data, saved_xmm, pushes % 2 == 1);
     }
     else {
-        compile_and_finalize_elist(m_elist.begin(), m_elist.end());
+        mexce_charstream body;
+        int32_t num_slots = m_num_temporaries;
+        auto first = m_elist.begin();
+        for (size_t i = 0; i < m_roots.size(); i++) {
+            auto last = next(m_roots[i]);
+            num_slots = std::max(num_slots, compile_elist(body, first, last, m_peephole_counters, &va, m_num_temporaries));
+            body < 0xdd < 0x9e;                                 // fstp        qword ptr [esi/rsi+disp32]
+            body << int32_t(i * sizeof(double));
+            first = last;
+        }
+        emit_x87_frame(code_buffer, num_slots, true);
+        append_code(code_buffer, body);
+        emit_x87_frame(code_buffer, num_slots, false);
     }
+
+    emit_restore_arguments(code_buffer, m_uses_context, true, m_uses_block);
+    code_buffer < 0xc3;                                         // ret
+
+    auto code = link_code(code_buffer);
+    m_buffer_size = code.size();
+    evaluate_all_fptr = copy_to_executable_buffer<evaluate_all_fptr_t>(code);
 }
 
 
 
+// Generates the batch kernel: void kernel(size_t n, Column_cursor* cursors, double* out)
+// Every variable of the expression is read through a cursor, the variables without a
+// column get a cursor with zero stride. With several expressions, the results are written
+// through the cursors that follow those of the variables, and out is not used.
 inline
-void evaluator::compile_and_finalize_elist(impl::elist_it_t first, impl::elist_it_t last)
+void evaluator::compile_batch_kernel()
 {
     using namespace impl;
 
-    const static uint8_t return_sequence[] = {
-#ifdef MEXCE_64
-        // Right before the function returns, in 32-bit x86, the result is in
-        // st(0), where it is expected to be. There is nothing further to do there
-        // other than return.
-        // In x64 however, the result is expected to be in xmm0, thus we should
-        // move it there and pop the FPU stack. To achieve that, we  store the
-        // result to memory and then load it to xmm0, which requires a temporary.
-        // This code is used at the very end (see below), but its size must be known here.
+    Variable_addressing va;
+    m_batch_variables.clear();
+    for (auto& e : m_elist) {
+        if (e->element_type == CVAR && !va.pointer_offset.count((Value*)e)) {
+            va.pointer_offset[(Value*)e] = int32_t(m_batch_variables.size() * sizeof(Column_cursor));
+            m_batch_variables.push_back(static_cast<Variable*>(e));
+        }
+    }
+    vector<int32_t> output_offsets;
+    if (m_roots.size() > 1) {
+        for (size_t i = 0; i < m_roots.size(); i++) {
+            output_offsets.push_back(int32_t((m_batch_variables.size() + i) * sizeof(Column_cursor)));
+        }
+    }
 
-        //  load return address to rax (last 8 bytes - address is uninitialized)
-        0x48, 0xb8, 0xcd, 0xcd, 0xcd, 0xcd, 0xcd, 0xcd, 0xcd, 0xcd, // mov         rax, cdcdcdcdcdcdcdcdh
+    mexce_charstream code_buffer;
 
-        // store the return value
-        0xdd, 0x18,                                                 // fstp        qword ptr [rax]
+    // keep n, the cursors and out in edi/rdi, ebx/rbx and esi/rsi, which are preserved across calls
+    code_buffer < 0x53 < 0x56 < 0x57;                           // push        ebx/rbx, esi/rsi, edi/rdi
+#ifdef MEXCE_64
+  #ifdef _WIN32
+    code_buffer < 0x48 < 0x89 < 0xcf                            // mov         rdi, rcx
+                < 0x48 < 0x89 < 0xd3                            // mov         rbx, rdx
+                < 0x4c < 0x89 < 0xc6;                           // mov         rsi, r8
+  #else
+    code_buffer < 0x48 < 0x89 < 0xf3                            // mov         rbx, rsi
+                < 0x48 < 0x89 < 0xd6;                           // mov         rsi, rdx
+  #endif
+#else
+    code_buffer < 0x8b < 0x7c < 0x24 < 0x10                     // mov         edi, dword ptr [esp+10h]
+                < 0x8b < 0x5c < 0x24 < 0x14                     // mov         ebx, dword ptr [esp+14h]
+                < 0x8b < 0x74 < 0x24 < 0x18;                    // mov         esi, dword ptr [esp+18h]
+#endif
 
-        // load from the return value to xmm0
-        0xf3, 0x0f, 0x7e, 0x00,                                     // movq        xmm0, mmword ptr [rax]
-        0x58,                                                       // pop rax
+#ifdef MEXCE_64
+    const uint8_t rex_w = 0x48;
+#else
+    const uint8_t rex_w = 0;
 #endif
-        0xc3                                                        // return
+
+    // appends the code that moves the output and the cursors forward by 'rows' rows
+    auto advance = [&](mexce_charstream& body, int rows) {
+        int shift = rows == 8 ? 3 : rows == 4 ? 2 : 0;
+        if (output_offsets.empty()) {
+            if (rex_w) body < rex_w;
+            body < 0x83 < 0xc6 < (8 * rows);                    // add         esi/rsi, 8*rows
+        }
+        for (auto offset : output_offsets) {
+            if (rex_w) body < rex_w;
+            body < 0x83 < 0x83; body << offset; body < (8 * rows); // add         [ebx/rbx+data], 8*rows
+        }
+        for (auto& e : va.pointer_offset) {
+            if (rex_w) body < rex_w;
+            body < 0x8b < 0x83;                                 // mov         eax/rax, [ebx/rbx+stride]
+            body << int32_t(e.second + sizeof(void*));
+            if (shift) {
+                if (rex_w) body < rex_w;
+                body < 0xc1 < 0xe0 < shift;                     // shl         eax/rax, shift
+            }
+            if (rex_w) body < rex_w;
+            body < 0x01 < 0x83;                                 // add         [ebx/rbx+data], eax/rax
+            body << e.second;
+        }
     };
 
-    mexce_charstream code_buffer;
+    // Most of the rows are computed 8 at a time with AVX-512, or 4 at a time with AVX2.
+    int lanes = 1;
+    if (m_backend == backend::avx) {
+        lanes = cpu_features().avx512f ? 8 : cpu_features().avx2 ? 4 : 1;
+    }
 
-#ifdef MEXCE_64
-    // On x64 we are using rax to fetch/store addresses
-    code_buffer < 0x50; // push rax
-#endif
+    // The remainder is computed by the loop below, one row at a time, or with AVX-512,
+    // in one more iteration where opmask k1 selects the valid rows.
+    bool masked_tail = lanes == 8;
+
+    // Emits the address of the result of the i-th expression: [esi/rsi], or with several
+    // expressions, the data of its cursor, which is loaded to eax/rax.
+    auto output_address = [&](mexce_charstream& s, size_t i) {
+        if (output_offsets.empty()) {
+            return Mem(RSI);
+        }
+        if (rex_w) s < rex_w;
+        s < 0x8b < 0x83; s << output_offsets[i];                // mov         eax/rax, [ebx/rbx+data]
+        return Mem(RAX);
+    };
+
+    // the body of the remainder, which stores its results to their outputs
+    mexce_charstream body;
+    Simd_compiler sc(this, m_backend, m_accuracy, masked_tail ? 8 : 1, &va);
+    int32_t x87_slots = m_num_temporaries;
+    if (m_backend == backend::x87) {
+        auto first = m_elist.begin();
+        for (size_t i = 0; i < m_roots.size(); i++) {
+            auto last = next(m_roots[i]);
+            x87_slots = std::max(x87_slots, compile_elist(body, first, last, m_peephole_counters, &va, m_num_temporaries));
+            Mem out = output_address(body, i);
+            body < 0xdd < (0x18 | out.base);                    // fstp        qword ptr [eax/rax] or [esi/rsi]
+            first = last;
+        }
+    }
+    else {
+        if (masked_tail) {
+            body < 0x89 < 0xf9                                  // mov         ecx, edi
+                 < 0xb8 < 0x01 < 0x00 < 0x00 < 0x00             // mov         eax, 1
+                 < 0xd3 < 0xe0                                  // shl         eax, cl
+                 < 0xff < 0xc8                                  // dec         eax
+                 < 0xc5 < 0xf8 < 0x92 < 0xc8;                   // kmovw       k1, eax
+            sc.tail_mask = 1;
+        }
+        sc.reserve_slots(m_elist.begin(), m_roots, m_num_temporaries);
+        auto first = m_elist.begin();
+        for (size_t i = 0; i < m_roots.size(); i++) {
+            auto last = next(m_roots[i]);
+            sc.compile(first, last);
+            sc.store_result(output_address(sc.s, i), sc.tail_mask);
+            first = last;
+        }
+        append_code(body, sc.s);
+    }
+    if (!masked_tail) {
+        advance(body, 1);
+        if (rex_w) body < rex_w;
+        body < 0xff < 0xcf;                                     // dec         edi/rdi
+    }
 
-    compile_elist(code_buffer, first, last);
+    mexce_charstream vector_body;
+    Simd_compiler vc(this, m_backend, m_accuracy, lanes, &va);
+    if (lanes > 1) {
+        vc.reserve_slots(m_elist.begin(), m_roots, m_num_temporaries);
+        auto first = m_elist.begin();
+        for (size_t i = 0; i < m_roots.size(); i++) {
+            auto last = next(m_roots[i]);
+            vc.compile(first, last);
+            vc.store_result(output_address(vc.s, i));
+            first = last;
+        }
+        append_code(vector_body, vc.s);
+        advance(vector_body, lanes);
+        vector_body < 0x48 < 0x83 < 0xef < lanes;               // sub         rdi, lanes
+    }
 
-    // copy the return sequence
-    code_buffer.s.write((const char*)return_sequence, sizeof(return_sequence));
+    // after the return address and the 3 pushes, rsp is 16-byte aligned
+    int32_t  frame_data = std::max(sc.frame_data_size(), vc.frame_data_size());
+    uint32_t saved_xmm  = sc.callee_saved_xmm() | vc.callee_saved_xmm();
+    if (m_backend != backend::x87) {
+        Simd_compiler::emit_prologue(code_buffer, frame_data, saved_xmm, true);
+    }
+    else {
+        emit_x87_frame(code_buffer, x87_slots, true);
+    }
 
-    auto code = code_buffer.s.str();
-    m_buffer_size = code.size();
-    auto buffer = get_executable_buffer(m_buffer_size);
-    memcpy(buffer, &code[0], m_buffer_size);
+    if (lanes > 1) {
+        auto vector_code = vector_body.s.str();
+        int32_t vector_size = (int32_t)vector_code.size();
+        code_buffer < 0x48 < 0x83 < 0xff < lanes;               // cmp         rdi, lanes
+        code_buffer < 0x0f < 0x82;                              // jb          remainder
+        code_buffer << int32_t(vector_size + 10);
+        append_code(code_buffer, vector_code, vector_body.pool_references);    // vector_loop:
+        code_buffer < 0x48 < 0x83 < 0xff < lanes;               // cmp         rdi, lanes
+        code_buffer < 0x0f < 0x83;                              // jae         vector_loop
+        code_buffer << int32_t(-(vector_size + 10));
+    }
 
-#ifdef MEXCE_64
-    // load the intermediate variable's address to rax
-    *((uint64_t*)(buffer+code.size()-16)) = (uint64_t)&m_x64_return_var;
-#endif
+    auto body_code = body.s.str();
+    int32_t body_size = (int32_t)body_code.size();
+
+    if (rex_w) code_buffer < rex_w;                             // remainder:
+    code_buffer < 0x85 < 0xff;                                  // test        edi/rdi, edi/rdi
+    code_buffer < 0x0f < 0x84;                                  // jz          end
+    code_buffer << int32_t(body_size + (masked_tail ? 0 : 6));
+    append_code(code_buffer, body_code, body.pool_references);             // loop:
+    if (!masked_tail) {
+        code_buffer < 0x0f < 0x85;                              // jnz         loop
+        code_buffer << int32_t(-(body_size + 6));
+    }
+    if (m_backend != backend::x87) {                            // end:
+        Simd_compiler::emit_epilogue(code_buffer, frame_data, saved_xmm, true);
+    }
+    else {
+        emit_x87_frame(code_buffer, x87_slots, false);
+    }
+    if (lanes > 1) {
+        code_buffer < 0xc5 < 0xf8 < 0x77;                       // vzeroupper
+    }
+    code_buffer < 0x5f < 0x5e < 0x5b;                           // pop         edi/rdi, esi/rsi, ebx/rbx
+    code_buffer < 0xc3;                                         // ret
 
-    evaluate_fptr = lock_executable_buffer(buffer, code.size());
+    auto code = link_code(code_buffer);
+    m_batch_buffer_size = code.size();
+    m_batch_fptr.store(copy_to_executable_buffer<batch_fptr_t>(code), std::memory_order_release);
 }
 
 } // mexce
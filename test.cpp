@@ -0,0 +1,781 @@
+// Checks of the results that must not depend on the backend or on the optimizations of the
+// expression, on every backend that the CPU supports. Build and run it with e.g.
+//     g++ -std=c++14 -O2 test.cpp -o test && ./test
+// It prints the failed checks and returns their number.
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+#include "mexce.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+int failures = 0;
+
+const double nan_ = std::numeric_limits<double>::quiet_NaN();
+const double inf_ = std::numeric_limits<double>::infinity();
+
+
+// The backends that the CPU supports
+vector<mexce::backend> backends()
+{
+    vector<mexce::backend> r;
+    for (auto b : { mexce::backend::x87, mexce::backend::sse2, mexce::backend::avx }) {
+        try {
+            mexce::evaluator ev;
+            ev.set_backend(b);
+            r.push_back(b);
+        }
+        catch (std::logic_error&) {
+        }
+    }
+    return r;
+}
+
+
+const char* backend_name(mexce::backend b)
+{
+    return b == mexce::backend::x87 ? "x87" : b == mexce::backend::sse2 ? "sse2" : "avx";
+}
+
+
+// Equal, including the sign of zero, and any NaN equals any NaN of the same sign
+bool same(double a, double b)
+{
+    if (std::isnan(a) || std::isnan(b)) {
+        return std::isnan(a) && std::isnan(b) && std::signbit(a) == std::signbit(b);
+    }
+    return a == b && std::signbit(a) == std::signbit(b);
+}
+
+
+// Checks that expression evaluates to expected for x and y, on every backend
+void check(const string& expression, double x, double y, double expected)
+{
+    for (auto b : backends()) {
+        double vx = x, vy = y;
+        mexce::evaluator ev;
+        ev.bind(vx, "x", vy, "y");
+        ev.set_backend(b);
+        ev.set_expression(expression);
+        double r = ev.evaluate();
+        if (!same(r, expected)) {
+            printf("FAILED: %s at x = %g, y = %g on %s: %g, expected %g\n",
+                expression.c_str(), x, y, backend_name(b), r, expected);
+            failures++;
+        }
+    }
+}
+
+
+// min and max return the same operand for 0 and -0 on every backend, as the x87 code does:
+// max(a, b) is b if a <= b, min(a, b) is a if a <= b, and both are a if b is NaN
+void test_min_max()
+{
+    check("max(x, y)",  0.0, -0.0, -0.0);
+    check("max(x, y)", -0.0,  0.0,  0.0);
+    check("min(x, y)",  0.0, -0.0,  0.0);
+    check("min(x, y)", -0.0,  0.0, -0.0);
+    check("max(x, y)", nan_,  1.0, nan_);
+    check("max(x, y)",  1.0, nan_,  1.0);
+    check("min(x, y)", nan_,  1.0,  1.0);
+    check("min(x, y)",  1.0, nan_, nan_);
+    check("max(x, y)",  3.0,  2.0,  3.0);
+    check("min(x, y)",  3.0,  2.0,  2.0);
+}
+
+
+
+// Unary minus flips the sign bit, as fchs does, and subtraction from 0 gives +0 for 0
+void test_unary_minus()
+{
+    check("-x",           0.0,  0.0, -0.0);
+    check("-x",          -0.0,  0.0,  0.0);
+    check("-x",          nan_,  0.0, -nan_);
+    check("-x",         -nan_,  0.0,  nan_);
+    check("-(x)",         0.0,  0.0, -0.0);
+    check("-sin(x)",      0.0,  0.0, -0.0);
+    check("-x-y",         0.0,  0.0, -0.0);
+    check("-x*2-y",       0.0,  0.0, -0.0);
+    check("-(x+y)",       0.0,  0.0, -0.0);
+    check("1/-(x<x)",     1.0,  0.0, -inf_);
+    check("-neg(x)",     -0.0,  0.0, -0.0);
+    check("-neg(x)",     nan_,  0.0,  nan_);
+    check("neg(-x)",    -nan_,  0.0, -nan_);
+    check("abs(0-x)",    -0.0,  0.0,  0.0);
+    check("x-1-neg(y)",   2.0,  3.0,  4.0);
+    check("y-x",          0.0,  0.0,  0.0);
+    check("0-x",          0.0,  0.0,  0.0);
+    check("-x+0",         0.0,  0.0,  0.0);
+    check("y-y",          0.0, -0.0,  0.0);
+    check("-y+y-x",       0.0,  1.0,  0.0);
+    check("log(x^-3)",    1.0,  0.0,  0.0);
+    check("-x",           2.0,  0.0, -2.0);
+    check("3-x",          2.0,  0.0,  1.0);
+}
+
+
+
+// floor, ceil and round, including the sign of zero, ties and values from 2^52 on
+void test_rounding()
+{
+    check("floor(x)",    -0.5,  0.0, -1.0);
+    check("floor(x)",    -0.0,  0.0, -0.0);
+    check("floor(x)",     2.0,  0.0,  2.0);
+    check("ceil(x)",     -0.5,  0.0, -0.0);
+    check("ceil(x)",      0.5,  0.0,  1.0);
+    check("ceil(x)",     -2.0,  0.0, -2.0);
+    check("round(x)",     2.5,  0.0,  2.0);
+    check("round(x)",    -0.5,  0.0, -0.0);
+    check("floor(x)", 4503599627370497.0, 0.0, 4503599627370497.0);
+    check("floor(x)",    inf_,  0.0,  inf_);
+    check("ceil(x)",    -inf_,  0.0, -inf_);
+}
+
+
+// log(x^k) is k*log(abs(x)) only for k other than 0
+void test_log_of_power()
+{
+    check("log(x^0)",     0.0,  0.0,  0.0);
+    check("log(x^0)",    inf_,  0.0,  0.0);
+    check("log(x^0)",   -inf_,  0.0,  0.0);
+    check("ln(x^0)",     nan_,  0.0,  0.0);
+    check("log(x^2)",    -2.0,  0.0,  std::log(4.0));
+    check("log(x^-1)",    1.0,  0.0,  0.0);
+}
+
+
+// Equal within a relative error of tol, or both NaN, and of the same sign
+bool close(double a, double b, double tol)
+{
+    if (std::isnan(a) || std::isnan(b)) {
+        return std::isnan(a) && std::isnan(b);
+    }
+    if (std::signbit(a) != std::signbit(b)) {
+        return false;
+    }
+    return a == b || std::fabs(a - b) <= tol * std::fabs(b);
+}
+
+
+// exp(x)*exp(y) is merged into exp(x+y) with fast math only: without it, exp(710) overflows a
+// double on SSE2/AVX (the x87 registers have a wider range)
+void test_exponentials()
+{
+    for (auto b : backends()) {
+        if (b == mexce::backend::x87) {
+            continue;
+        }
+        for (bool fast_math : { false, true }) {
+            double x = 710, y = -10;
+            mexce::evaluator ev;
+            ev.bind(x, "x", y, "y");
+            ev.set_backend(b);
+            ev.set_fast_math(fast_math);
+            ev.set_expression("exp(x)*exp(y)");
+            double r = ev.evaluate();
+            if (fast_math ? !close(r, std::exp(700.0), 1e-13) : r != inf_) {
+                printf("FAILED: exp(x)*exp(y) at x = 710, y = -10 on %s%s: %g\n",
+                    backend_name(b), fast_math ? " with fast math" : "", r);
+                failures++;
+            }
+        }
+    }
+}
+
+
+// A constant exponent that is compiled to square roots and multiplications gives the result of
+// the generic pow with the same exponent in a variable, for negative and zero bases too
+void test_pow_constant_exponent()
+{
+    for (auto b : backends())
+    for (auto a : { mexce::accuracy::standard, mexce::accuracy::fast, mexce::accuracy::precise })
+    for (string e : { "2.25", "1.5", "0.5", "-0.5", "-1.25", "0.25", "3", "-3", "10", "100", "-101", "257", "1000" })
+    for (double v : { -2.0, -0.7, 0.0, -0.0, 0.7, 2.0, -1e-310 }) {
+        double x = v, y = std::stod(e);
+        mexce::evaluator ev, generic;
+        ev.bind(x, "x");
+        generic.bind(x, "x", y, "y");
+        ev.set_backend(b);
+        generic.set_backend(b);
+        ev.set_accuracy(a);
+        generic.set_accuracy(a);
+        ev.set_expression("x^" + e);
+        generic.set_expression("x^y");
+        double r = ev.evaluate(), expected = generic.evaluate();
+        if (!close(r, expected, a == mexce::accuracy::fast ? 1e-12 : 1e-15)) {
+            printf("FAILED: x^%s at x = %g on %s: %.17g, x^y gives %.17g\n",
+                e.c_str(), v, backend_name(b), r, expected);
+            failures++;
+        }
+    }
+    for (auto b : backends()) {
+        double y = 5.0;
+        mexce::evaluator ev;
+        ev.bind(y, "y");
+        ev.set_backend(b);
+        ev.set_expression("(pi-y)^min(e,2.25)");
+        double r = ev.evaluate();
+        if (!close(r, -std::pow(5.0 - M_PI, 2.25), 1e-15)) {
+            printf("FAILED: (pi-y)^min(e,2.25) at y = 5 on %s: %.17g\n", backend_name(b), r);
+            failures++;
+        }
+    }
+}
+
+
+// The error of pow with integer and half-integer exponents, constant and variable, is within
+// 1 ULP of the standard tier, against powl
+void test_pow_accuracy()
+{
+    for (auto b : backends())
+    for (string e : { "3", "7", "-7", "25", "200", "1.5", "2.25", "-0.5", "y" }) {
+        double x = 0, y = 37;
+        mexce::evaluator ev;
+        ev.bind(x, "x", y, "y");
+        ev.set_backend(b);
+        ev.set_expression("x^" + e);
+        double n = e == "y" ? y : std::stod(e), worst = 0;
+        for (int i = 0; i < 1000; i++) {
+            x = std::exp((i - 500) * 1.3 / std::max(std::fabs(n), 1.0));
+            long double expected = std::pow((long double)x, (long double)n);
+            double ulp = std::nextafter((double)expected, inf_) - (double)expected;
+            worst = std::max(worst, (double)(std::fabs(ev.evaluate() - expected) / ulp));
+        }
+        if (worst > 1.0) {
+            printf("FAILED: x^%s on %s: error of %.2f ULP\n", e.c_str(), backend_name(b), worst);
+            failures++;
+        }
+    }
+}
+
+
+// Each row of a batch gives the result of evaluate() for it, on every backend and accuracy tier
+void check_batch_rows(const string& expression, const vector<double>& xs, const vector<double>& ys)
+{
+    for (auto b : backends())
+    for (auto a : { mexce::accuracy::standard, mexce::accuracy::fast, mexce::accuracy::precise }) {
+        double x = 0, y = 0;
+        mexce::evaluator ev;
+        ev.bind(x, "x", y, "y");
+        ev.set_backend(b);
+        ev.set_accuracy(a);
+        ev.set_expression(expression);
+        vector<double> out(xs.size());
+        ev.evaluate_batch(xs.size(), { { "x", xs.data() }, { "y", ys.data() } }, out.data());
+        for (size_t i = 0; i < xs.size(); i++) {
+            x = xs[i];
+            y = ys[i];
+            double expected = ev.evaluate();
+            if (!same(out[i], expected)) {
+                printf("FAILED: batch of %s at x = %g, y = %g on %s: %.17g, evaluate() gives %.17g\n",
+                    expression.c_str(), xs[i], ys[i], backend_name(b), out[i], expected);
+                failures++;
+            }
+        }
+    }
+}
+
+
+// The result of a row does not depend on the rows next to it, e.g. 5^3 next to 5^3.5, e^8 next
+// to e^8.5, or tan(1) next to tan(1e7), whose argument the SIMD code cannot reduce
+void test_batch_rows()
+{
+    vector<double> xs, ys;
+    for (double v : { 5.0, M_E, -2.0, 0.0, 0.7, -1e-310, 1e10 })
+    for (double e : { 3.0, 8.0, 3.5, -3.0, 0.0, 64.0, -0.5, nan_, 63.0, 2.0, -7.0, 1e10 }) {
+        xs.push_back(v);
+        ys.push_back(e);
+    }
+    check_batch_rows("x^y", xs, ys);
+
+    xs.clear();
+    for (double v : { 1.0, 1e7, -2.5, 1e300, 0.1, -1e7, 3e6, 1e6, -0.0, inf_, 100.0, nan_, 1048576.0, 0.5 }) {
+        xs.push_back(v);
+    }
+    ys.assign(xs.size(), 0.0);
+    for (string f : { "sin(x)", "cos(x)", "tan(x)", "sin(x)+cos(x)", "cos(x)*sin(x)" }) {
+        check_batch_rows(f, xs, ys);
+    }
+
+    // the functions that the SIMD code computes, and those that it bridges to the x87 code
+    xs.clear();
+    ys.clear();
+    for (int i = 0; i < 37; i++) {
+        xs.push_back((i - 18) * 0.37);
+        ys.push_back(i % 5 ? std::exp(i * 0.3 - 5) : -(i * 0.25));
+    }
+    for (string f : { "exp(x)+ln(y)", "log2(y)*log10(y)+logb(y,x+5)", "sqrt(abs(x*y))/(x-y)",
+        "floor(x*y)+ceil(x-y)+round(x+y)+int(x)", "max(x,y)-min(x,y)+abs(x)", "(x<y)+bnd(x,y)+sign(x)",
+        "mod(x,y)+ylog2(x,y)", "sin(x)*cos(y)+tan(x*y)", "x^3+y^-2+abs(y)^0.5", "neg(x)*y+x*y+x*y*x" })
+    {
+        check_batch_rows(f, xs, ys);
+    }
+}
+
+
+// Columns of every type, contiguous and with a stride, also a negative one, give the rows of
+// evaluate() for any number of rows, whether it fills the vectors of the batch loop or leaves
+// a tail, which is computed without writing past out[n - 1]
+void test_batch_columns()
+{
+    struct Row { double x; float f; int32_t i; int16_t s; int64_t l; };
+    const double sentinel = 12345.0;
+
+    for (auto b : backends())
+    for (size_t n = 0; n <= 67; n += n < 20 ? 1 : 47) {
+        vector<Row> rows(n);
+        vector<double> xs(n);
+        vector<float> fs(n);
+        vector<int32_t> is(n);
+        for (size_t r = 0; r < n; r++) {
+            rows[r] = { r * 0.5 - 3, r + 0.25f, int32_t(r * 7) - 40, int16_t(100 - r), int64_t(r) << 40 };
+            xs[r] = rows[r].x;
+            fs[r] = rows[r].f;
+            is[r] = rows[r].i;
+        }
+
+        double x = 0; float f = 0; int32_t i = 0; int16_t s = 0; int64_t l = 0;
+        mexce::evaluator ev;
+        ev.bind(x, "x", f, "f", i, "i", s, "s", l, "l");
+        ev.set_backend(b);
+        ev.set_expression("x*f+i-s+l/4096+sin(x)");
+
+        vector<double> strided(n + 9, sentinel), contiguous(n + 9, sentinel), reversed(n + 9, sentinel);
+        const Row* r0 = rows.data();
+        ev.evaluate_batch(n, { { "x", &r0->x, sizeof(Row) }, { "f", &r0->f, sizeof(Row) },
+            { "i", &r0->i, sizeof(Row) }, { "s", &r0->s, sizeof(Row) }, { "l", &r0->l, sizeof(Row) } },
+            strided.data());
+        ev.evaluate_batch(n, { { "x", xs.data() }, { "f", fs.data() }, { "i", is.data() },
+            { "s", &r0->s, sizeof(Row) }, { "l", &r0->l, sizeof(Row) } }, contiguous.data());
+        if (n > 0) {
+            const Row* last = &rows[n - 1];
+            const ptrdiff_t back = -(ptrdiff_t)sizeof(Row);
+            ev.evaluate_batch(n, { { "x", &xs[n - 1], -(ptrdiff_t)sizeof(double) },
+                { "f", &fs[n - 1], -(ptrdiff_t)sizeof(float) }, { "i", &last->i, back },
+                { "s", &last->s, back }, { "l", &last->l, back } }, reversed.data());
+        }
+
+        vector<double> expected(n + 9, sentinel);
+        for (size_t r = 0; r < n; r++) {
+            x = rows[r].x; f = rows[r].f; i = rows[r].i; s = rows[r].s; l = rows[r].l;
+            expected[r] = ev.evaluate();
+        }
+        for (size_t r = 0; r < n + 9; r++) {
+            double expected_reversed = r < n ? expected[n - 1 - r] : sentinel;
+            if (!same(strided[r], expected[r]) || !same(contiguous[r], expected[r]) ||
+                !same(reversed[r], expected_reversed))
+            {
+                printf("FAILED: row %zu of %zu of the columns on %s: %.17g (strided), %.17g (contiguous), "
+                    "%.17g (reversed), expected %.17g and %.17g\n", r, n, backend_name(b), strided[r],
+                    contiguous[r], reversed[r], expected[r], expected_reversed);
+                failures++;
+            }
+        }
+    }
+}
+
+
+// Members bound by their offset are read from the context of evaluate_in, and from each record
+// of a batch, next to a variable bound by reference
+void test_context()
+{
+    struct Record { double price; float qty; int32_t lots; int16_t level; };
+
+    for (auto b : backends()) {
+        vector<Record> records;
+        for (int r = 0; r < 19; r++) {
+            records.push_back({ r * 0.25, r + 0.5f, 3 - r, int16_t(r * 100) });
+        }
+        double k = 2;
+        mexce::evaluator ev;
+        ev.bind_member(&Record::price, "price");
+        ev.bind_member(&Record::qty, "qty");
+        ev.bind_member(&Record::lots, "lots");
+        ev.bind_offset<int16_t>(offsetof(Record, level), "level");
+        ev.bind(k, "k");
+        ev.set_backend(b);
+        ev.set_expression("price*qty+lots*k-level");
+
+        for (auto& r : records) {
+            double v = ev.evaluate_in(&r);
+            double expected = r.price * r.qty + r.lots * k - r.level;
+            if (v != expected) {
+                printf("FAILED: evaluate_in of price*qty+lots*k-level on %s: %g, expected %g\n",
+                    backend_name(b), v, expected);
+                failures++;
+            }
+        }
+
+        for (size_t n = 0; n <= records.size(); n++) {
+            vector<double> out(n + 1, -1.0);
+            ev.evaluate_batch(n, records.data(), sizeof(Record), out.data());
+            for (size_t r = 0; r < n + 1; r++) {
+                double expected = r < n ? ev.evaluate_in(&records[r]) : -1.0;
+                if (out[r] != expected) {
+                    printf("FAILED: record %zu of a batch of %zu on %s: %g, expected %g\n",
+                        r, n, backend_name(b), out[r], expected);
+                    failures++;
+                }
+            }
+        }
+
+        bool thrown = false;
+        try {
+            ev.evaluate();
+        }
+        catch (std::logic_error&) {
+            thrown = true;
+        }
+        if (!thrown) {
+            printf("FAILED: evaluate() of members bound at an offset on %s did not throw\n", backend_name(b));
+            failures++;
+        }
+    }
+}
+
+
+// Several expressions give the results of each one on its own, from evaluate(out), evaluate_in
+// and a batch, whose output has the rows of each expression one after the other
+void test_several_expressions()
+{
+    const vector<string> expressions = { "x*y+1", "sin(x)*y", "x*y+sin(x)", "cos(x)+y^3", "y" };
+    struct Point { double x, y; };
+
+    for (auto b : backends()) {
+        double x = 0, y = 0;
+        mexce::evaluator ev;
+        ev.bind(x, "x", y, "y");
+        ev.set_backend(b);
+        ev.set_expressions(expressions);
+
+        vector<mexce::evaluator> single(expressions.size());
+        for (size_t e = 0; e < expressions.size(); e++) {
+            single[e].bind(x, "x", y, "y");
+            single[e].set_backend(b);
+            single[e].set_expression(expressions[e]);
+        }
+
+        mexce::evaluator in_context;
+        in_context.bind_member(&Point::x, "x");
+        in_context.bind_member(&Point::y, "y");
+        in_context.set_backend(b);
+        in_context.set_expressions(expressions);
+
+        const size_t n = 13;
+        vector<double> xs, ys, batch(expressions.size() * n);
+        for (size_t r = 0; r < n; r++) {
+            xs.push_back(r * 0.7 - 4);
+            ys.push_back(r * 0.3 + 0.1);
+        }
+        ev.evaluate_batch(n, { { "x", xs.data() }, { "y", ys.data() } }, batch.data());
+
+        for (size_t r = 0; r < n; r++) {
+            x = xs[r];
+            y = ys[r];
+            Point p = { x, y };
+            vector<double> out(expressions.size()), out_in(expressions.size());
+            ev.evaluate(out.data());
+            in_context.evaluate_in(&p, out_in.data());
+            for (size_t e = 0; e < expressions.size(); e++) {
+                double expected = single[e].evaluate();
+                if (!same(out[e], expected) || !same(out_in[e], expected) || !same(batch[e * n + r], expected)) {
+                    printf("FAILED: %s of several at x = %g, y = %g on %s: %.17g, %.17g in context, "
+                        "%.17g in a batch, expected %.17g\n", expressions[e].c_str(), x, y, backend_name(b),
+                        out[e], out_in[e], batch[e * n + r], expected);
+                    failures++;
+                }
+            }
+        }
+
+        bool thrown = false;
+        try {
+            ev.evaluate();
+        }
+        catch (std::logic_error&) {
+            thrown = true;
+        }
+        if (!thrown) {
+            printf("FAILED: evaluate() of several expressions on %s did not throw\n", backend_name(b));
+            failures++;
+        }
+    }
+}
+
+
+// An expression that does not compile leaves the previous one in place, which the setters
+// of the evaluator then recompile
+void test_failed_expression()
+{
+    for (auto b : backends()) {
+        double x = 3;
+        mexce::evaluator ev;
+        ev.bind(x, "x");
+        ev.set_backend(b);
+        ev.set_expression("x*2");
+        bool thrown = false;
+        try {
+            ev.set_expression("x+");
+        }
+        catch (std::exception&) {
+            thrown = true;
+        }
+        try {
+            ev.set_backend(b);
+            ev.set_accuracy(mexce::accuracy::fast);
+            ev.set_fast_math(true);
+            if (!thrown || ev.evaluate() != 6) {
+                printf("FAILED: x*2 after x+ on %s: %g\n", backend_name(b), ev.evaluate());
+                failures++;
+            }
+        }
+        catch (std::exception& e) {
+            printf("FAILED: the setters after x+ on %s threw: %s\n", backend_name(b), e.what());
+            failures++;
+        }
+    }
+}
+
+
+// var of a variable of the block returns it for the same type, and throws for another one
+void test_var()
+{
+    mexce::evaluator ev;
+    double& x = ev.var<double>("x");
+    x = 2.0;
+    if (&ev.var<double>("x") != &x) {
+        printf("FAILED: var<double> of x did not return x\n");
+        failures++;
+    }
+    bool thrown = false;
+    try {
+        ev.var<float>("x");
+    }
+    catch (std::logic_error&) {
+        thrown = true;
+    }
+    ev.set_expression("x+1");
+    if (!thrown || ev.evaluate() != 3.0) {
+        printf("FAILED: var<float> of the double x did not throw\n");
+        failures++;
+    }
+
+    // a one-off evaluation reads the block, and keeps the settings of the evaluator
+    for (auto b : backends()) {
+        mexce::evaluator e;
+        e.var<double>("x") = 1e200;
+        e.set_backend(b);
+        e.set_fast_math(true);
+        double r = e.evaluate("x/2");
+        double s = e.evaluate("sqrt(x*x)");     // abs(x) with fast math, otherwise inf
+        if (r != 5e199 || s != 1e200) {
+            printf("FAILED: evaluate(\"x/2\"), evaluate(\"sqrt(x*x)\") of var x on %s: %g, %g\n",
+                backend_name(b), r, s);
+            failures++;
+        }
+    }
+}
+
+
+// The errors of the functions are within those of the table in README.md for each accuracy
+// tier, against the long double functions: about 1e-13 relative with fast, and 1 ULP for the
+// x87 instructions, which precise takes except for sin, cos and tan (those of the x87 backend,
+// which reduce the argument with a 66-bit pi, are only checked with fast)
+void test_accuracy_tiers()
+{
+    struct Function { string expression; double standard_ulp; bool trigonometric;
+        long double (*f)(long double, long double); double lo, hi; };
+    const vector<Function> functions = {
+        { "sin(x)",   1.1, true,  [](long double x, long double) { return std::sin(x); },      -100, 100 },
+        { "cos(x)",   1.1, true,  [](long double x, long double) { return std::cos(x); },      -100, 100 },
+        { "tan(x)",   2.2, true,  [](long double x, long double) { return std::tan(x); },      -100, 100 },
+        { "exp(x)",   1.2, false, [](long double x, long double) { return std::exp(x); },      -700, 700 },
+        { "ln(y)",    0.8, false, [](long double, long double y) { return std::log(y); },      -700, 700 },
+        { "log2(y)",  1.7, false, [](long double, long double y) { return std::log2(y); },     -700, 700 },
+        { "log10(y)", 1.8, false, [](long double, long double y) { return std::log10(y); },    -700, 700 },
+        { "y^x",      1.1, false, [](long double x, long double y) { return std::pow(y, x); }, -3, 3 },
+    };
+
+    for (auto b : backends())
+    for (auto a : { mexce::accuracy::standard, mexce::accuracy::fast, mexce::accuracy::precise })
+    for (auto& fn : functions) {
+        bool x87_instructions = b == mexce::backend::x87 || (a == mexce::accuracy::precise && !fn.trigonometric);
+        if (b == mexce::backend::x87 && fn.trigonometric && a != mexce::accuracy::fast) {
+            continue;
+        }
+        double x = 0, y = 0;
+        mexce::evaluator ev;
+        ev.bind(x, "x", y, "y");
+        ev.set_backend(b);
+        ev.set_accuracy(a);
+        ev.set_expression(fn.expression);
+
+        double worst_ulp = 0, worst_relative = 0;
+        for (int i = 0; i <= 2000; i++) {
+            x = fn.lo + (fn.hi - fn.lo) * i / 2000 + 1e-3;
+            y = std::exp(x);
+            long double expected = fn.f(x, y);
+            double ulp = std::nextafter(std::fabs((double)expected), inf_) - std::fabs((double)expected);
+            double error = (double)std::fabs(ev.evaluate() - expected);
+            worst_ulp = std::max(worst_ulp, error / ulp);
+            worst_relative = std::max(worst_relative, (double)(error / std::fabs(expected)));
+        }
+        bool ok = a == mexce::accuracy::fast ? worst_relative <= 1e-12 :
+            worst_ulp <= (x87_instructions ? 1.0 : fn.standard_ulp);
+        if (!ok) {
+            printf("FAILED: %s on %s with the %s tier: error of %.2f ULP, %.3g relative\n",
+                fn.expression.c_str(), backend_name(b), a == mexce::accuracy::fast ? "fast" :
+                a == mexce::accuracy::standard ? "standard" : "precise", worst_ulp, worst_relative);
+            failures++;
+        }
+    }
+}
+
+
+// The SSE2 and AVX backends give the results of the x87 one within a relative error of 1e-13,
+// or 1e-12 with fast, on expressions of bench_expr_all_results.txt without cancellation (the
+// results differ by the roundings of the intermediate results to doubles, see README.md)
+void test_backends_agree()
+{
+    const vector<string> expressions = {
+        "a+b", "a*b+a/b", "(2+a*b)^5/(a/b+3)^3", "a^b/e*pi", "sqrt(a^2+b^2+1)", "sin(a)^2+cos(b)^2",
+        "exp(a/4)*ln(b+2)", "log2(a+5)*log10(b+5)", "logb(a+1,b+1)", "a^1.5+b^-2.25+(a*b)^0.5",
+        "6.6*a^5+5.5*a^4+4.4*a^3+3.3*a^2+2.2*a+1.1", "(((a*1.1+2.2)*a+3.3)*a+4.4)/(b+1)",
+        "sin(a)*cos(b)+sin(b)*cos(a)", "tan(a/3)*exp(-b)", "abs(a-b)^3+max(a,b)^e", "1/(1+exp(-a*b))",
+    };
+    const double points[][2] = { { 0.3, 0.7 }, { 1.1, 2.2 }, { 2.5, 0.45 }, { 3.7, 7.25 }, { 0.05, 12.5 } };
+
+    for (auto b : backends())
+    for (auto a : { mexce::accuracy::standard, mexce::accuracy::fast, mexce::accuracy::precise }) {
+        if (b == mexce::backend::x87) {
+            continue;
+        }
+        double va = 0, vb = 0;
+        mexce::evaluator x87, ev;
+        x87.bind(va, "a", vb, "b");
+        ev.bind(va, "a", vb, "b");
+        ev.set_backend(b);
+        ev.set_accuracy(a);
+        for (auto& e : expressions) {
+            x87.set_expression(e);
+            ev.set_expression(e);
+            for (auto& p : points) {
+                va = p[0];
+                vb = p[1];
+                double r = ev.evaluate(), expected = x87.evaluate();
+                if (!close(r, expected, a == mexce::accuracy::fast ? 1e-12 : 1e-13)) {
+                    printf("FAILED: %s at a = %g, b = %g on %s: %.17g, x87 gives %.17g\n",
+                        e.c_str(), va, vb, backend_name(b), r, expected);
+                    failures++;
+                }
+            }
+        }
+    }
+}
+
+
+// A sum of products of depth 10, with subtrees that repeat, needs more registers than any
+// backend has and computes each repeated subtree once. It gives the value of the same sums
+// and products in long double, with fast math too, and in a batch the rows of evaluate().
+// On x87, the peephole pass reuses the address of the spill area, and its counters are reset
+// with the next expression.
+string deep_sum_of_products(int depth, int& leaf, long double* value)
+{
+    if (depth == 0) {
+        leaf++;
+        if (leaf % 3 == 0) {
+            *value = 1.25;
+            return "x";
+        }
+        if (leaf % 3 == 1) {
+            *value = 0.75;
+            return "y";
+        }
+        string constant = std::to_string(1 + leaf * 0.001);
+        *value = std::stod(constant);
+        return constant;
+    }
+    long double a, b;
+    string sa = deep_sum_of_products(depth - 1, leaf, &a);
+    string sb = depth % 4 == 2 ? sa : deep_sum_of_products(depth - 1, leaf, &b);
+    if (depth % 4 == 2) {
+        b = a;
+    }
+    *value = depth % 2 ? a + b : a * b / 4;
+    return "(" + sa + (depth % 2 ? "+" : "*") + sb + (depth % 2 ? ")" : "/4)");
+}
+
+
+void test_deep_expressions()
+{
+    int leaf = 0;
+    long double value;
+    const string expression = deep_sum_of_products(10, leaf, &value);
+
+    for (auto b : backends())
+    for (bool fast_math : { false, true }) {
+        double x = 1.25, y = 0.75;
+        mexce::evaluator ev;
+        ev.bind(x, "x", y, "y");
+        ev.set_backend(b);
+        ev.set_fast_math(fast_math);
+        ev.set_expression(expression);
+        double r = ev.evaluate();
+        if (!close(r, (double)value, 1e-13)) {
+            printf("FAILED: the sum of products of depth 10 on %s%s: %.17g, expected %.17g\n",
+                backend_name(b), fast_math ? " with fast math" : "", r, (double)value);
+            failures++;
+        }
+
+        if (b == mexce::backend::x87 && !fast_math) {
+            auto& c = ev.get_peephole_counters();
+            size_t reused = c.addresses_reused;
+            ev.set_expression("x+y");
+            size_t total = c.loads_discarded + c.copies_folded + c.exchanges_removed +
+                c.addresses_reused + c.stores_forwarded;
+            if (reused == 0 || total != 0) {
+                printf("FAILED: peephole counters of the sum of products, then of x+y: %zu, %zu\n",
+                    reused, total);
+                failures++;
+            }
+        }
+    }
+    check_batch_rows(expression, { 1.25, 0.5, 1.0, 1.125, 0.75 }, { 0.75, 0.5, 1.0, 0.875, 1.25 });
+}
+
+}
+
+
+int main()
+{
+    test_min_max();
+    test_unary_minus();
+    test_rounding();
+    test_log_of_power();
+    test_exponentials();
+    test_pow_constant_exponent();
+    test_pow_accuracy();
+    test_batch_rows();
+    test_batch_columns();
+    test_context();
+    test_several_expressions();
+    test_failed_expression();
+    test_var();
+    test_accuracy_tiers();
+    test_backends_agree();
+    test_deep_expressions();
+
+    if (!failures) {
+        printf("All checks passed\n");
+    }
+    return failures;
+}